@@ -0,0 +1,259 @@
+#pragma once
+
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace termctl {
+namespace detail {
+inline double parse_number(std::string_view str, std::string_view &suffix) {
+  const auto s = std::string(str);
+  auto pos = std::size_t(0);
+  double val;
+  try {
+    val = std::stod(s, &pos);
+  } catch (const std::logic_error &) {
+    throw std::invalid_argument("invalid number \"" + s + "\"");
+  }
+
+  if (!std::isfinite(val))
+    throw std::invalid_argument("invalid number \"" + s + "\"");
+
+  suffix = str.substr(pos);
+  return val;
+}
+
+inline bool iequals(std::string_view a, std::string_view b) noexcept {
+  if (a.size() != b.size())
+    return false;
+  for (std::size_t i = 0; i < a.size(); ++i)
+    if (std::tolower(static_cast<unsigned char>(a[i])) !=
+        std::tolower(static_cast<unsigned char>(b[i])))
+      return false;
+  return true;
+}
+} // namespace detail
+
+// Parses durations like "50ms", "1.5s", "200us" or "2min", a bare number is
+// taken in units of 'Unit'.
+template <typename Unit = std::chrono::seconds>
+std::chrono::nanoseconds parse_duration(std::string_view str) {
+  auto suffix = std::string_view();
+  const auto val = detail::parse_number(str, suffix);
+  if (val < 0)
+    throw std::invalid_argument("negative duration \"" + std::string(str) +
+                                "\"");
+
+  auto scale = 0.0;
+  if (suffix.empty())
+    scale = std::chrono::duration<double, typename Unit::period>(1) /
+            std::chrono::duration<double, std::nano>(1);
+  else if (suffix == "ns")
+    scale = 1.0;
+  else if (suffix == "us")
+    scale = 1e3;
+  else if (suffix == "ms")
+    scale = 1e6;
+  else if (suffix == "s")
+    scale = 1e9;
+  else if (suffix == "m" || suffix == "min")
+    scale = 60e9;
+  else if (suffix == "h")
+    scale = 3600e9;
+  else
+    throw std::invalid_argument("invalid duration \"" + std::string(str) +
+                                "\"");
+
+  return std::chrono::nanoseconds(std::llround(val * scale));
+}
+
+// The highest rate parse_rate() accepts, in Hz.
+inline constexpr double max_rate = 1e6;
+
+// Parses rates like "100Hz" or "1kHz" into Hz, a bare number is taken as Hz.
+inline double parse_rate(std::string_view str) {
+  auto suffix = std::string_view();
+  const auto val = detail::parse_number(str, suffix);
+  auto scale = 0.0;
+  if (suffix.empty() || detail::iequals(suffix, "hz"))
+    scale = 1.0;
+  else if (detail::iequals(suffix, "khz"))
+    scale = 1e3;
+  else
+    throw std::invalid_argument("invalid rate \"" + std::string(str) + "\"");
+
+  if (val <= 0)
+    throw std::invalid_argument("rate must be positive \"" +
+                                std::string(str) + "\"");
+  if (val * scale > max_rate)
+    throw std::invalid_argument("rate must be at most 1MHz \"" +
+                                std::string(str) + "\"");
+  return val * scale;
+}
+
+// Parses a count like "3", rejecting fractions, negatives and trailing text.
+inline std::size_t parse_count(std::string_view str) {
+  auto suffix = std::string_view();
+  const auto val = detail::parse_number(str, suffix);
+  if (!suffix.empty() || val < 0 || val != std::floor(val) || val > 1e15)
+    throw std::invalid_argument("invalid count \"" + std::string(str) +
+                                "\"");
+  return std::size_t(val);
+}
+
+// Matches 'text' against a shell-style pattern of '*' and '?'.
+inline bool glob_match(std::string_view pattern,
+                       std::string_view text) noexcept {
+  auto p = std::size_t(0), t = std::size_t(0);
+  auto star = std::string_view::npos, mark = std::size_t(0);
+  while (t < text.size())
+    if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == text[t])) {
+      ++p;
+      ++t;
+    } else if (p < pattern.size() && pattern[p] == '*') {
+      star = p++;
+      mark = t;
+    } else if (star != std::string_view::npos) {
+      p = star + 1;
+      t = ++mark;
+    } else {
+      return false;
+    }
+
+  while (p < pattern.size() && pattern[p] == '*')
+    ++p;
+  return p == pattern.size();
+}
+
+// Splits a command line on blanks. Double or single quotes keep blanks
+// inside one argument and are removed, so 'trigger="Temp > 50"' becomes
+// "trigger=Temp > 50".
+inline std::vector<std::string> split_args(std::string_view line) {
+  auto args = std::vector<std::string>();
+  auto arg = std::string();
+  auto quote = '\0';
+  auto in_arg = false;
+  for (const auto c : line) {
+    if (quote != '\0') {
+      if (c == quote)
+        quote = '\0';
+      else
+        arg += c;
+    } else if (c == '"' || c == '\'') {
+      quote = c;
+      in_arg = true;
+    } else if (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      if (in_arg)
+        args.push_back(std::exchange(arg, {}));
+      in_arg = false;
+    } else {
+      arg += c;
+      in_arg = true;
+    }
+  }
+
+  if (quote != '\0')
+    throw std::invalid_argument("unterminated quote");
+  if (in_arg)
+    args.push_back(std::move(arg));
+  return args;
+}
+
+// Splits a comma separated list, dropping empty elements.
+inline std::vector<std::string> split_list(std::string_view str) {
+  auto vec = std::vector<std::string>();
+  while (!str.empty()) {
+    const auto pos = str.find(',');
+    if (auto elem = str.substr(0, pos); !elem.empty())
+      vec.emplace_back(elem);
+    str = pos == std::string_view::npos ? std::string_view()
+                                        : str.substr(pos + 1);
+  }
+  return vec;
+}
+
+// Splits command arguments into positional ones and 'key=value' options.
+class options final {
+public:
+  using values_type = std::unordered_map<std::string, std::string>;
+  using positional_type = std::vector<std::string>;
+
+  options() = default;
+  explicit options(const std::vector<std::string> &args) {
+    for (const auto &arg : args)
+      if (auto pos = arg.find('=');
+          pos != std::string::npos && is_key(arg, pos))
+        values_[arg.substr(0, pos)] = arg.substr(pos + 1);
+      else
+        positional_.push_back(arg);
+  }
+
+  const positional_type &positional() const noexcept { return positional_; }
+  bool has(const std::string &key) const { return values_.count(key) != 0; }
+
+  std::string get(const std::string &key, const std::string &def = {}) const {
+    if (auto it = values_.find(key); it != values_.cend())
+      return it->second;
+    return def;
+  }
+
+  double get_double(const std::string &key, double def) const {
+    if (auto it = values_.find(key); it != values_.cend()) {
+      auto suffix = std::string_view();
+      const auto val = detail::parse_number(it->second, suffix);
+      if (!suffix.empty())
+        throw std::invalid_argument("invalid number for '" + key + "'");
+      return val;
+    }
+    return def;
+  }
+
+  template <typename Unit = std::chrono::seconds>
+  std::chrono::nanoseconds get_duration(const std::string &key,
+                                        std::chrono::nanoseconds def) const {
+    if (auto it = values_.find(key); it != values_.cend())
+      return parse_duration<Unit>(it->second);
+    return def;
+  }
+
+  double get_rate(const std::string &key, double def) const {
+    if (auto it = values_.find(key); it != values_.cend())
+      return parse_rate(it->second);
+    return def;
+  }
+
+  // Rejects any option not listed, so typos do not pass silently.
+  void expect_only(std::initializer_list<std::string_view> keys) const {
+    for (const auto &[key, val] : values_) {
+      auto known = false;
+      for (const auto k : keys)
+        known = known || key == k;
+      if (!known)
+        throw std::invalid_argument("unknown option '" + key + "'");
+    }
+  }
+
+private:
+  // Only identifiers make keys, so operators like "<=" stay positional.
+  static bool is_key(const std::string &arg, std::size_t len) noexcept {
+    if (len == 0 || std::isdigit(static_cast<unsigned char>(arg[0])))
+      return false;
+    for (std::size_t i = 0; i < len; ++i)
+      if (!std::isalnum(static_cast<unsigned char>(arg[i])) && arg[i] != '_' &&
+          arg[i] != '-')
+        return false;
+    return true;
+  }
+
+  values_type values_;
+  positional_type positional_;
+};
+} // namespace termctl
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "channel.hpp"
+#include "condition.hpp"
+#include "console.hpp"
+#include "jobs.hpp"
+#include "ring.hpp"
+#include "task.hpp"
+
+namespace ctf_io {
+struct capture_options {
+  condition trigger;
+  std::chrono::nanoseconds pre = std::chrono::seconds(1);
+  std::chrono::nanoseconds post = std::chrono::seconds(1);
+  double rate = 1000.0;
+  // Captures to take before returning, zero to run until stopped.
+  std::size_t count = 1;
+  // Each capture is written to "<prefix>-<n>.csv".
+  std::string prefix;
+};
+
+// Samples items into a ring of the last pre + post ticks, like an
+// oscilloscope in normal mode: when the trigger condition becomes true, 'post'
+// more ticks are taken and the window is handed to a writer thread, while
+// sampling goes on into a spare ring. The trigger costs one comparison per
+// tick. Sampling runs on the calling job's thread.
+class capture final {
+public:
+  using clock_type = std::chrono::steady_clock;
+
+  capture(std::vector<channel> &&chs, const capture_options &opts);
+  ~capture() { stop_writer(); }
+
+  capture(const capture &) = delete;
+  capture &operator=(const capture &) = delete;
+
+  void run();
+  void report(std::ostream &os) const;
+
+private:
+  // The last 'size' ticks, one row of every item per tick. Only the sampler
+  // touches a frame until it is handed over, so no field needs a lock.
+  struct frame {
+    std::vector<std::int64_t> t;
+    std::vector<double> values;
+    std::size_t head = 0;
+    std::size_t filled = 0;
+    std::int64_t trigger_t = 0;
+    std::size_t number = 0;
+    // Set by the writer.
+    std::filesystem::path file;
+    std::string error;
+  };
+
+  // Frames in flight beyond the one being filled.
+  static constexpr std::size_t spare_frames = 2;
+
+  bool sample(frame &f, std::int64_t t);
+  void freeze();
+  void collect();
+  void run_writer();
+  void write(frame &f) const;
+  void stop_writer();
+
+  std::vector<channel> channels_;
+  std::size_t trigger_column_ = 0;
+  capture_options opts_;
+  clock_type::duration period_;
+  std::size_t pre_ticks_ = 0;
+  std::size_t post_ticks_ = 0;
+  std::size_t size_ = 0;
+
+  std::unique_ptr<frame> current_;
+  std::vector<std::unique_ptr<frame>> spares_;
+  spsc_ring<frame *> full_{spare_frames + 1};
+  spsc_ring<frame *> done_{spare_frames + 1};
+  std::mutex writer_mutex_;
+  std::condition_variable writer_cv_;
+  bool writer_stop_ = false;
+  std::thread writer_;
+
+  runtime::deadline_stats stats_;
+  std::size_t triggers_ = 0;
+  std::size_t written_ = 0;
+  std::size_t skipped_ = 0;
+  std::size_t failed_ = 0;
+  bool stopped_ = false;
+  clock_type::duration elapsed_{};
+};
+
+inline capture::capture(std::vector<channel> &&chs,
+                        const capture_options &opts)
+    : channels_(std::move(chs)), opts_(opts),
+      period_(runtime::rate_period(opts.rate)) {
+  auto it = std::find_if(channels_.begin(), channels_.end(),
+                         [&](const channel &ch) {
+                           return ch.name() == opts_.trigger.item;
+                         });
+  if (it == channels_.end())
+    throw std::invalid_argument("the trigger item \"" + opts_.trigger.item +
+                                "\" is not captured");
+  trigger_column_ = std::size_t(it - channels_.begin());
+
+  const auto ticks = [this](std::chrono::nanoseconds d) {
+    return std::size_t(std::llround(std::chrono::duration<double>(d).count() *
+                                    opts_.rate));
+  };
+  pre_ticks_ = ticks(opts_.pre);
+  post_ticks_ = ticks(opts_.post);
+  size_ = pre_ticks_ + 1 + post_ticks_;
+  if (size_ * channels_.size() > (std::size_t(1) << 27))
+    throw std::invalid_argument("the capture window is too large");
+
+  for (std::size_t i = 0; i <= spare_frames; ++i) {
+    auto f = std::make_unique<frame>();
+    f->t.resize(size_);
+    f->values.resize(size_ * channels_.size());
+    spares_.push_back(std::move(f));
+  }
+  current_ = std::move(spares_.back());
+  spares_.pop_back();
+  writer_ = std::thread(&capture::run_writer, this);
+}
+
+inline bool capture::sample(frame &f, std::int64_t t) {
+  const auto n = channels_.size();
+  auto *row = &f.values[f.head * n];
+  auto ok = true;
+  for (std::size_t i = 0; i < n; ++i)
+    if (const auto v = channels_[i].read_double(); v)
+      row[i] = *v;
+    else {
+      row[i] = std::numeric_limits<double>::quiet_NaN();
+      ok = false;
+    }
+  f.t[f.head] = t;
+  f.head = (f.head + 1) % size_;
+  f.filled = std::min(f.filled + 1, size_);
+  return ok;
+}
+
+// Hands the current frame to the writer and goes on in a spare one.
+inline void capture::freeze() {
+  if (spares_.empty()) {
+    // The writer is behind, this window is lost but sampling goes on.
+    ++skipped_;
+    current_->head = current_->filled = 0;
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    full_.push(std::exchange(current_, std::move(spares_.back())).release());
+  }
+  writer_cv_.notify_all();
+  spares_.pop_back();
+  current_->head = current_->filled = 0;
+}
+
+// Takes back frames the writer is done with and reports them.
+inline void capture::collect() {
+  done_.drain([this](frame *p) {
+    auto f = std::unique_ptr<frame>(p);
+    if (f->error.empty()) {
+      ++written_;
+      termctl::out() << "[OK][capture][" << f->file.string() << "] "
+                     << f->filled << " ticks of " << channels_.size()
+                     << " items" << std::endl;
+    } else {
+      ++failed_;
+      termctl::err() << "[FAIL][capture][" << f->file.string() << "] "
+                     << f->error << std::endl;
+      termctl::mark_failed();
+    }
+    spares_.push_back(std::move(f));
+  });
+}
+
+inline void capture::run() {
+  const auto period = period_;
+  const auto start = clock_type::now();
+  // The trigger fires on the tick its condition becomes true, so a level
+  // already reached at the start waits for the next crossing.
+  auto previous = true;
+  auto remaining = std::size_t(0);
+  auto triggered = false;
+
+  for (std::int64_t k = 0;; ++k) {
+    collect();
+    if (opts_.count && written_ + failed_ + skipped_ >= opts_.count)
+      break;
+
+    auto deadline = start + period * k;
+    if (!termctl::this_job::sleep_until(deadline)) {
+      stopped_ = true;
+      break;
+    }
+    auto lateness = clock_type::now() - deadline;
+    if (lateness >= period) {
+      const auto skipped = lateness / period;
+      stats_.miss(std::uint64_t(skipped));
+      k += skipped;
+      deadline += period * skipped;
+      lateness -= period * skipped;
+    }
+
+    const auto t =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - start)
+            .count();
+    auto &f = *current_;
+    stats_.record(lateness, sample(f, t));
+
+    const auto v =
+        f.values[((f.head + size_ - 1) % size_) * channels_.size() +
+                 trigger_column_];
+    const auto holds = !std::isnan(v) && opts_.trigger.eval(v);
+    if (triggered) {
+      if (--remaining == 0) {
+        triggered = false;
+        freeze();
+      }
+    } else if (holds && !previous && f.filled > pre_ticks_ &&
+               (!opts_.count || triggers_ < opts_.count)) {
+      // A fresh frame re-arms once it holds a full pre-trigger window.
+      triggered = true;
+      ++triggers_;
+      f.trigger_t = t;
+      f.number = triggers_;
+      remaining = post_ticks_;
+      if (remaining == 0) {
+        triggered = false;
+        freeze();
+      }
+    }
+    previous = holds;
+  }
+
+  elapsed_ = clock_type::now() - start;
+  stop_writer();
+  collect();
+}
+
+inline void capture::run_writer() {
+  for (;;) {
+    {
+      std::unique_lock<std::mutex> lock(writer_mutex_);
+      writer_cv_.wait(lock,
+                      [this] { return writer_stop_ || full_.size() > 0; });
+      if (full_.size() == 0)
+        return;
+    }
+    full_.drain([this](frame *f) {
+      try {
+        write(*f);
+      } catch (const std::exception &e) {
+        f->error = e.what();
+      }
+      done_.push(f);
+    });
+  }
+}
+
+inline void capture::write(frame &f) const {
+  f.file = opts_.prefix + "-" + std::to_string(f.number) + ".csv";
+  auto os = std::ofstream(f.file);
+  if (!os)
+    throw std::runtime_error("could not open the file");
+
+  // Rows from the oldest, timestamped relative to the trigger.
+  const auto n = channels_.size();
+  auto line = std::string("t");
+  for (const auto &ch : channels_)
+    line += "," + ch.name();
+  os << line << "\n";
+
+  char buf[32];
+  const auto first = (f.head + size_ - f.filled) % size_;
+  for (std::size_t r = 0; r < f.filled; ++r) {
+    const auto row = (first + r) % size_;
+    const auto rel = double(f.t[row] - f.trigger_t) / 1e9;
+    line.assign(buf, std::to_chars(buf, buf + sizeof(buf), rel,
+                                   std::chars_format::fixed, 6)
+                         .ptr);
+    for (std::size_t i = 0; i < n; ++i) {
+      line += ',';
+      if (const auto v = f.values[row * n + i]; !std::isnan(v))
+        line.append(buf, std::to_chars(buf, buf + sizeof(buf), v).ptr);
+    }
+    os << line << "\n";
+  }
+
+  if (!os.flush())
+    throw std::runtime_error("could not write the file");
+}
+
+inline void capture::stop_writer() {
+  {
+    std::lock_guard<std::mutex> lock(writer_mutex_);
+    writer_stop_ = true;
+  }
+  writer_cv_.notify_all();
+  if (writer_.joinable())
+    writer_.join();
+}
+
+inline void capture::report(std::ostream &os) const {
+  const auto flags = os.flags();
+  const auto precision = os.precision();
+  os << "[" << (stopped_ ? "STOP" : failed_ ? "FAIL" : "OK") << "][capture]["
+     << opts_.trigger << "] " << written_ << " of " << triggers_
+     << " triggers written";
+  stats_.print(os, std::chrono::duration<double>(elapsed_).count());
+  os << "[skipped: " << skipped_ << "]";
+  os.flags(flags);
+  os.precision(precision);
+}
+} // namespace ctf_io
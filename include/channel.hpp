@@ -0,0 +1,132 @@
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <variant>
+
+#include "conf_parser.hpp"
+#include "fault.hpp"
+#include "variant.hpp"
+
+namespace ctf_io {
+// An item resolved once to its IO keys, so engines writing at a high rate do
+// not look up the item or convert its names on every sample.
+class channel final {
+public:
+  using item = conf::io_parser::item;
+
+  // Which side of the item writes go to: the commanded value the product
+  // writes, or the readback it reads, as emulated by models.
+  enum class side_type { command, readback };
+
+  channel() = delete;
+  channel(const channel &) = default;
+  channel &operator=(const channel &) = default;
+  channel(channel &&) noexcept = default;
+  channel &operator=(channel &&) noexcept = default;
+  ~channel() = default;
+
+  explicit channel(const item &i, side_type side = side_type::command)
+      : item_(i), reader_(i.dt, i.pr),
+        writer_(i.dt, side == side_type::command ? write_key(i) : i.pr),
+        side_(side) {}
+
+  // Writes go to 'pw', or to 'pr' if the item has no 'pw' configured.
+  static const std::string &write_key(const item &i) noexcept {
+    return i.pw.empty() ? i.pr : i.pw;
+  }
+
+  const item &get_item() const noexcept { return item_; }
+  const std::string &name() const noexcept { return item_.name; }
+  const std::string &write_key() const noexcept {
+    return side_ == side_type::command ? write_key(item_) : item_.pr;
+  }
+  bool readable() const noexcept { return !item_.pr.empty(); }
+  bool writable() const noexcept { return !write_key().empty(); }
+  bool numeric() const noexcept {
+    return item_.dt == item::data_type::int_val ||
+           item_.dt == item::data_type::double_val;
+  }
+
+  // Faults attached to the key written apply to both overloads; a string
+  // written to a numeric item is converted first.
+  bool write(double val) {
+    auto delay = std::chrono::nanoseconds(0);
+    if (auto slot = faults(); slot != nullptr) {
+      const auto r = slot->apply(val);
+      if (r.drop)
+        return false;
+      val = r.value;
+      delay = r.delay;
+    }
+
+    switch (item_.dt) {
+    case item::data_type::int_val:
+      writer_.set(static_cast<int>(std::lround(val)));
+      break;
+    case item::data_type::double_val:
+      writer_.set(val);
+      break;
+    default:
+      writer_.set(std::to_string(val));
+      break;
+    }
+    if (delay.count() > 0) {
+      fault_engine::shared().defer(delay, writer_);
+      return true;
+    }
+    return writer_.write();
+  }
+
+  bool write(const std::string &val) {
+    writer_.set_value_from_str(item_.dt, val);
+    if (numeric() && faults() != nullptr)
+      return write(*to_double(writer_));
+    return writer_.write();
+  }
+
+  // The value last written, as it would be printed.
+  const variant &written() const noexcept { return writer_; }
+
+  const variant *read() {
+    return reader_.read() ? &reader_ : nullptr;
+  }
+
+  std::optional<double> read_double() {
+    if (!reader_.read())
+      return std::nullopt;
+    return to_double(reader_);
+  }
+
+  static std::optional<double> to_double(const variant &v) {
+    if (auto i = std::get_if<int>(&v.get()))
+      return *i;
+    if (auto d = std::get_if<double>(&v.get()))
+      return *d;
+    return std::nullopt;
+  }
+
+private:
+  // Looks the key up again only when some key got its first fault, so
+  // writes of keys without faults never take a lock.
+  fault_slot *faults() {
+    auto &engine = fault_engine::shared();
+    if (const auto gen = engine.generation(); gen != faults_gen_) {
+      faults_gen_ = gen;
+      faults_ = engine.find(write_key());
+    }
+    return faults_ && faults_->armed() ? faults_.get() : nullptr;
+  }
+
+  item item_;
+  variant reader_;
+  variant writer_;
+  side_type side_;
+  fault_slot::ptr faults_;
+  std::uint64_t faults_gen_ = 0;
+};
+} // namespace ctf_io
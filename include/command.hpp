@@ -44,6 +44,17 @@ public:
     exec_(args);
   }
 
+  // Arguments completed from this command's names rank higher for a while.
+  void touch(const exec_args &args) {
+    if (has_param())
+      for (const auto &arg : args)
+        param_completion_->touch(arg);
+  }
+
+  basic_completion *param_completion() const noexcept {
+    return has_param() ? param_completion_.get() : nullptr;
+  }
+
   const std::string &get_name() const noexcept { return name_; }
   bool has_param() const noexcept {
     return param_completion_ && *param_completion_;
@@ -79,6 +90,11 @@ public:
     it->second->execute(std::move(args));
   }
 
+  void touch(const std::string &name, const basic_command::exec_args &args) {
+    if (auto it = cmds_map_.find(name); it != cmds_map_.cend())
+      it->second->touch(args);
+  }
+
   basic_completion::generator_func
   find_param_generator(const std::string &name) const {
     if (auto it = cmds_map_.find(name); it != cmds_map_.cend())
@@ -87,6 +103,12 @@ public:
     return {};
   }
 
+  basic_completion *find_param_completion(const std::string &name) const {
+    if (auto it = cmds_map_.find(name); it != cmds_map_.cend())
+      return it->second->param_completion();
+    return nullptr;
+  }
+
   template <typename... Args> static vec_type make_vec(Args &&...args) {
     vec_type vec;
     (vec.emplace_back(std::forward<Args>(args)), ...);
@@ -1,198 +1,240 @@
 #pragma once
 
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <deque>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include <string>
-#include <type_traits>
+#include <string_view>
 #include <utility>
-#include <variant>
-
-#include <ctf_io.h>
-#include <lb/drv_emu.hpp>
+#include <vector>
 
+#include "args.hpp"
+#include "capture.hpp"
+#include "channel.hpp"
 #include "command.hpp"
 #include "conf_parser.hpp"
+#include "console.hpp"
+#include "dash.hpp"
+#include "derive.hpp"
+#include "echo.hpp"
+#include "expect.hpp"
+#include "expression.hpp"
+#include "fault.hpp"
+#include "jobs.hpp"
+#include "journal.hpp"
+#include "plant.hpp"
+#include "recorder.hpp"
+#include "replay.hpp"
+#include "scenario.hpp"
+#include "selector.hpp"
+#include "shard.hpp"
+#include "task.hpp"
 #include "terminal.hpp"
+#include "variant.hpp"
+#include "waiter.hpp"
+#include "watch.hpp"
+#include "waveform.hpp"
 
 namespace ctf_io {
-class variant final {
-public:
-  using raw_type = std::variant<int, double, std::string>;
-  using item = conf::io_parser::item;
-
-  template <typename T>
-  static constexpr auto is_member_v =
-      std::disjunction_v<std::is_same<T, int>, std::is_same<T, double>,
-                         std::is_same<T, std::string>>;
-
-  variant() = delete;
-  variant(const variant &) = default;
-  variant &operator=(const variant &) = default;
-  variant(variant &&) noexcept = default;
-  variant &operator=(variant &&) noexcept = default;
-  ~variant() = default;
-
-  template <typename T,
-            typename = std::enable_if_t<is_member_v<std::decay_t<T>>>>
-  variant &operator=(T &&val) {
-    set(std::forward<T>(val));
-    return *this;
-  }
-
-  friend std::ostream &operator<<(std::ostream &, const variant &);
-
-  explicit variant(item::data_type type, const std::string &param,
-                   const std::string &val = {}) {
-    reset(type, param, val);
-  }
-
-  void reset(item::data_type type, const std::string &param = {},
-             const std::string &val = {});
-  auto &get() noexcept { return var_; }
-  const auto &get() const noexcept { return var_; }
-
-  template <typename T,
-            typename = std::enable_if_t<is_member_v<std::decay_t<T>>>>
-  void set(T &&val) {
-    var_ = std::forward<T>(val);
-  }
-
-  void set_value_from_str(item::data_type type, const std::string &val);
-
-  bool read() noexcept;
-  bool write() noexcept;
-
-private:
-  raw_type var_;
-  std::string param_;
-};
-
-inline void variant::reset(item::data_type type, const std::string &param,
-                           const std::string &val) {
-  set_value_from_str(type, val);
-  if (!param.empty())
-    std::visit(
-        [&param, this](auto &&v) {
-          using Tv = std::decay_t<decltype(v)>;
-          if constexpr (std::is_same_v<Tv, std::string>)
-            param_ = lb::drv_emulator<char>{}.to_io_name(param.c_str());
-          else
-            param_ = lb::drv_emulator<Tv>{}.to_io_name(param.c_str());
-        },
-        var_);
+// Queues the result for the journal, if one is kept.
+inline void record(const char *op, const conf::io_parser::item &item,
+                   const std::string &key, const variant &value, bool ok,
+                   std::chrono::steady_clock::duration latency) {
+  auto &j = journal::shared();
+  if (!j.enabled())
+    return;
+  auto os = std::ostringstream();
+  os << value;
+  j.record({journal::clock_type::now(), op, item.name, key, os.str(), ok,
+            latency});
 }
 
-inline void variant::set_value_from_str(item::data_type type,
-                                        const std::string &val) {
-  switch (type) {
-  case item::data_type::int_val:
-    set(val.empty() ? 0 : std::stoi(val));
-    break;
-  case item::data_type::double_val:
-    set(val.empty() ? 0.0 : std::stod(val));
-    break;
-  case item::data_type::string_val:
-    set(val);
-    break;
-  default:
-    throw std::invalid_argument("unsupported type for variant");
+// Reads one item and prints the result, returns whether it was read.
+inline bool get_item(const conf::io_parser::item &item) {
+  auto val = variant(item.dt, item.pr);
+  const auto begin = std::chrono::steady_clock::now();
+  const auto ok = val.read();
+  record("get", item, item.pr, val, ok,
+         std::chrono::steady_clock::now() - begin);
+  if (ok) {
+    termctl::out() << "[OK][" << item.name << "][" << item.pr
+                   << "] read: " << val << std::endl;
+    return true;
   }
-}
 
-inline bool variant::read() noexcept {
-  try {
-    auto ret = IO_UNKNOWN_TYPE;
-    if (auto int_ptr = std::get_if<int>(&var_))
-      ret = io_read_int(param_.c_str(), int_ptr);
-    else if (auto double_ptr = std::get_if<double>(&var_))
-      ret = io_read_double(param_.c_str(), double_ptr);
-    else if (auto str_ptr = std::get_if<std::string>(&var_))
-      ret = io_read_string(param_, *str_ptr);
-    return ret == IO_SUCCESS;
-  } catch (const std::exception &e) {
-    std::cerr << "Error: " << e.what() << std::endl;
-  }
+  termctl::err()
+      << "[FAIL][" << item.name << "][" << item.pr
+      << "] could not be read, please might need to set a value first"
+      << std::endl;
+  termctl::mark_failed();
   return false;
 }
 
-inline bool variant::write() noexcept {
-  try {
-    auto ret = IO_UNKNOWN_TYPE;
-    if (auto int_ptr = std::get_if<int>(&var_))
-      ret = io_write_int(param_.c_str(), *int_ptr);
-    else if (auto double_ptr = std::get_if<double>(&var_))
-      ret = io_write_double(param_.c_str(), *double_ptr);
-    else if (auto str_ptr = std::get_if<std::string>(&var_))
-      ret = io_write_string(param_.c_str(), str_ptr->c_str());
-    return ret == IO_SUCCESS;
-  } catch (const std::exception &e) {
-    std::cerr << "Error: " << e.what() << std::endl;
-  }
-  return false;
+// Prints how many of the selected items 'op' went through for, e.g.
+// "[OK][get] 12 read, 0 failed".
+inline void print_selected(const char *op, const char *done_as,
+                           std::size_t done, std::size_t failed,
+                           std::size_t skipped) {
+  termctl::out() << (failed ? "[FAIL][" : "[OK][") << op << "] " << done
+                 << " " << done_as << ", " << failed << " failed";
+  if (skipped)
+    termctl::out() << ", " << skipped << " skipped";
+  termctl::out() << std::endl;
 }
 
 inline void perform_command_get(const termctl::basic_command::exec_args &args,
                                 const conf::io_parser::shared_ptr &parser) {
-  if (!args.empty()) {
-    auto item = parser->find_item(args[0]);
-    if (!item) {
-      throw std::invalid_argument("invalid item of module \"" + args[0] + "\"");
-      return;
-    } else if (item->pr.empty()) {
+  if (args.empty())
+    throw std::invalid_argument("requires exactly one argument on command");
+
+  if (args.size() == 1 && item_selector(args[0], *parser).is_name()) {
+    const auto item = parser->find_item(args[0]);
+    if (item->pr.empty())
       throw std::invalid_argument("the 'pr' value for module \"" + args[0] +
                                   "\" could not be empty");
-      return;
-    } else {
-      auto val = variant(item->dt, item->pr);
-      if (val.read()) {
-        std::cout << "[OK][" << item->name << "][" << item->pr
-                  << "] read: " << val << std::endl;
-        return;
-      }
-
-      std::cerr << "[FAIL][" << item->name << "][" << item->pr
-                << "] could not be read, please might need to set a value first"
-                << std::endl;
-      return;
+    get_item(*item);
+    return;
+  }
+
+  // Items without a 'pr' are passed over rather than failing the rest.
+  auto read = std::size_t(0), failed = std::size_t(0), skipped = std::size_t(0);
+  for (const auto &item : select_items(*parser, args)) {
+    if (termctl::this_job::stop_requested())
+      break;
+    if (item.pr.empty())
+      ++skipped;
+    else if (get_item(item))
+      ++read;
+    else
+      ++failed;
+  }
+  if (read + failed == 0)
+    throw std::invalid_argument("no readable item matches");
+  print_selected("get", "read", read, failed, skipped);
+}
+
+// Everything after '=' is one expression over the current values of other
+// items, e.g. "set Chamber.Pressure = Chamber.Setpoint * 0.98".
+inline double evaluate_expression(const termctl::basic_command::exec_args &args,
+                                  const conf::io_parser &parser) {
+  auto text = std::string();
+  for (auto it = args.begin() + 2; it != args.end(); ++it)
+    text += (text.empty() ? "" : " ") + *it;
+  if (text.empty())
+    throw std::invalid_argument("expects an expression after '='");
+
+  auto values = std::deque<double>();
+  const auto expr = expression(text, [&](const std::string &name) {
+    const auto i = parser.find_item(name);
+    if (!i)
+      throw std::invalid_argument("invalid item of module \"" + name + "\"");
+    auto ch = channel(*i);
+    const auto v = ch.numeric() ? ch.read_double() : std::nullopt;
+    if (!v)
+      throw std::runtime_error("could not read \"" + name + "\"");
+    return &values.emplace_back(*v);
+  });
+
+  return expr.eval();
+}
+
+// Writes 'value' to one item and prints the result, returns whether it was
+// written.
+inline bool set_item(const conf::io_parser::item &item,
+                     const std::string &value) {
+  auto ch = channel(item);
+  const auto begin = std::chrono::steady_clock::now();
+  const auto ok = ch.write(value);
+  record("set", item, ch.write_key(), ch.written(), ok,
+         std::chrono::steady_clock::now() - begin);
+  if (ok) {
+    termctl::out() << "[OK][" << item.name << "][" << ch.write_key()
+                   << "] write: " << ch.written() << std::endl;
+    return true;
+  }
+
+  termctl::err() << "[FAIL][" << item.name << "][" << ch.write_key()
+                 << "] failed to write: " << value << std::endl;
+  termctl::mark_failed();
+  return false;
+}
+
+// Writes to every item 'selector' selects the value 'value_of' gives for it.
+template <typename F>
+void set_items(const std::string &selector, F &&value_of,
+               const conf::io_parser &parser) {
+  if (item_selector(selector, parser).is_name()) {
+    const auto item = parser.find_item(selector);
+    if (item->pw.empty()) {
+      termctl::err() << "Warning: the value 'pw' is empty, attempting to use "
+                        "'pr' value ..."
+                     << std::endl;
+
+      if (item->pr.empty())
+        throw std::runtime_error("the value 'pr' is empty, attempt to use 'pr' "
+                                 "value failed");
     }
+    set_item(*item, value_of(*item));
+    return;
   }
 
-  throw std::invalid_argument("requires exactly one argument on command");
+  // Items nothing can be written to are passed over, and so is a value an
+  // item cannot take, rather than failing the rest.
+  auto written = std::size_t(0), failed = std::size_t(0),
+       skipped = std::size_t(0);
+  for (const auto &item : select_items(parser, {selector})) {
+    if (termctl::this_job::stop_requested())
+      break;
+    if (channel::write_key(item).empty()) {
+      ++skipped;
+      continue;
+    }
+    try {
+      set_item(item, value_of(item)) ? ++written : ++failed;
+    } catch (const std::exception &e) {
+      termctl::err() << "[FAIL][" << item.name << "] " << e.what()
+                     << std::endl;
+      termctl::mark_failed();
+      ++failed;
+    }
+  }
+  if (written + failed == 0)
+    throw std::invalid_argument("no writable item matches");
+  print_selected("set", "written", written, failed, skipped);
 }
 
 inline void perform_command_set(const termctl::basic_command::exec_args &args,
                                 const conf::io_parser::shared_ptr &parser) {
-  if (args.size() == 2) {
-    if (auto item = parser->find_item(args[0]); item) {
-      auto prw = item->pw;
-      if (prw.empty()) {
-        std::cerr << "Warning: the value 'pw' is empty, attempting to use 'pr' "
-                     "value ..."
-                  << std::endl;
-
-        prw = item->pr;
-        if (prw.empty())
-          throw std::runtime_error(
-              "the value 'pr' is empty, attempt to use 'pr' "
-              "value failed");
-      }
-
-      auto val = variant(item->dt, prw, args[1]);
-      if (val.write()) {
-        std::cout << "[OK][" << item->name << "][" << prw << "] write: " << val
-                  << std::endl;
-        return;
-      }
-
-      std::cerr << "[FAIL][" << item->name << "][" << prw
-                << "] failed to write: " << args[1] << std::endl;
-      return;
-    } else {
-      throw std::invalid_argument("invalid item of module \"" + args[0] + "\"");
-    }
+  if (args.size() >= 2 && args[1] == "=") {
+    const auto v = evaluate_expression(args, *parser);
+    if (!std::isfinite(v))
+      throw std::runtime_error("the expression is not finite");
+    // Integers are rounded the way every numeric write rounds them.
+    return set_items(
+        args[0],
+        [v](const conf::io_parser::item &item) {
+          if (item.dt == conf::io_parser::item::data_type::int_val)
+            return std::to_string(std::lround(v));
+          char buf[32];
+          return std::string(buf,
+                             std::to_chars(buf, buf + sizeof(buf), v).ptr);
+        },
+        *parser);
   }
 
+  if (args.size() == 2)
+    return set_items(
+        args[0], [&](const conf::io_parser::item &) { return args[1]; },
+        *parser);
+
   throw std::invalid_argument("requires exactly two arguments on command");
 }
 
@@ -201,44 +243,912 @@ inline void perform_command_info(const termctl::basic_command::exec_args &args,
   if (!args.empty()) {
     if (args[0] == "all") {
       for (const auto &item : parser->items())
-        item.second.pretty_print();
-      return;
-    } else if (auto item = parser->find_item(args[0]); item) {
-      item->pretty_print();
+        item.second.pretty_print(termctl::out());
       return;
     }
 
-    throw std::invalid_argument("invalid item of module \"" + args[0] + "\"");
+    const auto items = select_items(*parser, args);
+    for (const auto &item : items)
+      item.pretty_print(termctl::out());
+    if (items.empty())
+      throw std::invalid_argument("no item matches");
+    return;
+  }
+
+  throw std::invalid_argument("requires exactly one argument on command");
+}
+
+inline void perform_command_wave(const termctl::basic_command::exec_args &args,
+                                 const conf::io_parser::shared_ptr &parser) {
+  auto &engine = waveform_engine::shared();
+  if (args.size() == 1 && args[0] == "list") {
+    for (const auto &wf : engine.list()) {
+      wf->print(termctl::out());
+      termctl::out() << "\n";
+    }
+    termctl::out().flush();
+    return;
+  } else if (args.size() == 2 && args[0] == "stop") {
+    const auto stopped = engine.stop(args[1]);
+    if (stopped.empty())
+      throw std::invalid_argument("no such waveform \"" + args[1] + "\"");
+    for (const auto &wf : stopped) {
+      termctl::out() << "[STOP]";
+      wf->print(termctl::out());
+      termctl::out() << "\n";
+    }
+    termctl::out().flush();
+    return;
+  }
+
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.size() != 2)
+    throw std::invalid_argument(
+        "usage: wave <item> sine|ramp|square|triangle|noise [amp=..] "
+        "[offset=..] [freq=..] [rate=..Hz] [phase=..], wave list, "
+        "wave stop <id>|<item>|all");
+  opts.expect_only({"amp", "offset", "freq", "rate", "phase"});
+
+  auto item = parser->find_item(pos[0]);
+  if (!item)
+    throw std::invalid_argument("invalid item of module \"" + pos[0] + "\"");
+
+  auto params = waveform_params();
+  params.shape = waveform_params::parse_shape(pos[1]);
+  params.amp = opts.get_double("amp", params.amp);
+  params.offset = opts.get_double("offset", params.offset);
+  params.freq = opts.get_rate("freq", params.freq);
+  params.rate = opts.get_rate("rate", params.rate);
+  params.phase = opts.get_double("phase", params.phase);
+
+  auto wf = engine.start(channel(*item), params);
+  termctl::out() << "[OK][" << item->name << "]["
+                 << wf->get_channel().write_key() << "] wave " << wf->id()
+                 << " started" << std::endl;
+}
+
+inline runtime::task<void> sleep_task(std::chrono::nanoseconds d) {
+  co_await runtime::sleep_for(d);
+}
+
+inline void
+perform_command_sleep(const termctl::basic_command::exec_args &args) {
+  if (args.size() == 1) {
+    const auto d = termctl::parse_duration(args[0]);
+    termctl::this_job::await(runtime::spawn(sleep_task(d)));
+    return;
   }
 
   throw std::invalid_argument("requires exactly one argument on command");
 }
 
-inline std::ostream &operator<<(std::ostream &os, const variant &v) {
-  std::visit(
-      [&os](auto &&val) {
-        using Tv = std::decay_t<decltype(val)>;
-        if constexpr (std::is_same_v<Tv, std::string>)
-          os << val;
-        else
-          os << std::to_string(val);
-      },
-      v.get());
-  return os;
+inline void perform_command_run(const termctl::basic_command::exec_args &args,
+                                const conf::io_parser::shared_ptr &parser) {
+  if (args.size() != 1)
+    throw std::invalid_argument("requires exactly one argument on command");
+
+  // Everything is resolved and checked before the first step runs.
+  auto sc = scenario::load(args[0], *parser);
+  // A failed run is reported too, its timing up to the failure matters most.
+  try {
+    termctl::this_job::await(runtime::spawn(sc->run()));
+  } catch (...) {
+    sc->report(termctl::err());
+    termctl::err().flush();
+    throw;
+  }
+  sc->report(termctl::out());
+  termctl::out().flush();
+}
+
+// e.g. "history Chamber.Pressure 10m" or "history Chamber.* limit=50".
+inline void
+perform_command_history(const termctl::basic_command::exec_args &args,
+                        const conf::io_parser::shared_ptr &) {
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.empty() || pos.size() > 2)
+    throw std::invalid_argument(
+        "usage: history <item|pattern> [since] [limit=..]");
+  opts.expect_only({"limit"});
+
+  const auto since = pos.size() == 2 ? termctl::parse_duration(pos[1])
+                                     : std::chrono::nanoseconds(0);
+  const auto limit = opts.get_double("limit", 100);
+  if (limit < 1)
+    throw std::invalid_argument("invalid 'limit'");
+
+  // What was just done is in the answer too.
+  auto &j = journal::shared();
+  j.flush();
+  j.query(termctl::out(), pos[0], since, std::size_t(limit));
+  termctl::out() << std::endl;
+}
+
+#ifndef _WIN32
+// Joins 'args' back into a command line, quoting what needs it.
+inline std::string join_args(const termctl::basic_command::exec_args &args,
+                             std::size_t first) {
+  auto line = std::string();
+  for (auto i = first; i < args.size(); ++i) {
+    const auto &a = args[i];
+    if (!line.empty())
+      line += ' ';
+    if (a.empty() || a.find_first_of(" \t\"'") != std::string::npos) {
+      const auto q = a.find('"') == std::string::npos ? '"' : '\'';
+      line += q + a + q;
+    } else {
+      line += a;
+    }
+  }
+  return line;
+}
+
+// Lines of 'file' each go to the worker owning their item, all workers run
+// at once; only failures are printed.
+inline void shard_load(const std::string &file) {
+  auto is = std::ifstream(file);
+  if (!is)
+    throw std::runtime_error("could not open \"" + file + "\"");
+
+  auto &pool = termctl::shard_pool::shared();
+  auto batch = std::vector<termctl::shard_pool::request>();
+  auto lines = std::vector<int>();
+  auto failed = std::size_t(0);
+  auto line = std::string();
+  for (auto n = 1; std::getline(is, line); ++n) {
+    const auto first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#')
+      continue;
+    if (line.back() == '\r')
+      line.pop_back();
+    try {
+      batch.push_back({pool.route(line), line.substr(first), {}});
+      lines.push_back(n);
+    } catch (const std::exception &e) {
+      termctl::err() << "Error: " << file << ":" << n << ": " << e.what()
+                     << "\n";
+      ++failed;
+    }
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  pool.dispatch(batch);
+  const auto elapsed = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+
+  auto cancelled = std::size_t(0);
+  for (std::size_t i = 0; i < batch.size(); ++i) {
+    const auto &res = batch[i].res;
+    if (res.cancelled) {
+      ++cancelled;
+      continue;
+    }
+    if (res.ok)
+      continue;
+    ++failed;
+    auto es = std::istringstream(res.err);
+    for (auto msg = std::string(); std::getline(es, msg);) {
+      if (msg.rfind("Error: ", 0) == 0)
+        msg.erase(0, 7);
+      termctl::err() << "Error: " << file << ":" << lines[i] << ": " << msg
+                     << "\n";
+    }
+  }
+  termctl::err().flush();
+  if (failed)
+    termctl::mark_failed();
+  termctl::out() << "[shard][" << file << "] " << batch.size()
+                 << " commands on " << pool.size() << " workers, " << failed
+                 << " failed, " << cancelled << " cancelled (" << elapsed
+                 << "s)" << std::endl;
+}
+#endif
+
+// e.g. "shard wave Chamber.Pressure sine freq=1Hz", "shard all wave list"
+// or "shard load stimulus.txt".
+inline void perform_command_shard(const termctl::basic_command::exec_args &args,
+                                  const conf::io_parser::shared_ptr &) {
+#ifdef _WIN32
+  (void)args;
+  throw std::runtime_error("shard workers need fork()");
+#else
+  auto &pool = termctl::shard_pool::shared();
+  if (args.empty() || (args.size() == 1 && args[0] == "list")) {
+    pool.print(termctl::out());
+    termctl::out() << std::endl;
+    return;
+  }
+  if (args[0] == "load") {
+    if (args.size() != 2)
+      throw std::invalid_argument("usage: shard load <file>");
+    return shard_load(args[1]);
+  }
+
+  auto batch = std::vector<termctl::shard_pool::request>();
+  if (args[0] == "all") {
+    if (args.size() < 2)
+      throw std::invalid_argument("usage: shard all <command>");
+    const auto line = join_args(args, 1);
+    for (std::size_t k = 0; k < pool.size(); ++k)
+      batch.push_back({k, line, {}});
+  } else {
+    const auto line = join_args(args, 0);
+    batch.push_back({pool.route(line), line, {}});
+  }
+  pool.dispatch(batch);
+  for (const auto &r : batch) {
+    termctl::out() << r.res.out;
+    termctl::err() << r.res.err;
+    if (!r.res.ok && !r.res.cancelled)
+      termctl::mark_failed();
+  }
+  termctl::out().flush();
+  termctl::err().flush();
+#endif
+}
+
+// Runs 'suite' as 'expect' and 'expect-file' do, with their options.
+inline void run_expect(expect_suite &suite, const termctl::options &opts,
+                       bool all, bool summary) {
+  auto wopts = wait_options();
+  if (opts.has("timeout"))
+    wopts.timeout = opts.get_duration("timeout", {});
+
+  const auto ok = suite.run(wopts);
+  if (const auto junit = opts.get("junit"); !junit.empty())
+    suite.write_junit(junit);
+  if (const auto json = opts.get("json"); !json.empty())
+    suite.write_json(json);
+
+  if (!ok)
+    termctl::mark_failed();
+  auto &os = ok ? termctl::out() : termctl::err();
+  suite.report(os, all);
+  if (summary) {
+    suite.summary(os);
+    os << "\n";
+  }
+  os.flush();
+}
+
+// e.g. "expect Chamber.Pressure < 1e-3 timeout=5s".
+inline void
+perform_command_expect(const termctl::basic_command::exec_args &args,
+                       const conf::io_parser::shared_ptr &parser) {
+  const auto opts = termctl::options(args);
+  if (opts.positional().empty())
+    throw std::invalid_argument(
+        "usage: expect <item> <op> <value> [tol=..] [timeout=..] "
+        "[junit=..] [json=..]");
+  opts.expect_only({"tol", "timeout", "junit", "json"});
+
+  auto c = expect_suite::check{condition::parse(opts.positional()), {}};
+  c.cond.set_tol(opts.get_double("tol", 0.0));
+  auto checks = std::vector<expect_suite::check>();
+  checks.push_back(std::move(c));
+  auto suite = expect_suite("expect", std::move(checks), *parser);
+  run_expect(suite, opts, true, false);
+}
+
+// e.g. "expect-file panel.txt timeout=10s junit=panel.xml".
+inline void
+perform_command_expect_file(const termctl::basic_command::exec_args &args,
+                            const conf::io_parser::shared_ptr &parser) {
+  const auto opts = termctl::options(args);
+  if (opts.positional().size() != 1)
+    throw std::invalid_argument(
+        "usage: expect-file <file> [tol=..] [timeout=..] [junit=..] "
+        "[json=..] [verbose=1]");
+  opts.expect_only({"tol", "timeout", "junit", "json", "verbose"});
+
+  auto suite = expect_suite::load(opts.positional()[0], *parser,
+                                  opts.get_double("tol", 0.0));
+  run_expect(suite, opts, opts.get_double("verbose", 0) != 0, true);
+}
+
+// Conditions are joined by 'and' or 'or', e.g.
+// "wait Chamber.Pressure < 1e-3 and Valve.Open == 1 timeout=30s".
+inline void perform_command_wait(const termctl::basic_command::exec_args &args,
+                                 const conf::io_parser::shared_ptr &parser) {
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.empty())
+    throw std::invalid_argument(
+        "usage: wait <item> <op> <value> [and|or <item> <op> <value>].. "
+        "[tol=..] [timeout=..] [fast=..] [slow=..]");
+  opts.expect_only({"tol", "timeout", "fast", "slow"});
+
+  auto wopts = wait_options();
+  auto joiner = std::string();
+  auto groups = std::vector<std::vector<std::string>>(1);
+  for (const auto &tok : pos)
+    if (tok == "and" || tok == "or") {
+      if (!joiner.empty() && joiner != tok)
+        throw std::invalid_argument("cannot mix 'and' with 'or'");
+      joiner = tok;
+      groups.emplace_back();
+    } else {
+      groups.back().push_back(tok);
+    }
+  if (joiner == "or")
+    wopts.mode = wait_options::mode_type::any;
+
+  const auto tol = opts.get_double("tol", 0.0);
+  auto conds = std::vector<std::pair<condition, channel>>();
+  for (const auto &group : groups) {
+    auto cond = condition::parse(group);
+    cond.set_tol(tol);
+    auto item = parser->find_item(cond.item);
+    if (!item)
+      throw std::invalid_argument("invalid item of module \"" + cond.item +
+                                  "\"");
+    auto ch = channel(*item);
+    if (!ch.readable() || !ch.numeric())
+      throw std::invalid_argument("the item \"" + cond.item +
+                                  "\" is not a readable number");
+    conds.emplace_back(std::move(cond), std::move(ch));
+  }
+
+  if (opts.has("timeout"))
+    wopts.timeout = opts.get_duration("timeout", {});
+  wopts.fast = opts.get_duration<std::chrono::milliseconds>("fast", wopts.fast);
+  wopts.slow = opts.get_duration<std::chrono::milliseconds>("slow", wopts.slow);
+  if (wopts.fast.count() <= 0 || wopts.slow < wopts.fast)
+    throw std::invalid_argument("invalid 'fast' or 'slow'");
+
+  auto w = waiter(std::move(conds), wopts);
+  const auto ok = w.run();
+  if (!ok)
+    termctl::mark_failed();
+  auto &os = ok ? termctl::out() : termctl::err();
+  w.report(os);
+  os << std::endl;
+}
+
+inline void perform_command_echo(const termctl::basic_command::exec_args &args,
+                                 const conf::io_parser::shared_ptr &parser) {
+  auto &engine = echo_engine::shared();
+  if (args.empty() || (args.size() == 1 && args[0] == "status")) {
+    engine.print(termctl::out());
+    termctl::out() << std::endl;
+    return;
+  } else if (args.size() == 1 && args[0] == "stop") {
+    if (!engine.running())
+      throw std::invalid_argument("echo is not running");
+    engine.stop();
+    termctl::out() << "[STOP]";
+    engine.print(termctl::out());
+    termctl::out() << std::endl;
+    return;
+  }
+
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.size() != 1 || pos[0] != "start")
+    throw std::invalid_argument("usage: echo start [drv=<id>|<name>] "
+                                "[cat=io|memory] [rate=..Hz], echo stop, "
+                                "echo status");
+  opts.expect_only({"drv", "cat", "rate"});
+
+  auto f = echo_engine::filter();
+  if (opts.has("drv")) {
+    const auto drv = opts.get("drv");
+    for (const auto &[id, d] : parser->drivers())
+      if (d.name == drv || std::to_string(d.id) == drv)
+        f.driver = d.id;
+    if (!f.driver)
+      throw std::invalid_argument("invalid driver \"" + drv + "\"");
+  }
+  if (opts.has("cat")) {
+    const auto cat = opts.get("cat");
+    if (cat == "io" || cat == "IO")
+      f.category = conf::io_parser::item::category_type::io;
+    else if (cat == "memory" || cat == "Memory")
+      f.category = conf::io_parser::item::category_type::memory;
+    else
+      throw std::invalid_argument("invalid category \"" + cat + "\"");
+  }
+
+  const auto rate = opts.get_rate("rate", 100.0);
+  const auto count = engine.start(*parser, f, rate);
+  termctl::out() << "[OK][echo] " << count << " items at " << rate << "Hz"
+                 << std::endl;
+}
+
+inline void
+perform_command_watch(const termctl::basic_command::exec_args &args,
+                      const conf::io_parser::shared_ptr &parser) {
+  if (args.empty())
+    throw std::invalid_argument("usage: watch <items|pattern>.. [interval]");
+
+  // A trailing duration is the interval, item names never parse as one.
+  auto patterns = std::vector<std::string>(args.begin(), args.end());
+  auto interval = std::chrono::nanoseconds(std::chrono::milliseconds(500));
+  if (patterns.size() > 1) {
+    try {
+      interval = termctl::parse_duration(patterns.back());
+      patterns.pop_back();
+    } catch (const std::invalid_argument &) {
+    }
+  }
+  if (interval < std::chrono::milliseconds(1))
+    throw std::invalid_argument("the interval must be at least 1ms");
+
+  auto chs = std::vector<channel>();
+  for (const auto &item : select_items(*parser, patterns))
+    if (!item.pr.empty())
+      chs.emplace_back(item);
+  if (chs.empty())
+    throw std::invalid_argument("no readable item matches");
+
+  auto w = watcher(std::move(chs), interval);
+  w.run();
+  w.report(termctl::out());
+  termctl::out() << std::endl;
+}
+
+inline void perform_command_dash(const termctl::basic_command::exec_args &args,
+                                 const conf::io_parser::shared_ptr &parser) {
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.empty() == !opts.has("drv"))
+    throw std::invalid_argument(
+        "usage: dash <items|pattern>.. [rate=..Hz], dash drv=<id>|<name> "
+        "[rate=..Hz]");
+  opts.expect_only({"drv", "rate"});
+
+  auto items = std::vector<conf::io_parser::item>();
+  if (opts.has("drv")) {
+    const auto drv = opts.get("drv");
+    auto id = std::optional<std::int32_t>();
+    for (const auto &[key, d] : parser->drivers())
+      if (d.name == drv || std::to_string(d.id) == drv)
+        id = d.id;
+    if (!id)
+      throw std::invalid_argument("invalid driver \"" + drv + "\"");
+    for (const auto &[name, item] : parser->items())
+      if (item.driver_id == *id)
+        items.push_back(item);
+  } else {
+    items = select_items(*parser, pos);
+  }
+
+  auto chs = std::vector<channel>();
+  for (const auto &item : items)
+    if (!item.pr.empty())
+      chs.emplace_back(item);
+  if (chs.empty())
+    throw std::invalid_argument("no readable item matches");
+
+  auto dash = dashboard(std::move(chs), opts.get_rate("rate", 20.0));
+  dash.run();
+  dash.report(termctl::out());
+  termctl::out() << std::endl;
+}
+
+inline void perform_command_plant(const termctl::basic_command::exec_args &args,
+                                  const conf::io_parser::shared_ptr &parser) {
+  auto &engine = plant_engine::shared();
+  if (args.size() == 1 && args[0] == "list") {
+    engine.print(termctl::out());
+    termctl::out() << std::endl;
+    return;
+  } else if (args.size() == 2 && args[0] == "stop") {
+    if (engine.stop(args[1]) == 0)
+      throw std::invalid_argument("no such plant model \"" + args[1] + "\"");
+    termctl::out() << "[STOP][plant][" << args[1] << "]" << std::endl;
+    return;
+  }
+
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.size() != 1)
+    throw std::invalid_argument(
+        "usage: plant <item> [in=<item>] [mode=follow|integrate] [gain=..] "
+        "[offset=..] [lag=..] [deadtime=..] [slew=..] [min=..] [max=..], "
+        "plant list, plant stop <item>|all");
+  opts.expect_only({"in", "mode", "gain", "offset", "lag", "deadtime",
+                    "slew", "min", "max"});
+
+  auto in = std::optional<conf::io_parser::item>();
+  if (opts.has("in") && !(in = parser->find_item(opts.get("in"))))
+    throw std::invalid_argument("invalid item of module \"" + opts.get("in") +
+                                "\"");
+  auto bindings = std::vector<plant_engine::binding>();
+  for (const auto &out : select_items(*parser, {pos[0]}))
+    bindings.emplace_back(out, in ? *in : out);
+  if (bindings.empty())
+    throw std::invalid_argument("no item matches \"" + pos[0] + "\"");
+
+  auto params = plant_params();
+  params.mode = plant_params::parse_mode(opts.get("mode", "follow"));
+  params.gain = opts.get_double("gain", params.gain);
+  params.offset = opts.get_double("offset", params.offset);
+  params.lag = opts.get_duration("lag", params.lag);
+  params.deadtime = opts.get_duration("deadtime", params.deadtime);
+  params.slew = opts.get_double("slew", params.slew);
+  params.min = opts.get_double("min", params.min);
+  params.max = opts.get_double("max", params.max);
+  if (params.slew <= 0 || params.min > params.max)
+    throw std::invalid_argument("invalid 'slew', 'min' or 'max'");
+
+  engine.add(bindings, params);
+  if (bindings.size() == 1)
+    termctl::out() << "[OK][" << bindings[0].first.name << "]["
+                   << bindings[0].second.pw << " -> " << bindings[0].first.pr
+                   << "] plant started at " << engine.rate() << "Hz"
+                   << std::endl;
+  else
+    termctl::out() << "[OK][plant] " << bindings.size()
+                   << " models started at " << engine.rate() << "Hz"
+                   << std::endl;
+}
+
+inline void
+perform_command_derive(const termctl::basic_command::exec_args &args,
+                       const conf::io_parser::shared_ptr &parser) {
+  auto &engine = derive_engine::shared();
+  if (args.size() == 1 && args[0] == "list") {
+    engine.print(termctl::out());
+    termctl::out() << std::endl;
+    return;
+  } else if (args.size() == 2 && args[0] == "stop") {
+    if (engine.stop(args[1]) == 0)
+      throw std::invalid_argument("no such derived item \"" + args[1] + "\"");
+    termctl::out() << "[STOP][derive][" << args[1] << "]" << std::endl;
+    return;
+  }
+
+  if (args.size() < 3 || args[1] != "=")
+    throw std::invalid_argument("usage: derive <item> = <expression>, "
+                                "derive list, derive stop <item>|all");
+  const auto item = parser->find_item(args[0]);
+  if (!item)
+    throw std::invalid_argument("invalid item of module \"" + args[0] + "\"");
+
+  auto text = std::string();
+  for (auto it = args.begin() + 2; it != args.end(); ++it)
+    text += (text.empty() ? "" : " ") + *it;
+  engine.add(*item, text, parser);
+  termctl::out() << "[OK][" << item->name << "][" << item->pr << " = " << text
+                 << "] derived at " << engine.rate() << "Hz" << std::endl;
+}
+
+inline void perform_command_fault(const termctl::basic_command::exec_args &args,
+                                  const conf::io_parser::shared_ptr &parser) {
+  auto &engine = fault_engine::shared();
+  if (args.empty() || (args.size() == 1 && args[0] == "list")) {
+    engine.print(termctl::out());
+    termctl::out() << std::endl;
+    return;
+  } else if (args.size() == 2 && args[0] == "clear") {
+    if (engine.clear(args[1]) == 0)
+      throw std::invalid_argument("no such fault \"" + args[1] + "\"");
+    termctl::out() << "[STOP][fault][" << args[1] << "]" << std::endl;
+    return;
+  }
+
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.size() != 2)
+    throw std::invalid_argument(
+        "usage: fault <item|pattern> stuck|drift|noise|spike|quantize|dropout|"
+        "latency [value=..] [rate=..] [sigma=..] [amp=..] [prob=..] "
+        "[step=..] [delay=..] [after=..] [for=..] [when=<condition>] "
+        "[side=command|readback], "
+        "fault list, fault clear <id>|<item>|all");
+
+  // Commands are written by set and waveforms, readbacks by plant models
+  // and the echo.
+  const auto side = opts.get("side", "command");
+  if (side != "command" && side != "readback")
+    throw std::invalid_argument("invalid side \"" + side + "\"");
+  const auto readback = side == "readback";
+
+  using kind_type = fault_params::kind_type;
+  auto params = fault_params();
+  params.kind = fault_params::parse_kind(pos[1]);
+  switch (params.kind) {
+  case kind_type::stuck:
+    opts.expect_only({"value", "after", "for", "when", "side"});
+    if (opts.has("value"))
+      params.value = opts.get_double("value", 0.0);
+    break;
+  case kind_type::drift:
+    opts.expect_only({"rate", "after", "for", "when", "side"});
+    params.rate = opts.get_double("rate", params.rate);
+    break;
+  case kind_type::noise:
+    opts.expect_only({"sigma", "after", "for", "when", "side"});
+    params.sigma = opts.get_double("sigma", params.sigma);
+    break;
+  case kind_type::spike:
+    opts.expect_only({"amp", "prob", "after", "for", "when", "side"});
+    params.amp = opts.get_double("amp", params.amp);
+    params.prob = opts.get_double("prob", 0.01);
+    break;
+  case kind_type::quantize:
+    opts.expect_only({"step", "after", "for", "when", "side"});
+    params.step = opts.get_double("step", params.step);
+    break;
+  case kind_type::dropout:
+    opts.expect_only({"prob", "after", "for", "when", "side"});
+    params.prob = opts.get_double("prob", params.prob);
+    break;
+  case kind_type::latency:
+    opts.expect_only({"delay", "after", "for", "when", "side"});
+    params.delay = opts.get_duration("delay", std::chrono::milliseconds(100));
+    break;
+  }
+  if (params.prob < 0 || params.prob > 1)
+    throw std::invalid_argument("'prob' must be within 0 to 1");
+  if (params.sigma < 0 || params.step <= 0)
+    throw std::invalid_argument("invalid 'sigma' or 'step'");
+
+  auto when = std::optional<std::pair<condition, variant>>();
+  if (opts.has("when")) {
+    auto cond = condition::parse(std::string_view(opts.get("when")));
+    auto item = parser->find_item(cond.item);
+    if (!item)
+      throw std::invalid_argument("invalid item of module \"" + cond.item +
+                                  "\"");
+    if (item->pr.empty() ||
+        item->dt == conf::io_parser::item::data_type::string_val)
+      throw std::invalid_argument("conditions need a numeric item with 'pr'");
+    when.emplace(std::move(cond), variant(item->dt, item->pr));
+  }
+  const auto after = opts.get_duration("after", {});
+  auto duration = std::optional<std::chrono::nanoseconds>();
+  if (opts.has("for"))
+    duration = opts.get_duration("for", {});
+
+  auto items = std::vector<conf::io_parser::item>();
+  for (auto &item : select_items(*parser, {pos[0]}))
+    if (!(readback ? item.pr : channel::write_key(item)).empty() &&
+        item.dt != conf::io_parser::item::data_type::string_val)
+      items.push_back(std::move(item));
+  if (items.empty())
+    throw std::invalid_argument("no numeric writable item matches \"" +
+                                pos[0] + "\"");
+
+  for (const auto &item : items) {
+    auto f = engine.add(item.name,
+                        readback ? item.pr : channel::write_key(item), params,
+                        after, duration, when);
+    if (items.size() == 1) {
+      termctl::out() << "[OK]";
+      f->print(termctl::out());
+      termctl::out() << std::endl;
+    }
+  }
+  if (items.size() > 1)
+    termctl::out() << "[OK][fault] " << items.size() << " "
+                   << fault_params::kind_to_str(params.kind)
+                   << " faults attached" << std::endl;
+}
+
+inline void
+perform_command_record(const termctl::basic_command::exec_args &args,
+                       const conf::io_parser::shared_ptr &parser) {
+  auto &rec = recorder::shared();
+  if (args.empty() || (args.size() == 1 && args[0] == "status")) {
+    rec.print(termctl::out());
+    termctl::out() << std::endl;
+    return;
+  } else if (args.size() == 1 && args[0] == "stop") {
+    if (!rec.running())
+      throw std::invalid_argument("not recording");
+    rec.stop();
+    termctl::out() << "[STOP]";
+    rec.print(termctl::out());
+    termctl::out() << std::endl;
+    return;
+  }
+
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.size() < 2 || pos[0] != "start")
+    throw std::invalid_argument("usage: record start <items|pattern>.. "
+                                "[rate=..Hz] [file=..], record stop, "
+                                "record status");
+  opts.expect_only({"rate", "file"});
+
+  auto chs = std::vector<channel>();
+  for (const auto &item :
+       select_items(*parser, std::vector<std::string>(pos.begin() + 1,
+                                                      pos.end())))
+    if (!item.pr.empty())
+      chs.emplace_back(item);
+  if (chs.empty())
+    throw std::invalid_argument("no readable item matches");
+
+  auto file = opts.get("file");
+  if (file.empty()) {
+    const auto now = std::time(nullptr);
+    char buf[32];
+    std::strftime(buf, sizeof(buf), "iotest-%Y%m%d-%H%M%S.trace",
+                  std::localtime(&now));
+    file = buf;
+  }
+
+  const auto count = chs.size();
+  const auto rate = opts.get_rate("rate", 100.0);
+  rec.start(std::move(chs), rate, file);
+  termctl::out() << "[OK][record][" << file << "] " << count
+                 << " items at " << rate << "Hz" << std::endl;
+}
+
+inline void
+perform_command_capture(const termctl::basic_command::exec_args &args,
+                        const conf::io_parser::shared_ptr &parser) {
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.empty() || !opts.has("trigger"))
+    throw std::invalid_argument(
+        "usage: capture <items|pattern>.. trigger=\"<item> <op> <value>\" "
+        "[pre=..] [post=..] [rate=..Hz] [count=..] [file=..]");
+  opts.expect_only({"trigger", "pre", "post", "rate", "count", "file"});
+
+  auto copts = capture_options();
+  copts.trigger = condition::parse(std::string_view(opts.get("trigger")));
+  copts.pre = opts.get_duration("pre", copts.pre);
+  copts.post = opts.get_duration("post", copts.post);
+  copts.rate = opts.get_rate("rate", copts.rate);
+  const auto count = opts.get_double("count", double(copts.count));
+  if (count < 0 || count != std::floor(count))
+    throw std::invalid_argument("invalid 'count'");
+  copts.count = std::size_t(count);
+
+  copts.prefix = opts.get("file");
+  if (copts.prefix.empty()) {
+    const auto now = std::time(nullptr);
+    char buf[32];
+    std::strftime(buf, sizeof(buf), "capture-%Y%m%d-%H%M%S",
+                  std::localtime(&now));
+    copts.prefix = buf;
+  }
+
+  // The trigger item is captured along if it was not listed.
+  auto names = std::vector<std::string>(pos.begin(), pos.end());
+  names.push_back(copts.trigger.item);
+  auto chs = std::vector<channel>();
+  for (const auto &item : select_items(*parser, names))
+    if (!item.pr.empty() &&
+        item.dt != conf::io_parser::item::data_type::string_val)
+      chs.emplace_back(item);
+  if (std::none_of(chs.begin(), chs.end(), [&](const channel &ch) {
+        return ch.name() == copts.trigger.item;
+      }))
+    throw std::invalid_argument("the trigger needs a numeric item with 'pr'");
+
+  auto cap = capture(std::move(chs), copts);
+  cap.run();
+  cap.report(termctl::out());
+  termctl::out() << std::endl;
+}
+
+inline void
+perform_command_replay(const termctl::basic_command::exec_args &args,
+                       const conf::io_parser::shared_ptr &parser) {
+  const auto opts = termctl::options(args);
+  const auto &pos = opts.positional();
+  if (pos.size() != 1)
+    throw std::invalid_argument("usage: replay <trace> [speed=..|afap] "
+                                "[from=..] [to=..] [items=<glob>,..]");
+  opts.expect_only({"speed", "from", "to", "items"});
+
+  auto ropts = replay_options();
+  if (opts.get("speed") == "afap") {
+    ropts.speed = 0;
+  } else {
+    ropts.speed = opts.get_double("speed", ropts.speed);
+    if (ropts.speed < 0.1 || ropts.speed > 100)
+      throw std::invalid_argument("speed must be within 0.1 to 100, or afap");
+  }
+  ropts.from = opts.get_duration("from", ropts.from);
+  if (opts.has("to"))
+    ropts.to = opts.get_duration("to", {});
+  if (ropts.to && *ropts.to < ropts.from)
+    throw std::invalid_argument("'to' is before 'from'");
+  ropts.items = termctl::split_list(opts.get("items"));
+
+  auto replay = [&](auto &&r) {
+    r.run();
+    r.report(termctl::out());
+    termctl::out() << std::endl;
+  };
+  if (binary_trace::is_trace(pos[0]))
+    replay(replayer<binary_trace>(pos[0], *parser, ropts));
+  else
+    replay(replayer<text_trace>(pos[0], *parser, ropts));
 }
 } // namespace ctf_io
 
 namespace termctl {
 inline basic_command::ptr make_help_command() {
   return std::make_unique<basic_command>("help", [](const auto &) {
-    std::cout << "Available commands:\n";
-    std::cout << "  get  <module>                get the value of <module>\n";
-    std::cout << "  set  <module>|pr/pw <value>  set <module> or <pr/pw> to "
+    out() << "Available commands:\n";
+    out() << "  get  <items>                 get the values of <items>\n";
+    out() << "  set  <items>|pr/pw <value>   set <items> or <pr/pw> to "
                  "<value>\n";
-    std::cout << "  info <module>|all            get the information of "
-                 "<module>\n";
-    std::cout << "  help                         display help text\n";
-    std::cout << "  exit                         quit\n";
+    out() << "  set  <items> = <expr>        set <items> to an expression "
+             "of other items\n";
+    out() << "  info <items>|all             get the information of "
+                 "<items>\n";
+    out() << "  wave <module> <shape> ...    write a periodic waveform to "
+             "<module>\n"
+             "                               shape: sine|ramp|square|triangle|"
+             "noise\n"
+             "                               opts: amp= offset= freq= "
+             "rate=..Hz phase=\n";
+    out() << "  wave list|stop <id>|all      list or stop waveforms\n";
+    out() << "  run  <file>                  run the scenario in <file>\n";
+    out() << "  plant <module> ...           model the 'pr' of <module> from a "
+             "'pw'\n"
+             "                               opts: in= mode=follow|integrate "
+             "gain= offset=\n"
+             "                               lag= deadtime= slew= min= max=\n";
+    out() << "  plant list|stop <module>|all\n"
+             "                               list or stop plant models\n";
+    out() << "  derive <module> = <expr>     keep the 'pr' of <module> equal "
+             "to <expr>\n";
+    out() << "  derive list|stop <module>|all\n"
+             "                               list or stop derived items\n";
+    out() << "  echo start [drv=] [cat=]     mirror 'pw' to 'pr' of items, "
+             "opts: rate=..Hz\n";
+    out() << "  echo stop|status             stop or show the echo\n";
+    out() << "  fault <module> <kind> ...    attach a fault to writes of "
+             "<module>\n"
+             "                               kind: stuck|drift|noise|spike|"
+             "quantize|dropout|latency\n"
+             "                               opts: value= rate= sigma= amp= "
+             "prob= step= delay=\n"
+             "                               after= for= when=<condition> "
+             "side=command|readback\n";
+    out() << "  fault list|clear <id>|all    list or remove faults\n";
+    out() << "  record start <items> ...     record <items> or patterns to a "
+             "trace\n"
+             "                               opts: rate=..Hz file=\n";
+    out() << "  record stop|status           stop or show the recording\n";
+    out() << "  replay <trace> ...           replay a recorded trace\n"
+             "                               opts: speed=0.1..100|afap from= "
+             "to= items=\n";
+    out() << "  capture <items> trigger=..   capture <items> around a "
+             "trigger to CSV\n"
+             "                               opts: pre= post= rate=..Hz "
+             "count= file=\n";
+    out() << "  dash <items>|drv=<driver>    show a live table of <items>, "
+             "opts: rate=..Hz\n";
+    out() << "  watch <items> [interval]     print changes of <items> or "
+             "patterns, e.g. 100ms\n";
+    out() << "  wait <module> <op> <value>   wait until the condition "
+             "holds, op: < <= > >= == !=\n"
+             "                               join more with 'and' or 'or'\n"
+             "                               opts: tol= timeout= fast= slow=\n";
+    out() << "  expect <module> <op> <value> check a value, opts: tol= "
+             "timeout= junit= json=\n";
+    out() << "  expect-file <file>           check every line of <file> in "
+             "one batch, same opts\n";
+    out() << "  history <module> [since]     list journaled get/set of "
+             "<module>, opts: limit=\n";
+    out() << "  shard <command>              run <command> on the worker "
+             "owning its item\n"
+             "                               shard all <command>|load <file>|"
+             "list\n";
+    out() << "  sleep <duration>             wait for <duration>, e.g. 50ms\n";
+    out() << "  jobs                         list background jobs\n";
+    out() << "  fg   [%<job>]                wait for a background job\n";
+    out() << "  kill %<job>                  cancel a background job\n";
+    out() << "  <command> &                  run <command> in background\n";
+    out() << "  <items>                      item names, globs, /regex/, "
+             "drv:<id> dt:<type> cat:IO|Memory\n"
+             "                               joined with ! & | ( ), e.g. "
+             "Chamber.*&dt:Double\n";
+    out() << "  help                         display help text\n";
+    out() << "  exit                         quit\n";
     return true;
   });
 }
@@ -250,6 +1160,67 @@ inline basic_command::ptr make_exit_command() {
   });
 }
 
+inline job::ptr find_job(const basic_command::exec_args &args) {
+  if (args.empty()) {
+    if (auto j = job_table::shared().latest_background(); j)
+      return j;
+    throw std::invalid_argument("no current job");
+  }
+
+  auto spec = std::string_view(args[0]);
+  if (!spec.empty() && spec.front() == '%')
+    spec.remove_prefix(1);
+
+  try {
+    auto pos = std::size_t(0);
+    const auto id = std::stoul(std::string(spec), &pos);
+    if (pos == spec.size())
+      if (auto j = job_table::shared().find(job::id_type(id)); j)
+        return j;
+  } catch (const std::logic_error &) {
+  }
+
+  throw std::invalid_argument("no such job \"" + args[0] + "\"");
+}
+
+inline basic_command::ptr make_jobs_command() {
+  return std::make_unique<basic_command>("jobs", [](const auto &) {
+    for (const auto &j : job_table::shared().list()) {
+      const auto state = j->state();
+      out() << "[" << j->id() << "]  "
+            << (state == job::state_type::running     ? "Running  "
+                : state == job::state_type::cancelled ? "Cancelled"
+                                                      : "Done     ")
+            << "  " << j->line() << "\n";
+    }
+    out().flush();
+    return true;
+  });
+}
+
+inline basic_command::ptr make_fg_command() {
+  return std::make_unique<basic_command>("fg", [](const auto &args) {
+    auto j = find_job(args);
+    out() << j->line() << std::endl;
+    j->set_background(false);
+    // Ctrl-C cancels 'fg' itself, which is passed on to the awaited job.
+    while (!j->wait_for(std::chrono::milliseconds(50)))
+      if (termctl::this_job::stop_requested())
+        j->request_stop();
+    return true;
+  });
+}
+
+inline basic_command::ptr make_kill_command() {
+  return std::make_unique<basic_command>("kill", [](const auto &args) {
+    if (args.empty())
+      throw std::invalid_argument("requires exactly one argument on command");
+    auto j = find_job(args);
+    j->request_stop();
+    return true;
+  });
+}
+
 inline basic_command::ptr make_get_command(conf::io_parser::shared_ptr parser) {
   return std::make_unique<basic_command>(
       "get",
@@ -264,6 +1235,136 @@ inline basic_command::ptr make_set_command(conf::io_parser::shared_ptr parser) {
       parser->item_keys());
 }
 
+inline basic_command::ptr
+make_wave_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "wave",
+      std::bind(ctf_io::perform_command_wave, std::placeholders::_1, parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_run_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "run",
+      std::bind(ctf_io::perform_command_run, std::placeholders::_1, parser));
+}
+
+inline basic_command::ptr
+make_expect_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "expect",
+      std::bind(ctf_io::perform_command_expect, std::placeholders::_1, parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_expect_file_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "expect-file", std::bind(ctf_io::perform_command_expect_file,
+                               std::placeholders::_1, parser));
+}
+
+inline basic_command::ptr
+make_shard_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "shard",
+      std::bind(ctf_io::perform_command_shard, std::placeholders::_1, parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_history_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "history",
+      std::bind(ctf_io::perform_command_history, std::placeholders::_1,
+                parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_plant_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "plant",
+      std::bind(ctf_io::perform_command_plant, std::placeholders::_1, parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_derive_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "derive",
+      std::bind(ctf_io::perform_command_derive, std::placeholders::_1, parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_echo_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "echo",
+      std::bind(ctf_io::perform_command_echo, std::placeholders::_1, parser));
+}
+
+inline basic_command::ptr
+make_fault_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "fault",
+      std::bind(ctf_io::perform_command_fault, std::placeholders::_1, parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_record_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "record",
+      std::bind(ctf_io::perform_command_record, std::placeholders::_1, parser));
+}
+
+inline basic_command::ptr
+make_replay_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "replay",
+      std::bind(ctf_io::perform_command_replay, std::placeholders::_1, parser));
+}
+
+inline basic_command::ptr
+make_capture_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "capture",
+      std::bind(ctf_io::perform_command_capture, std::placeholders::_1,
+                parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_dash_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "dash",
+      std::bind(ctf_io::perform_command_dash, std::placeholders::_1, parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_watch_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "watch",
+      std::bind(ctf_io::perform_command_watch, std::placeholders::_1, parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr
+make_wait_command(conf::io_parser::shared_ptr parser) {
+  return std::make_unique<basic_command>(
+      "wait",
+      std::bind(ctf_io::perform_command_wait, std::placeholders::_1, parser),
+      parser->item_keys());
+}
+
+inline basic_command::ptr make_sleep_command() {
+  return std::make_unique<basic_command>("sleep",
+                                         ctf_io::perform_command_sleep);
+}
+
 inline basic_command::ptr
 make_info_command(conf::io_parser::shared_ptr parser) {
   return std::make_unique<basic_command>(
@@ -1,16 +1,33 @@
 #pragma once
 
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstdlib>
 #include <cstring>
 #include <functional>
 #include <memory>
+#include <ostream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <tuple>
 #include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "args.hpp"
+#include "console.hpp"
 
 namespace termctl {
 class basic_completion {
 public:
   using ptr = std::unique_ptr<basic_completion>;
   using items_type = std::unordered_set<std::string>;
+  // Sorted, so the names sharing a prefix are one contiguous range.
+  using index_type = std::vector<std::string>;
+  using iterator = index_type::const_iterator;
+  using range_type = std::pair<iterator, iterator>;
   using generator_func = std::function<char *(const char *, int)>;
 
   basic_completion() = delete;
@@ -19,19 +36,321 @@ public:
   virtual ~basic_completion() = default;
 
   explicit basic_completion(const items_type &items)
-      : items_(items), iter_(items_.cend()) {}
-  explicit basic_completion(items_type &&items) noexcept
-      : items_(std::move(items)), iter_(items_.cend()) {}
+      : index_(items.cbegin(), items.cend()) {
+    std::sort(index_.begin(), index_.end());
+    iter_ = end_ = index_.cend();
+    masks_.reserve(index_.size());
+    for (const auto &name : index_)
+      masks_.push_back(char_mask(name));
+    used_.assign(index_.size(), 0);
+    if (!separators().empty())
+      build_trie();
+  }
+
+  explicit operator bool() const noexcept { return !index_.empty(); }
+
+  // The names starting with 'prefix' in lexical order, in O(log n).
+  range_type range(std::string_view prefix) const {
+    const auto first =
+        std::lower_bound(index_.cbegin(), index_.cend(), prefix);
+    const auto last = std::upper_bound(
+        first, index_.cend(), prefix,
+        [](std::string_view p, const std::string &name) {
+          return p < std::string_view(name).substr(0, p.size());
+        });
+    return {first, last};
+  }
+
+  // The longest prefix shared by every name starting with 'prefix'; in a
+  // sorted range that is the one shared by its first and last names.
+  std::string common_prefix(std::string_view prefix) const {
+    const auto [first, last] = range(prefix);
+    if (first == last)
+      return std::string(prefix);
+    const auto &a = *first;
+    const auto &b = *std::prev(last);
+    const auto n = std::mismatch(a.cbegin(), a.cend(), b.cbegin(), b.cend());
+    return std::string(a.cbegin(), n.first);
+  }
+
+  struct ranking {
+    // The best 'count' asked for, best first.
+    std::vector<iterator> best;
+    std::size_t total = 0;
+  };
+
+  // The names holding the characters of 'text' in order, e.g. "chpr" for
+  // "Chamber.Pressure". A name scores for characters matched at the start
+  // of a segment or of a camelCase word, for runs of matched characters and
+  // for having been used lately; it loses for every character skipped.
+  ranking fuzzy(std::string_view text,
+                std::size_t count = std::size_t(-1)) const;
 
-  explicit operator bool() const noexcept { return !items_.empty(); }
+  // How many matches the last completion left out of its page.
+  std::size_t more() const noexcept { return more_; }
+  // What to list for 'match' of the last completion: a name as it is, or
+  // the segment it adds to the level listed and how many names are below.
+  std::string label(std::string_view match) const;
+
+  // The page the last completion listed, from 0.
+  std::size_t page() const noexcept { return page_; }
+  // Whether the last completion offered only the common prefix.
+  bool partial() const noexcept { return partial_; }
+  // The page was listed, completing the same text again lists the next.
+  void shown() noexcept { shown_ = !partial_; }
+
+  // Matches listed at once, IOTEST_COMPLETION_LIMIT or 100; 0 for all.
+  static std::size_t page_size() {
+    static const auto size = [] {
+      const auto env = std::getenv("IOTEST_COMPLETION_LIMIT");
+      if (env == nullptr || *env == '\0')
+        return std::size_t(100);
+      try {
+        return parse_count(env);
+      } catch (const std::invalid_argument &e) {
+        err() << "Warning: ignoring IOTEST_COMPLETION_LIMIT, " << e.what()
+              << std::endl;
+        return std::size_t(100);
+      }
+    }();
+    return size;
+  }
+
+  // The characters ending a name segment, IOTEST_COMPLETION_SEPARATORS or
+  // "._"; names complete a segment at a time unless it is set empty.
+  static const std::string &separators() {
+    static const auto seps = [] {
+      const auto env = std::getenv("IOTEST_COMPLETION_SEPARATORS");
+      return std::string(env == nullptr ? "._" : env);
+    }();
+    return seps;
+  }
+
+  // Ranks 'name' above the others in fuzzy matches for a while. Only the
+  // thread completing may call it.
+  void touch(std::string_view name) {
+    const auto [first, last] = range(name);
+    if (first != last && *first == name)
+      used_[std::size_t(first - index_.cbegin())] = ++tick_;
+  }
 
   virtual char *generator(const char *text, int state) = 0;
 
 protected:
-  items_type items_;
-  items_type::const_iterator iter_;
+  // Which characters a name holds, one bit per letter or digit regardless
+  // of case and the rest folded into the remaining bits; a name can only
+  // match if it holds every bit of the text.
+  static std::uint64_t char_mask(std::string_view s) noexcept {
+    auto mask = std::uint64_t(0);
+    for (const auto c : s)
+      mask |= std::uint64_t(1) << char_bit(c);
+    return mask;
+  }
+
+  static unsigned char_bit(char c) noexcept {
+    const auto u = static_cast<unsigned char>(std::tolower(
+        static_cast<unsigned char>(c)));
+    if (u >= 'a' && u <= 'z')
+      return u - 'a';
+    if (u >= '0' && u <= '9')
+      return 26 + (u - '0');
+    return 36 + u % 28;
+  }
+
+  static int score(std::string_view name, std::string_view text) noexcept;
+
+  // A prefix ending at a separator, or a whole name, and the names starting
+  // with it, index_[first, last). Its children, one per next segment, are
+  // trie_[children, end) in lexical order.
+  struct node {
+    std::uint32_t first;
+    std::uint32_t last;
+    std::uint32_t length;
+    std::uint32_t children;
+    std::uint32_t end;
+  };
+  static constexpr auto npos = std::size_t(-1);
+
+  std::string_view prefix(const node &n) const noexcept {
+    return std::string_view(index_[n.first]).substr(0, n.length);
+  }
+
+  void build_trie();
+  // The deepest node 'text' runs through a separator of.
+  std::size_t descend(std::string_view text) const;
+  // The children of node 'k' starting with 'text'.
+  std::pair<std::size_t, std::size_t> children(std::size_t k,
+                                               std::string_view text) const;
+
+  index_type index_;
+  std::vector<std::uint64_t> masks_;
+  // The tick each name was last used at, 0 if never.
+  std::vector<std::uint32_t> used_;
+  std::uint32_t tick_ = 0;
+  // Empty without separators; the root, trie_[0], is the empty prefix.
+  std::vector<node> trie_;
+  iterator iter_;
+  iterator end_;
+
+  // Paging over completions of the same text.
+  std::string text_;
+  std::size_t page_ = 0;
+  std::size_t more_ = 0;
+  bool shown_ = false;
+  bool partial_ = false;
+  // The node whose children were listed, npos for names.
+  std::size_t at_ = npos;
 };
 
+// Level by level, each node's children go to the end, so they are adjacent;
+// one pass over the names below every node.
+inline void basic_completion::build_trie() {
+  const auto &seps = separators();
+  trie_.push_back({0, std::uint32_t(index_.size()), 0, 0, 0});
+  for (std::size_t k = 0; k < trie_.size(); ++k) {
+    const auto first = trie_[k].first;
+    const auto last = trie_[k].last;
+    const auto length = trie_[k].length;
+    trie_[k].children = std::uint32_t(trie_.size());
+    auto i = first;
+    // A name ending at the node is the node itself.
+    if (i < last && index_[i].size() == length)
+      ++i;
+    while (i < last) {
+      const auto &name = index_[i];
+      const auto sep = name.find_first_of(seps, length);
+      const auto next =
+          std::uint32_t(sep == std::string::npos ? name.size() : sep + 1);
+      const auto key = std::string_view(name).substr(0, next);
+      // Names are unique, a whole one has no others below.
+      auto j = i + 1;
+      while (sep != std::string::npos && j < last &&
+             std::string_view(index_[j]).substr(0, next) == key)
+        ++j;
+      trie_.push_back({i, j, next, 0, 0});
+      i = j;
+    }
+    trie_[k].end = std::uint32_t(trie_.size());
+  }
+}
+
+inline std::pair<std::size_t, std::size_t>
+basic_completion::children(std::size_t k, std::string_view text) const {
+  const auto first = trie_.cbegin() + trie_[k].children;
+  const auto last = trie_.cbegin() + trie_[k].end;
+  const auto lo = std::partition_point(
+      first, last, [&](const node &n) { return prefix(n) < text; });
+  const auto hi = std::partition_point(lo, last, [&](const node &n) {
+    return prefix(n).substr(0, text.size()) == text;
+  });
+  return {std::size_t(lo - trie_.cbegin()), std::size_t(hi - trie_.cbegin())};
+}
+
+inline std::size_t basic_completion::descend(std::string_view text) const {
+  auto k = std::size_t(0);
+  for (;;) {
+    const auto sep = text.find_first_of(separators(), trie_[k].length);
+    if (sep == std::string_view::npos)
+      return k;
+    // Children are cut at their first separator, only one can match.
+    const auto key = text.substr(0, sep + 1);
+    const auto [first, last] = children(k, key);
+    if (first == last || prefix(trie_[first]) != key)
+      return k;
+    k = first;
+  }
+}
+
+inline std::string basic_completion::label(std::string_view match) const {
+  if (at_ == npos)
+    return std::string(match);
+  const auto [first, last] = children(at_, match);
+  auto text = std::string(match.substr(trie_[at_].length));
+  if (first == last || prefix(trie_[first]) != match)
+    return text;
+  const auto &n = trie_[first];
+  if (n.last - n.first > 1 || index_[n.first].size() != n.length)
+    text += " (" + std::to_string(n.last - n.first) + ")";
+  return text;
+}
+
+// Matches each character of 'text' at its first place in 'name', ignoring
+// case; returns the score, or a negative value without a match.
+inline int basic_completion::score(std::string_view name,
+                                   std::string_view text) noexcept {
+  const auto lower = [](char c) {
+    return std::tolower(static_cast<unsigned char>(c));
+  };
+  const auto boundary = [&](std::size_t i) {
+    if (i == 0)
+      return true;
+    const auto prev = static_cast<unsigned char>(name[i - 1]);
+    const auto cur = static_cast<unsigned char>(name[i]);
+    return !std::isalnum(prev) || (std::islower(prev) && std::isupper(cur)) ||
+           (std::isalpha(prev) && std::isdigit(cur));
+  };
+
+  auto total = 0;
+  auto last = std::string_view::npos;
+  auto i = std::size_t(0);
+  for (const auto c : text) {
+    while (i < name.size() && lower(name[i]) != lower(c))
+      ++i;
+    if (i == name.size())
+      return -1;
+    if (boundary(i))
+      total += i == 0 ? 16 : 8;
+    if (last != std::string_view::npos && i == last + 1)
+      total += 4;
+    else if (last != std::string_view::npos)
+      total -= std::min<int>(int(i - last - 1), 8);
+    if (name[i] == c)
+      total += 1;
+    last = i++;
+  }
+  return total + 100;
+}
+
+inline basic_completion::ranking
+basic_completion::fuzzy(std::string_view text, std::size_t count) const {
+  struct ranked {
+    int score;
+    iterator it;
+  };
+
+  const auto mask = char_mask(text);
+  auto hits = std::vector<ranked>();
+  for (std::size_t i = 0; i < index_.size(); ++i) {
+    if ((masks_[i] & mask) != mask)
+      continue;
+    auto s = score(index_[i], text);
+    if (s < 0)
+      continue;
+    // The latest used gets 16 more, the earliest a bit over 8.
+    if (used_[i] != 0)
+      s += 8 + int(8 * std::uint64_t(used_[i]) / tick_);
+    hits.push_back({s, index_.cbegin() + std::ptrdiff_t(i)});
+  }
+
+  // Ties go to the shorter name, then in lexical order. Only what is asked
+  // for is sorted.
+  const auto better = [](const ranked &a, const ranked &b) {
+    if (a.score != b.score)
+      return a.score > b.score;
+    if (a.it->size() != b.it->size())
+      return a.it->size() < b.it->size();
+    return a.it < b.it;
+  };
+  const auto n = std::min(count, hits.size());
+  std::partial_sort(hits.begin(), hits.begin() + std::ptrdiff_t(n),
+                    hits.end(), better);
+  auto r = ranking{{}, hits.size()};
+  r.best.reserve(n);
+  for (std::size_t i = 0; i < n; ++i)
+    r.best.push_back(hits[i].it);
+  return r;
+}
+
 class completion final : public basic_completion {
 public:
   using basic_completion::basic_completion;
@@ -40,26 +359,125 @@ public:
     return std::make_unique<completion>(items);
   }
 
-  static ptr make_unique(items_type &&items) noexcept {
-    return std::make_unique<completion>(std::move(items));
-  }
-
   char *generator(const char *text, int state) override;
+
+private:
+  void start(std::string_view text);
+
+  void start_segments(std::string_view text, range_type names,
+                      std::size_t limit);
+
+  std::vector<iterator> ranked_;
+  std::size_t next_ = 0;
+  std::string common_;
+  // The page of trie_ nodes to hand out.
+  std::size_t child_ = 0;
+  std::size_t child_end_ = 0;
 };
 
+// Names starting with 'text' come out in lexical order, every name for
+// empty input, or with separators the next segments of them; without any,
+// the fuzzy matches do, best first. Beyond a page of them, the first
+// completion offers just their common prefix if it adds anything, and each
+// listing moves on to the next page; only the page is ever copied out.
+inline void completion::start(std::string_view text) {
+  const auto limit = page_size() ? page_size() : std::size_t(-1);
+  if (text != text_ || limit == std::size_t(-1))
+    page_ = 0;
+  else if (shown_)
+    ++page_;
+  text_ = text;
+  shown_ = partial_ = false;
+  more_ = next_ = child_ = child_end_ = 0;
+  at_ = npos;
+  ranked_.clear();
+  common_.clear();
+
+  auto [first, last] = range(text);
+  const auto total = std::size_t(last - first);
+  iter_ = end_ = last;
+
+  if (total == 0) {
+    if (text.empty())
+      return;
+    // Past the last page, the first comes round again.
+    auto r = fuzzy(text, (page_ + 1) * limit);
+    if (page_ * limit >= r.total)
+      page_ = 0;
+    const auto skip = std::min(page_ * limit, r.best.size());
+    const auto end = std::min(skip + limit, r.best.size());
+    ranked_.assign(r.best.begin() + std::ptrdiff_t(skip),
+                   r.best.begin() + std::ptrdiff_t(end));
+    more_ = r.total - end;
+    return;
+  }
+
+  if (!trie_.empty()) {
+    start_segments(text, {first, last}, limit);
+    if (at_ != npos || partial_)
+      return;
+  }
+
+  if (total > limit && page_ == 0) {
+    if (auto common = common_prefix(text); common.size() > text.size()) {
+      common_ = std::move(common);
+      partial_ = true;
+      return;
+    }
+  }
+  if (page_ * limit >= total)
+    page_ = 0;
+  iter_ = first + std::ptrdiff_t(page_ * limit);
+  end_ = iter_ + std::ptrdiff_t(std::min(limit, std::size_t(last - iter_)));
+  more_ = std::size_t(last - end_);
+}
+
+// Lists the segments following the deepest level 'text' reaches. One
+// segment alone is gone down as far as the names below agree.
+inline void completion::start_segments(std::string_view text,
+                                       range_type names, std::size_t limit) {
+  const auto k = descend(text);
+  const auto [first, last] = children(k, text);
+  const auto count = last - first;
+  if (count == 0 || (count == 1 && names.second - names.first == 1))
+    return;
+  if (count == 1) {
+    common_ = common_prefix(text);
+    partial_ = true;
+    return;
+  }
+
+  if (count > limit && page_ == 0) {
+    const auto a = prefix(trie_[first]);
+    const auto b = prefix(trie_[last - 1]);
+    const auto n = std::mismatch(a.cbegin(), a.cend(), b.cbegin(), b.cend());
+    if (auto common = std::string(a.cbegin(), n.first);
+        common.size() > text.size()) {
+      common_ = std::move(common);
+      partial_ = true;
+      return;
+    }
+  }
+  if (page_ * limit >= count)
+    page_ = 0;
+  at_ = k;
+  child_ = first + page_ * limit;
+  child_end_ = child_ + std::min(limit, last - child_);
+  more_ = last - child_end_;
+}
+
 inline char *completion::generator(const char *text, int state) {
   if (state == 0)
-    iter_ = items_.cbegin();
-
-  const auto len = std::strlen(text);
-  if (len)
-    while (iter_ != items_.cend()) {
-      const auto &item = *iter_;
-      ++iter_;
-      if (item.compare(0, len, text) == 0)
-        return strdup(item.c_str());
-    }
+    start(text);
 
-  return nullptr;
+  if (partial_)
+    return state == 0 ? strdup(common_.c_str()) : nullptr;
+  if (child_ < child_end_)
+    return strdup(std::string(prefix(trie_[child_++])).c_str());
+  if (next_ < ranked_.size())
+    return strdup(ranked_[next_++]->c_str());
+  if (iter_ == end_)
+    return nullptr;
+  return strdup((iter_++)->c_str());
 }
 } // namespace termctl
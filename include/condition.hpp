@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cmath>
+#include <cstddef>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace ctf_io {
+// A comparison of an item's value against a constant, e.g. "Temp > 50" or
+// "Valve.Open == 1 tol=0". The tolerance widens '==' and '!='.
+struct condition {
+  enum class op_type { lt, le, gt, ge, eq, ne };
+
+  std::string item;
+  op_type op = op_type::eq;
+  double value = 0.0;
+  double tol = 0.0;
+
+  // Accepts "A<3" as one token as well as "A < 3" split over three.
+  static condition parse(const std::vector<std::string> &tokens) {
+    auto expr = std::string();
+    for (const auto &t : tokens)
+      expr += t;
+    return parse(expr);
+  }
+
+  static condition parse(std::string_view expr) {
+    const auto pos = expr.find_first_of("<>=!");
+    if (pos == std::string_view::npos || pos == 0)
+      throw std::invalid_argument("invalid condition \"" + std::string(expr) +
+                                  "\"");
+
+    constexpr std::pair<std::string_view, op_type> ops[] = {
+        {"<=", op_type::le}, {">=", op_type::ge}, {"==", op_type::eq},
+        {"!=", op_type::ne}, {"<", op_type::lt},  {">", op_type::gt},
+        {"=", op_type::eq}};
+
+    auto cond = condition();
+    cond.item = std::string(trim(expr.substr(0, pos)));
+    auto len = std::size_t(0);
+    for (const auto &[tok, op] : ops)
+      if (expr.substr(pos, tok.size()) == tok) {
+        cond.op = op;
+        len = tok.size();
+        break;
+      }
+    if (len == 0)
+      throw std::invalid_argument("invalid condition \"" + std::string(expr) +
+                                  "\"");
+
+    const auto rhs = std::string(trim(expr.substr(pos + len)));
+    auto end = std::size_t(0);
+    try {
+      cond.value = std::stod(rhs, &end);
+    } catch (const std::logic_error &) {
+      end = 0;
+    }
+    if (rhs.empty() || end != rhs.size() || !std::isfinite(cond.value))
+      throw std::invalid_argument("invalid value in condition \"" +
+                                  std::string(expr) + "\"");
+    return cond;
+  }
+
+  void set_tol(double t) {
+    if (!std::isfinite(t) || t < 0)
+      throw std::invalid_argument("invalid tolerance");
+    tol = t;
+  }
+
+  bool eval(double v) const noexcept {
+    switch (op) {
+    case op_type::lt:
+      return v < value;
+    case op_type::le:
+      return v <= value;
+    case op_type::gt:
+      return v > value;
+    case op_type::ge:
+      return v >= value;
+    case op_type::eq:
+      return std::fabs(v - value) <= tol;
+    default:
+      return std::fabs(v - value) > tol;
+    }
+  }
+
+  // How far 'v' is from satisfying the condition, 0 once it holds.
+  double distance(double v) const noexcept {
+    return eval(v) ? 0.0 : std::fabs(v - value);
+  }
+
+  static const char *op_to_str(op_type op) noexcept {
+    switch (op) {
+    case op_type::lt:
+      return "<";
+    case op_type::le:
+      return "<=";
+    case op_type::gt:
+      return ">";
+    case op_type::ge:
+      return ">=";
+    case op_type::eq:
+      return "==";
+    default:
+      return "!=";
+    }
+  }
+
+  friend std::ostream &operator<<(std::ostream &os, const condition &c) {
+    os << c.item << " " << op_to_str(c.op) << " " << c.value;
+    if (c.tol > 0 && (c.op == op_type::eq || c.op == op_type::ne))
+      os << " tol=" << c.tol;
+    return os;
+  }
+
+private:
+  static std::string_view trim(std::string_view s) noexcept {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+      s.remove_prefix(1);
+    while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+      s.remove_suffix(1);
+    return s;
+  }
+};
+} // namespace ctf_io
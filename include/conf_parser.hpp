@@ -1,5 +1,8 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <cstddef>
 #include <cstdint>
 #include <cstdlib>
 #include <filesystem>
@@ -13,6 +16,7 @@
 #include <string_view>
 #include <unordered_map>
 #include <unordered_set>
+#include <utility>
 #include <vector>
 
 #include <rapidxml.hpp>
@@ -108,6 +112,65 @@ inline void basic_parser::reload(const std::filesystem::path &filepath) {
 } // namespace conf
 
 namespace conf {
+// A set of items by their position in name order, one bit each, so sets
+// combine a word at a time.
+class item_set {
+public:
+  item_set() = default;
+  explicit item_set(std::size_t size, bool all = false)
+      : size_(size), words_((size + 63) / 64, all ? ~std::uint64_t(0) : 0) {
+    trim();
+  }
+
+  std::size_t size() const noexcept { return size_; }
+  bool test(std::size_t i) const noexcept {
+    return (words_[i / 64] >> (i % 64)) & 1;
+  }
+  void set(std::size_t i) noexcept {
+    words_[i / 64] |= std::uint64_t(1) << (i % 64);
+  }
+
+  std::size_t count() const noexcept {
+    auto n = std::size_t(0);
+    for (const auto w : words_)
+      n += std::size_t(std::popcount(w));
+    return n;
+  }
+
+  item_set &operator&=(const item_set &other) noexcept {
+    for (std::size_t i = 0; i < words_.size(); ++i)
+      words_[i] &= other.words_[i];
+    return *this;
+  }
+  item_set &operator|=(const item_set &other) noexcept {
+    for (std::size_t i = 0; i < words_.size(); ++i)
+      words_[i] |= other.words_[i];
+    return *this;
+  }
+  item_set &flip() noexcept {
+    for (auto &w : words_)
+      w = ~w;
+    trim();
+    return *this;
+  }
+
+  // Calls f(i) for each item in the set, in order.
+  template <typename F> void for_each(F &&f) const {
+    for (std::size_t k = 0; k < words_.size(); ++k)
+      for (auto w = words_[k]; w != 0; w &= w - 1)
+        f(k * 64 + std::size_t(std::countr_zero(w)));
+  }
+
+private:
+  void trim() noexcept {
+    if (size_ % 64 != 0)
+      words_.back() &= (std::uint64_t(1) << (size_ % 64)) - 1;
+  }
+
+  std::size_t size_ = 0;
+  std::vector<std::uint64_t> words_;
+};
+
 class io_parser final : public basic_parser {
   static constexpr auto root_node_k = "IODEF";
   static constexpr auto drvs_node_k = "DRIVERS";
@@ -185,7 +248,7 @@ public:
           driver_id(parse_driver_id(node)), name(node_get_attr(node, "name")),
           pr(node_get_attr(node, "pr")), pw(node_get_attr(node, "pw")) {}
 
-    void pretty_print() const noexcept {
+    void pretty_print(std::ostream &os = std::cout) const noexcept {
       std::stringstream ss;
       ss << "[name: " << name << "]";
       ss << "[dt: " << data_type_to_str(dt) << "]";
@@ -195,7 +258,7 @@ public:
          << "]";
       ss << "[pr: " << (pr.empty() ? "Nil" : pr) << "]";
       ss << "[pw: " << (pw.empty() ? "Nil" : pw) << "]";
-      std::cout << ss.str() << std::endl;
+      os << ss.str() << std::endl;
     }
 
   private:
@@ -235,6 +298,30 @@ public:
     }
   };
 
+  // Built at load: the items in name order, and the sets of them with each
+  // driver, data type and category.
+  struct index_type {
+    std::vector<const item *> items;
+    std::unordered_map<std::int32_t, item_set> drivers;
+    std::vector<item_set> types;
+    std::vector<item_set> categories;
+
+    // The items whose names start with 'prefix', [first, last).
+    std::pair<std::size_t, std::size_t>
+    range(std::string_view prefix) const noexcept {
+      const auto first = std::partition_point(
+          items.cbegin(), items.cend(),
+          [&](const item *i) { return i->name < prefix; });
+      const auto last =
+          std::partition_point(first, items.cend(), [&](const item *i) {
+            return std::string_view(i->name).substr(0, prefix.size()) ==
+                   prefix;
+          });
+      return {std::size_t(first - items.cbegin()),
+              std::size_t(last - items.cbegin())};
+    }
+  };
+
   explicit io_parser(const std::string env_key = ioconf_path_k)
       : basic_parser() {
     const auto value = std::getenv(env_key.c_str());
@@ -260,8 +347,18 @@ public:
     return std::make_shared<io_parser>();
   }
 
+  // Loads 'filepath' instead of the file the environment points to.
+  static io_parser::shared_ptr
+  make_shared(const std::filesystem::path &filepath) {
+    auto parser = io_parser::shared_ptr(new io_parser(from_file_tag{}));
+    parser->reload(filepath);
+    return parser;
+  }
+
+  const drivers_type &drivers() const noexcept { return drivers_; }
   const items_type &items() const noexcept { return items_; }
   const item_keys_type &item_keys() const noexcept { return item_keys_; }
+  const index_type &index() const noexcept { return index_; }
 
   std::optional<driver> find_driver(std::uint32_t id) const {
     if (auto it = drivers_.find(id); it != drivers_.cend())
@@ -278,9 +375,15 @@ public:
   void reload(const std::filesystem::path &filepath = {}) override;
 
 private:
+  struct from_file_tag {};
+  explicit io_parser(from_file_tag) : basic_parser() {}
+
   drivers_type drivers_;
   items_type items_;
   item_keys_type item_keys_;
+  index_type index_;
+
+  void build_index();
 
   static std::string node_get_attr(const node_type *node,
                                    const std::string &name) {
@@ -327,5 +430,28 @@ inline void io_parser::reload(const std::filesystem::path &filepath) {
   drivers_ = std::move(drivers);
   items_ = std::move(items);
   item_keys_ = std::move(item_keys);
+  build_index();
+}
+
+inline void io_parser::build_index() {
+  auto index = index_type();
+  index.items.reserve(items_.size());
+  for (const auto &[name, i] : items_)
+    index.items.push_back(&i);
+  std::sort(index.items.begin(), index.items.end(),
+            [](const item *a, const item *b) { return a->name < b->name; });
+
+  const auto n = index.items.size();
+  index.types.assign(std::size_t(item::data_type::string_val) + 1,
+                     item_set(n));
+  index.categories.assign(std::size_t(item::category_type::io) + 1,
+                          item_set(n));
+  for (std::size_t k = 0; k < n; ++k) {
+    const auto &i = *index.items[k];
+    index.drivers.try_emplace(i.driver_id, n).first->second.set(k);
+    index.types[std::size_t(i.dt)].set(k);
+    index.categories[std::size_t(i.category)].set(k);
+  }
+  index_ = std::move(index);
 }
 } // namespace conf
@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstdio>
+#include <iostream>
+#include <mutex>
+#include <ostream>
+#include <streambuf>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace termctl {
+class console final {
+public:
+  enum class stream_type { out, err };
+  using message = std::pair<stream_type, std::string>;
+  using messages_type = std::vector<message>;
+
+  console(const console &) = delete;
+  console &operator=(const console &) = delete;
+
+  static console &shared() {
+    static console console_;
+    return console_;
+  }
+
+  // While attached, messages are queued for the terminal loop to print above
+  // the prompt; otherwise they are written straight through.
+  void attach() noexcept {
+    std::lock_guard<std::mutex> lock(mutex_);
+    attached_ = true;
+  }
+
+  void detach() {
+    auto pending = take();
+    std::lock_guard<std::mutex> lock(mutex_);
+    attached_ = false;
+    write(pending);
+  }
+
+  void post(stream_type type, std::string &&text) {
+    if (text.empty())
+      return;
+
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!attached_) {
+      write(messages_type{{type, std::move(text)}});
+      return;
+    }
+
+    pending_.emplace_back(type, std::move(text));
+    lock.unlock();
+    notify(wake_event);
+  }
+
+  messages_type take() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (held_)
+      return {};
+    return std::exchange(pending_, {});
+  }
+
+  // While held, messages stay queued, e.g. while a full-screen view owns the
+  // terminal; releasing wakes the terminal loop to print them.
+  void hold(bool held) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      held_ = held;
+    }
+    if (!held)
+      notify(wake_event);
+  }
+
+  static void write(const messages_type &msgs) {
+    for (const auto &[type, text] : msgs)
+      (type == stream_type::err ? std::cerr : std::cout) << text;
+    std::cout.flush();
+    std::cerr.flush();
+  }
+
+  // The read end of the wake pipe, polled by the terminal loop.
+  int wake_fd() const noexcept { return wake_fds_[0]; }
+
+  // Async-signal-safe, may be called from a signal handler.
+  void notify(char event) noexcept {
+#ifndef _WIN32
+    if (wake_fds_[1] >= 0)
+      [[maybe_unused]] auto n = ::write(wake_fds_[1], &event, 1);
+#else
+    (void)event;
+#endif
+  }
+
+  static constexpr char wake_event = 'w';
+  static constexpr char interrupt_event = 'i';
+
+private:
+  console() {
+#ifndef _WIN32
+    if (::pipe(wake_fds_) == 0)
+      for (auto fd : wake_fds_) {
+        ::fcntl(fd, F_SETFL, ::fcntl(fd, F_GETFL) | O_NONBLOCK);
+        ::fcntl(fd, F_SETFD, FD_CLOEXEC);
+      }
+    else
+      wake_fds_[0] = wake_fds_[1] = -1;
+#endif
+  }
+
+  std::mutex mutex_;
+  messages_type pending_;
+  bool attached_ = false;
+  bool held_ = false;
+  int wake_fds_[2] = {-1, -1};
+};
+
+// Collects whatever a thread writes and hands it to the console in one piece
+// on every flush or newline, so lines of concurrent jobs never interleave.
+class console_buf final : public std::streambuf {
+public:
+  explicit console_buf(console::stream_type type) : type_(type) {}
+  ~console_buf() override { sync(); }
+
+protected:
+  int_type overflow(int_type ch) override {
+    if (traits_type::eq_int_type(ch, traits_type::eof()))
+      return traits_type::not_eof(ch);
+    buffer_.push_back(traits_type::to_char_type(ch));
+    return ch;
+  }
+
+  std::streamsize xsputn(const char *s, std::streamsize n) override {
+    buffer_.append(s, static_cast<std::size_t>(n));
+    return n;
+  }
+
+  int sync() override {
+    console::shared().post(type_, std::exchange(buffer_, {}));
+    return 0;
+  }
+
+private:
+  console::stream_type type_;
+  std::string buffer_;
+};
+
+namespace detail {
+inline thread_local std::ostream *out_stream = nullptr;
+inline thread_local std::ostream *err_stream = nullptr;
+inline thread_local bool *failed = nullptr;
+} // namespace detail
+
+// Streams commands should print to instead of std::cout/std::cerr, they follow
+// whatever the current thread was redirected to.
+inline std::ostream &out() {
+  return detail::out_stream ? *detail::out_stream : std::cout;
+}
+
+inline std::ostream &err() {
+  return detail::err_stream ? *detail::err_stream : std::cerr;
+}
+
+// Flags the command running on this thread as failed, for commands that
+// print a [FAIL] line and carry on instead of throwing.
+inline void mark_failed() noexcept {
+  if (detail::failed != nullptr)
+    *detail::failed = true;
+}
+
+// Redirects out() and err() of the current thread, and mark_failed() to
+// 'failed' if one is given.
+class scoped_output final {
+public:
+  scoped_output(const scoped_output &) = delete;
+  scoped_output &operator=(const scoped_output &) = delete;
+
+  scoped_output(std::ostream &os, std::ostream &es, bool *failed = nullptr)
+      : prev_out_(std::exchange(detail::out_stream, &os)),
+        prev_err_(std::exchange(detail::err_stream, &es)),
+        prev_failed_(failed ? std::exchange(detail::failed, failed)
+                            : detail::failed) {}
+
+  ~scoped_output() {
+    detail::out_stream->flush();
+    detail::err_stream->flush();
+    detail::out_stream = prev_out_;
+    detail::err_stream = prev_err_;
+    detail::failed = prev_failed_;
+  }
+
+private:
+  std::ostream *prev_out_;
+  std::ostream *prev_err_;
+  bool *prev_failed_;
+};
+} // namespace termctl
@@ -0,0 +1,402 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <clocale>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <limits>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#ifndef _WIN32
+// Functions instead of macros, which would clash with names like move().
+#define NCURSES_NOMACROS
+#include <curses.h>
+#include <unistd.h>
+#endif
+
+#include "channel.hpp"
+#include "console.hpp"
+#include "jobs.hpp"
+#include "task.hpp"
+#include "variant.hpp"
+
+namespace ctf_io {
+// A full-screen table of live values. A sampler thread reads the items and
+// keeps per-row state; the UI thread, which is the calling job's, copies
+// the visible rows each frame and writes only the cells whose text changed,
+// so a frame of a settled dashboard sends next to nothing to the terminal.
+class dashboard final {
+public:
+  using clock_type = std::chrono::steady_clock;
+
+  dashboard(std::vector<channel> &&chs, double rate);
+  ~dashboard() { stop_sampler(); }
+
+  dashboard(const dashboard &) = delete;
+  dashboard &operator=(const dashboard &) = delete;
+
+  // Runs until 'q' or the job is stopped.
+  void run();
+  void report(std::ostream &os) const;
+
+private:
+  // Samples kept for the sparkline, one per 'trend_step'.
+  static constexpr std::size_t trend_size = 16;
+  static constexpr auto trend_step = std::chrono::milliseconds(500);
+
+  struct row {
+    std::string value;
+    std::optional<variant::raw_type> raw;
+    double min = std::numeric_limits<double>::infinity();
+    double max = -std::numeric_limits<double>::infinity();
+    std::array<double, trend_size> trend{};
+    std::size_t trend_len = 0;
+    clock_type::time_point changed;
+    bool ok = false;
+  };
+
+  enum column {
+    name_col,
+    value_col,
+    age_col,
+    min_col,
+    max_col,
+    trend_col,
+    status_col,
+    column_count
+  };
+
+  void run_sampler();
+  void sample(clock_type::time_point now, bool trend);
+  void stop_sampler();
+
+  std::vector<std::string> cells(std::size_t index, const row &r,
+                                 clock_type::time_point now) const;
+  static std::string age(clock_type::duration d);
+  std::string sparkline(const row &r) const;
+
+  std::vector<channel> channels_;
+  double rate_;
+  clock_type::duration period_;
+  bool unicode_ = false;
+
+  std::mutex mutex_;
+  std::vector<row> rows_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread sampler_;
+
+  std::uint64_t frames_ = 0;
+  std::uint64_t cells_drawn_ = 0;
+  clock_type::duration elapsed_{};
+};
+
+inline dashboard::dashboard(std::vector<channel> &&chs, double rate)
+    : channels_(std::move(chs)), rate_(rate),
+      period_(runtime::rate_period(rate)), rows_(channels_.size()) {}
+
+inline void dashboard::sample(clock_type::time_point now, bool trend) {
+  // Items are read without the lock, which only guards the rows.
+  auto values = std::vector<std::optional<variant::raw_type>>(channels_.size());
+  for (std::size_t i = 0; i < channels_.size(); ++i)
+    if (auto v = channels_[i].read(); v)
+      values[i] = v->get();
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::size_t i = 0; i < rows_.size(); ++i) {
+    auto &r = rows_[i];
+    r.ok = values[i].has_value();
+    if (!r.ok)
+      continue;
+    if (r.raw != values[i]) {
+      r.raw = std::move(values[i]);
+      r.changed = now;
+      r.value = std::visit(
+          [](const auto &v) {
+            if constexpr (std::is_same_v<std::decay_t<decltype(v)>,
+                                         std::string>)
+              return v;
+            else
+              return std::to_string(v);
+          },
+          *r.raw);
+    }
+    if (const auto d = std::visit(
+            [](const auto &v) -> std::optional<double> {
+              if constexpr (std::is_arithmetic_v<std::decay_t<decltype(v)>>)
+                return double(v);
+              else
+                return std::nullopt;
+            },
+            *r.raw)) {
+      r.min = std::min(r.min, *d);
+      r.max = std::max(r.max, *d);
+      if (trend) {
+        std::move(r.trend.begin() + 1, r.trend.end(), r.trend.begin());
+        r.trend.back() = *d;
+        r.trend_len = std::min(r.trend_len + 1, trend_size);
+      }
+    }
+  }
+}
+
+inline void dashboard::run_sampler() {
+  const auto period = period_;
+  const auto start = clock_type::now();
+  auto next_trend = start;
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (std::int64_t k = 0;; ++k) {
+    const auto deadline = start + period * k;
+    if (cv_.wait_until(lock, deadline, [this] { return stop_; }))
+      return;
+    const auto now = clock_type::now();
+    if (now - deadline >= period)
+      k += (now - deadline) / period;
+
+    const auto trend = now >= next_trend;
+    if (trend)
+      next_trend = now + trend_step;
+    lock.unlock();
+    sample(now, trend);
+    lock.lock();
+  }
+}
+
+inline void dashboard::stop_sampler() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (sampler_.joinable())
+    sampler_.join();
+}
+
+inline std::string dashboard::age(clock_type::duration d) {
+  const auto s = std::chrono::duration_cast<std::chrono::seconds>(d).count();
+  if (s < 1)
+    return "<1s";
+  if (s < 60)
+    return std::to_string(s) + "s";
+  if (s < 3600)
+    return std::to_string(s / 60) + "m";
+  return std::to_string(s / 3600) + "h";
+}
+
+inline std::string dashboard::sparkline(const row &r) const {
+  static constexpr const char *blocks[] = {"▁", "▂", "▃", "▄",
+                                           "▅", "▆", "▇", "█"};
+  static constexpr char ascii[] = "_.-~=+*#";
+  if (r.trend_len == 0)
+    return {};
+
+  const auto first = r.trend.end() - std::ptrdiff_t(r.trend_len);
+  const auto [lo, hi] = std::minmax_element(first, r.trend.end());
+  auto s = std::string();
+  for (auto it = first; it != r.trend.end(); ++it) {
+    const auto level =
+        *hi > *lo ? std::size_t(std::lround((*it - *lo) / (*hi - *lo) * 7))
+                  : std::size_t(0);
+    if (unicode_)
+      s += blocks[level];
+    else
+      s += ascii[level];
+  }
+  return s;
+}
+
+inline std::vector<std::string>
+dashboard::cells(std::size_t index, const row &r,
+                 clock_type::time_point now) const {
+  auto c = std::vector<std::string>(column_count);
+  c[name_col] = channels_[index].name();
+  if (r.raw) {
+    c[value_col] = r.value;
+    c[age_col] = age(now - r.changed);
+    if (r.min <= r.max) {
+      char buf[32];
+      std::snprintf(buf, sizeof(buf), "%.6g", r.min);
+      c[min_col] = buf;
+      std::snprintf(buf, sizeof(buf), "%.6g", r.max);
+      c[max_col] = buf;
+    }
+    c[trend_col] = sparkline(r);
+  }
+  c[status_col] = r.ok ? "OK" : "FAIL";
+  return c;
+}
+
+#ifndef _WIN32
+inline void dashboard::run() {
+  if (!::isatty(STDIN_FILENO) || !::isatty(STDOUT_FILENO))
+    throw std::runtime_error("dash needs a terminal");
+  if (auto *job = termctl::this_job::current(); job && job->background())
+    throw std::runtime_error("dash cannot run in the background");
+
+  // The sparkline uses block characters when the locale can show them.
+  std::setlocale(LC_CTYPE, "");
+  unicode_ = MB_CUR_MAX > 1;
+
+  // Output of other jobs waits until the screen is handed back.
+  struct screen_guard {
+    SCREEN *screen = ::newterm(nullptr, stdout, stdin);
+    screen_guard() { termctl::console::shared().hold(true); }
+    ~screen_guard() {
+      if (screen != nullptr) {
+        ::endwin();
+        ::delscreen(screen);
+      }
+      termctl::console::shared().hold(false);
+    }
+  } guard;
+  if (guard.screen == nullptr)
+    throw std::runtime_error("could not initialize the terminal");
+  ::cbreak();
+  ::noecho();
+  ::keypad(stdscr, TRUE);
+  ::curs_set(0);
+
+  stop_ = false;
+  sampler_ = std::thread(&dashboard::run_sampler, this);
+  struct sampler_guard {
+    dashboard *self;
+    ~sampler_guard() { self->stop_sampler(); }
+  } stopper{this};
+
+  auto widths = std::array<int, column_count>{0, 16, 5, 12, 12,
+                                               int(trend_size), 4};
+  for (const auto &ch : channels_)
+    widths[name_col] =
+        std::max(widths[name_col], std::min(int(ch.name().size()), 40));
+
+  // Text last written to each cell, by screen line and column.
+  auto drawn = std::vector<std::vector<std::string>>();
+  auto put = [&](int y, int x, int width, const std::string &text,
+                 std::string &cache) {
+    if (cache == text)
+      return;
+    ::mvaddnstr(y, x, text.c_str(), -1);
+    // Pad over what a longer text left behind.
+    for (auto n = int(text.size()); n < int(cache.size()) || n < width; ++n)
+      ::addch(' ');
+    cache = text;
+    ++cells_drawn_;
+  };
+
+  const auto period = period_;
+  const auto start = clock_type::now();
+  auto top = std::size_t(0);
+  auto visible = std::vector<row>();
+  auto quit = false;
+  for (std::int64_t k = 0; !quit && !termctl::this_job::stop_requested();
+       ++k) {
+    const auto lines = std::size_t(std::max(LINES - 1, 1));
+    top = std::min(top, channels_.size() - std::min(channels_.size(), lines));
+    const auto count = std::min(channels_.size() - top, lines);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      visible.assign(rows_.begin() + std::ptrdiff_t(top),
+                     rows_.begin() + std::ptrdiff_t(top + count));
+    }
+
+    if (drawn.size() != lines + 1) {
+      drawn.assign(lines + 1, std::vector<std::string>(column_count));
+      ::clear();
+    }
+
+    char head[160];
+    std::snprintf(head, sizeof(head),
+                  "dash: %zu items at %.0fHz, rows %zu-%zu  [q] quit  "
+                  "[up/down/PgUp/PgDn] scroll",
+                  channels_.size(), rate_, count ? top + 1 : 0, top + count);
+    put(0, 0, COLS, head, drawn[0][0]);
+
+    const auto now = clock_type::now();
+    for (std::size_t i = 0; i < lines; ++i) {
+      const auto y = int(i) + 1;
+      auto &cache = drawn[i + 1];
+      if (i >= count) {
+        if (std::any_of(cache.begin(), cache.end(),
+                        [](const auto &c) { return !c.empty(); })) {
+          ::move(y, 0);
+          ::clrtoeol();
+          cache.assign(column_count, {});
+        }
+        continue;
+      }
+
+      auto text = cells(top + i, visible[i], now);
+      auto x = 0;
+      for (int c = 0; c < column_count; ++c) {
+        // The sparkline is multibyte but never wider than its column.
+        if (c != trend_col && int(text[c].size()) > widths[c])
+          text[c].resize(std::size_t(widths[c]));
+        const auto fail = c == status_col && !visible[i].ok;
+        if (fail)
+          ::attron(A_BOLD);
+        put(y, x, widths[c], text[c], cache[c]);
+        if (fail)
+          ::attroff(A_BOLD);
+        x += widths[c] + 2;
+      }
+    }
+    ::refresh();
+    ++frames_;
+
+    // Keys are handled until the next frame is due.
+    const auto deadline = start + period * (k + 1);
+    while (!quit) {
+      const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          deadline - clock_type::now());
+      if (left.count() <= 0)
+        break;
+      ::timeout(int(left.count()));
+      const auto key = ::getch();
+      if (key == ERR)
+        break;
+      else if (key == 'q' || key == 'Q')
+        quit = true;
+      else if (key == KEY_DOWN)
+        ++top;
+      else if (key == KEY_UP)
+        top -= std::min<std::size_t>(top, 1);
+      else if (key == KEY_NPAGE)
+        top += lines;
+      else if (key == KEY_PPAGE)
+        top -= std::min(top, lines);
+      else if (key == KEY_HOME)
+        top = 0;
+      else if (key == KEY_END)
+        top = channels_.size();
+      else if (key == KEY_RESIZE)
+        drawn.clear();
+    }
+  }
+  elapsed_ = clock_type::now() - start;
+}
+#else
+inline void dashboard::run() {
+  throw std::runtime_error("dash is not supported on this platform");
+}
+#endif
+
+inline void dashboard::report(std::ostream &os) const {
+  os << "[STOP][dash] " << channels_.size() << " items, " << frames_
+     << " frames, " << cells_drawn_ << " cells drawn";
+}
+} // namespace ctf_io
@@ -0,0 +1,347 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <deque>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "args.hpp"
+#include "channel.hpp"
+#include "conf_parser.hpp"
+#include "expression.hpp"
+#include "task.hpp"
+
+namespace ctf_io {
+// Keeps the readback of items equal to expressions over other items, e.g.
+// "derive Flow = (P1 - P2) * 0.5". All derived items update on one thread at
+// a fixed rate. Every input is read once per tick however many expressions
+// use it, and only expressions with an input that changed are evaluated, in
+// dependency order, so a derived item feeding another propagates within the
+// same tick.
+class derive_engine final {
+public:
+  using item = conf::io_parser::item;
+  using clock_type = std::chrono::steady_clock;
+
+  derive_engine(const derive_engine &) = delete;
+  derive_engine &operator=(const derive_engine &) = delete;
+
+  static derive_engine &shared() {
+    static derive_engine engine_;
+    return engine_;
+  }
+
+  double rate() const noexcept { return rate_; }
+
+  // Derives 'out' from 'text', replacing any earlier definition of it.
+  void add(const item &out, const std::string &text,
+           conf::io_parser::shared_ptr parser);
+  // Removes derived items by name or "all", returns how many.
+  std::size_t stop(const std::string &which);
+  void print(std::ostream &os) const;
+
+private:
+  struct input {
+    channel ch;
+    std::vector<std::size_t> dependents;
+  };
+
+  struct derived {
+    channel output;
+    std::string text;
+    std::unique_ptr<expression> expr;
+    // The input slot the output is read back into, if anything uses it.
+    std::size_t feeds = npos;
+    double written = std::numeric_limits<double>::quiet_NaN();
+  };
+
+  static constexpr auto npos = std::size_t(-1);
+
+  derive_engine() {
+    // An invalid rate keeps the default.
+    if (const auto env = std::getenv("IOTEST_DERIVE_RATE"); env != nullptr) {
+      try {
+        rate_ = termctl::parse_rate(env);
+      } catch (const std::invalid_argument &) {
+      }
+    }
+  }
+
+  ~derive_engine() { halt(); }
+
+  void compile(std::vector<derived> &defs, std::deque<input> &inputs,
+               std::deque<double> &values) const;
+  void install(std::vector<derived> &&defs, std::deque<input> &&inputs,
+               std::deque<double> &&values);
+  void halt();
+  void run();
+  void step();
+
+  double rate_ = 100.0;
+  // Serializes add() and stop(), which start and join the thread.
+  std::mutex control_;
+  mutable std::mutex mutex_;
+  // In dependency order.
+  std::vector<derived> derived_;
+  std::deque<input> inputs_;
+  // Slot of every input, muparser holds pointers into it.
+  std::deque<double> values_;
+  std::vector<char> dirty_;
+  // Names in expressions are looked up here.
+  conf::io_parser::shared_ptr parser_;
+
+  std::thread thread_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  clock_type::time_point start_;
+  runtime::deadline_stats stats_;
+  std::atomic<std::uint64_t> evals_ = 0;
+  std::atomic<std::uint64_t> writes_ = 0;
+  std::atomic<std::uint64_t> errors_ = 0;
+};
+
+// Compiles every definition against a fresh set of input slots and sorts
+// them so each comes after the ones it reads; throws on a cycle.
+inline void derive_engine::compile(std::vector<derived> &defs,
+                                   std::deque<input> &inputs,
+                                   std::deque<double> &values) const {
+  auto slots = std::unordered_map<std::string, std::size_t>();
+  const auto slot_of = [&](const std::string &name) -> std::size_t {
+    if (auto it = slots.find(name); it != slots.end())
+      return it->second;
+    const auto i = parser_->find_item(name);
+    if (!i)
+      throw std::invalid_argument("invalid item of module \"" + name + "\"");
+    auto ch = channel(*i);
+    if (!ch.readable() || !ch.numeric())
+      throw std::invalid_argument("the item \"" + name +
+                                  "\" has no numeric 'pr'");
+    values.push_back(ch.read_double().value_or(0.0));
+    inputs.push_back({std::move(ch), {}});
+    return slots[name] = inputs.size() - 1;
+  };
+
+  auto uses = std::vector<std::vector<std::size_t>>(defs.size());
+  for (std::size_t d = 0; d < defs.size(); ++d) {
+    defs[d].expr = std::make_unique<expression>(
+        defs[d].text,
+        [&](const std::string &name) { return &values[slot_of(name)]; });
+    for (const auto &name : defs[d].expr->inputs())
+      uses[d].push_back(slots.at(name));
+  }
+
+  // Kahn's algorithm over "output of a feeds an input of b".
+  auto producer = std::vector<std::size_t>(inputs.size(), npos);
+  for (std::size_t d = 0; d < defs.size(); ++d)
+    if (auto it = slots.find(defs[d].output.name()); it != slots.end())
+      producer[it->second] = d;
+  auto pending = std::vector<std::size_t>(defs.size(), 0);
+  auto next = std::vector<std::vector<std::size_t>>(defs.size());
+  for (std::size_t d = 0; d < defs.size(); ++d)
+    for (const auto s : uses[d])
+      if (producer[s] != npos) {
+        ++pending[d];
+        next[producer[s]].push_back(d);
+      }
+  auto order = std::vector<std::size_t>();
+  for (std::size_t d = 0; d < defs.size(); ++d)
+    if (pending[d] == 0)
+      order.push_back(d);
+  for (std::size_t k = 0; k < order.size(); ++k)
+    for (const auto d : next[order[k]])
+      if (--pending[d] == 0)
+        order.push_back(d);
+  if (order.size() != defs.size()) {
+    for (std::size_t d = 0; d < defs.size(); ++d)
+      if (pending[d])
+        throw std::invalid_argument("the definitions form a cycle through \"" +
+                                    defs[d].output.name() + "\"");
+  }
+
+  auto sorted = std::vector<derived>();
+  for (const auto d : order)
+    sorted.push_back(std::move(defs[d]));
+  for (std::size_t d = 0; d < sorted.size(); ++d) {
+    auto &def = sorted[d];
+    if (auto it = slots.find(def.output.name()); it != slots.end())
+      def.feeds = it->second;
+    for (const auto &name : def.expr->inputs())
+      inputs[slots.at(name)].dependents.push_back(d);
+  }
+  defs = std::move(sorted);
+}
+
+inline void derive_engine::add(const item &out, const std::string &text,
+                               conf::io_parser::shared_ptr parser) {
+  auto output = channel(out, channel::side_type::readback);
+  if (!output.writable() || !output.numeric())
+    throw std::invalid_argument("the item \"" + out.name +
+                                "\" has no numeric 'pr'");
+
+  std::lock_guard<std::mutex> control(control_);
+  // Compiled aside, so a bad definition leaves the running ones untouched.
+  auto defs = std::vector<derived>();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    parser_ = std::move(parser);
+    for (const auto &d : derived_)
+      if (d.output.name() != out.name)
+        defs.push_back({d.output, d.text, nullptr});
+  }
+  defs.push_back({std::move(output), text, nullptr});
+  auto inputs = std::deque<input>();
+  auto values = std::deque<double>();
+  compile(defs, inputs, values);
+  install(std::move(defs), std::move(inputs), std::move(values));
+}
+
+inline std::size_t derive_engine::stop(const std::string &which) {
+  std::lock_guard<std::mutex> control(control_);
+  auto defs = std::vector<derived>();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (const auto &d : derived_)
+      if (which != "all" && which != d.output.name())
+        defs.push_back({d.output, d.text, nullptr});
+  }
+  const auto removed = derived_.size() - defs.size();
+  if (defs.empty()) {
+    halt();
+    std::lock_guard<std::mutex> lock(mutex_);
+    derived_.clear();
+    inputs_.clear();
+    values_.clear();
+    return removed;
+  }
+
+  // What is left compiled before, and still does.
+  auto inputs = std::deque<input>();
+  auto values = std::deque<double>();
+  compile(defs, inputs, values);
+  install(std::move(defs), std::move(inputs), std::move(values));
+  return removed;
+}
+
+inline void derive_engine::install(std::vector<derived> &&defs,
+                                   std::deque<input> &&inputs,
+                                   std::deque<double> &&values) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  derived_ = std::move(defs);
+  inputs_ = std::move(inputs);
+  values_ = std::move(values);
+  // Everything is evaluated on the first tick.
+  dirty_.assign(derived_.size(), 1);
+
+  if (!thread_.joinable()) {
+    stop_ = false;
+    start_ = clock_type::now();
+    stats_.reset();
+    thread_ = std::thread(&derive_engine::run, this);
+  }
+}
+
+inline void derive_engine::halt() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+inline void derive_engine::step() {
+  for (std::size_t s = 0; s < inputs_.size(); ++s) {
+    auto &in = inputs_[s];
+    if (const auto v = in.ch.read_double(); v && *v != values_[s]) {
+      values_[s] = *v;
+      for (const auto d : in.dependents)
+        dirty_[d] = 1;
+    }
+  }
+
+  // Dependents always come later, so marking them here is still in time.
+  auto evals = std::uint64_t(0), writes = std::uint64_t(0);
+  for (std::size_t d = 0; d < derived_.size(); ++d) {
+    if (!dirty_[d])
+      continue;
+    dirty_[d] = 0;
+    auto &def = derived_[d];
+    auto y = 0.0;
+    try {
+      y = def.expr->eval();
+      ++evals;
+    } catch (const std::exception &) {
+      errors_.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    if (!std::isfinite(y)) {
+      errors_.fetch_add(1, std::memory_order_relaxed);
+      continue;
+    }
+    if (y == def.written)
+      continue;
+    if (def.output.write(y))
+      ++writes;
+    def.written = y;
+    if (def.feeds != npos && values_[def.feeds] != y) {
+      values_[def.feeds] = y;
+      for (const auto e : inputs_[def.feeds].dependents)
+        dirty_[e] = 1;
+    }
+  }
+  evals_.fetch_add(evals, std::memory_order_relaxed);
+  writes_.fetch_add(writes, std::memory_order_relaxed);
+}
+
+inline void derive_engine::run() {
+  const auto period = runtime::rate_period(rate_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (std::int64_t k = 1;; ++k) {
+    auto deadline = start_ + period * k;
+    if (cv_.wait_until(lock, deadline, [this] { return stop_; }))
+      return;
+
+    auto lateness = clock_type::now() - deadline;
+    if (lateness >= period) {
+      const auto skipped = lateness / period;
+      stats_.miss(std::uint64_t(skipped));
+      k += skipped;
+      lateness -= period * skipped;
+    }
+
+    step();
+    stats_.record(lateness, true);
+  }
+}
+
+inline void derive_engine::print(std::ostream &os) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &d : derived_)
+    os << "[" << d.output.name() << "][" << d.output.write_key() << " = "
+       << d.text << "][y: " << d.written << "]\n";
+
+  const auto elapsed =
+      std::chrono::duration<double>(clock_type::now() - start_).count();
+  os << "[derive][" << derived_.size() << " items from " << inputs_.size()
+     << " inputs at " << rate_ << "Hz]";
+  stats_.print(os, elapsed);
+  os << "[evals: " << evals_.load() << "][writes: " << writes_.load()
+     << "][errors: " << errors_.load() << "]";
+}
+} // namespace ctf_io
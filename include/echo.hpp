@@ -0,0 +1,214 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <variant>
+#include <vector>
+
+#include "channel.hpp"
+#include "conf_parser.hpp"
+#include "task.hpp"
+#include "variant.hpp"
+
+namespace ctf_io {
+// Mirrors the 'pw' of items to their 'pr', as if every output were wired
+// straight back to its input. One thread polls all commanded values per
+// tick and writes only those that changed since the tick before, so a
+// point costs one read per tick while idle, and the latency stays within
+// one period.
+class echo_engine final {
+public:
+  using item = conf::io_parser::item;
+  using clock_type = std::chrono::steady_clock;
+
+  struct filter {
+    std::optional<std::int32_t> driver;
+    std::optional<item::category_type> category;
+
+    bool match(const item &i) const noexcept {
+      return (!driver || i.driver_id == *driver) &&
+             (!category || i.category == *category);
+    }
+  };
+
+  echo_engine(const echo_engine &) = delete;
+  echo_engine &operator=(const echo_engine &) = delete;
+
+  static echo_engine &shared() {
+    static echo_engine engine_;
+    return engine_;
+  }
+
+  bool running() const noexcept {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return running_;
+  }
+
+  // Starts echoing every item passing 'f' that has a 'pw' and a distinct
+  // 'pr', returns how many.
+  std::size_t start(const conf::io_parser &parser, const filter &f,
+                    double rate);
+  void stop();
+  void print(std::ostream &os) const;
+
+private:
+  struct point {
+    variant input;
+    channel output;
+    std::optional<variant::raw_type> last;
+  };
+
+  echo_engine() = default;
+  ~echo_engine() { stop(); }
+
+  void run();
+  std::uint64_t poll();
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  // Set from start() until the thread is joined; points_ only change while
+  // it is clear, so the thread polls them without the lock.
+  bool running_ = false;
+  std::vector<point> points_;
+  double rate_ = 0;
+  std::thread thread_;
+  clock_type::time_point start_;
+  clock_type::time_point end_;
+  runtime::deadline_stats stats_;
+  std::atomic<std::uint64_t> changes_ = 0;
+  std::atomic<std::int64_t> busy_sum_ = 0;
+  std::atomic<std::int64_t> busy_max_ = 0;
+};
+
+inline std::size_t echo_engine::start(const conf::io_parser &parser,
+                                      const filter &f, double rate) {
+  auto points = std::vector<point>();
+  for (const auto &[name, i] : parser.items())
+    if (f.match(i) && !i.pw.empty() && !i.pr.empty() && i.pw != i.pr &&
+        i.dt != item::data_type::unknown)
+      points.push_back(
+          {variant(i.dt, i.pw), channel(i, channel::side_type::readback), {}});
+  if (points.empty())
+    throw std::invalid_argument("no item with distinct 'pw' and 'pr' matches");
+  // Throws here, not in run(), if the period rounds to zero.
+  runtime::rate_period(rate);
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_)
+    throw std::runtime_error("echo is already running");
+
+  points_ = std::move(points);
+  rate_ = rate;
+  stop_ = false;
+  stats_.reset();
+  changes_ = 0;
+  busy_sum_ = busy_max_ = 0;
+  start_ = clock_type::now();
+  running_ = true;
+  thread_ = std::thread(&echo_engine::run, this);
+  return points_.size();
+}
+
+inline void echo_engine::stop() {
+  auto thread = std::thread();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+    thread = std::move(thread_);
+  }
+  cv_.notify_all();
+  if (thread.joinable()) {
+    thread.join();
+    std::lock_guard<std::mutex> lock(mutex_);
+    end_ = clock_type::now();
+    running_ = false;
+  }
+}
+
+inline std::uint64_t echo_engine::poll() {
+  auto changes = std::uint64_t(0);
+  for (auto &p : points_) {
+    if (!p.input.read() || p.last == p.input.get())
+      continue;
+
+    const auto ok = std::visit(
+        [&p](const auto &v) {
+          if constexpr (std::is_same_v<std::decay_t<decltype(v)>,
+                                       std::string>)
+            return p.output.write(v);
+          else
+            return p.output.write(double(v));
+        },
+        p.input.get());
+    // A failed write is retried on the next tick.
+    if (ok) {
+      p.last = p.input.get();
+      ++changes;
+    }
+  }
+  return changes;
+}
+
+inline void echo_engine::run() {
+  const auto period = runtime::rate_period(rate_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (std::int64_t k = 0;; ++k) {
+    const auto deadline = start_ + period * k;
+    if (cv_.wait_until(lock, deadline, [this] { return stop_; }))
+      return;
+
+    auto lateness = clock_type::now() - deadline;
+    if (lateness >= period) {
+      const auto skipped = lateness / period;
+      stats_.miss(std::uint64_t(skipped));
+      k += skipped;
+      lateness -= period * skipped;
+    }
+
+    lock.unlock();
+    const auto begin = clock_type::now();
+    changes_.fetch_add(poll(), std::memory_order_relaxed);
+    const auto busy = (clock_type::now() - begin).count();
+    busy_sum_.fetch_add(busy, std::memory_order_relaxed);
+    if (busy > busy_max_.load(std::memory_order_relaxed))
+      busy_max_.store(busy, std::memory_order_relaxed);
+    lock.lock();
+    stats_.record(lateness, true);
+  }
+}
+
+inline void echo_engine::print(std::ostream &os) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (points_.empty()) {
+    os << "[echo] not started";
+    return;
+  }
+
+  const auto flags = os.flags();
+  const auto precision = os.precision();
+  const auto ticks = stats_.ticks();
+  const auto end = running_ ? clock_type::now() : end_;
+  os << std::fixed << std::setprecision(1) << "[echo]["
+     << (running_ ? "running" : "stopped") << "]["
+     << points_.size() << " items at " << rate_ << "Hz]";
+  stats_.print(os, std::chrono::duration<double>(end - start_).count());
+  os << std::fixed << std::setprecision(1) << "[poll avg/max: "
+     << (ticks ? double(busy_sum_.load()) / double(ticks) / 1e3 : 0.0) << "/"
+     << busy_max_.load() / 1e3 << "us][changes: " << changes_.load() << "]";
+  os.flags(flags);
+  os.precision(precision);
+}
+} // namespace ctf_io
@@ -0,0 +1,351 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "args.hpp"
+#include "channel.hpp"
+#include "condition.hpp"
+#include "conf_parser.hpp"
+#include "json.hpp"
+#include "waiter.hpp"
+
+namespace ctf_io {
+// A set of checks of item values, from 'expect' or a file of them, one per
+// line:
+//
+//   # comment
+//   Chamber.Pressure < 1e-3
+//   Valve.Open == 1 tol=0
+//
+// Every item is read once however many checks name it, the reads spread
+// over a few threads. Checks failing that first read are retried together
+// in one polling loop until they all hold or the timeout runs out.
+class expect_suite final {
+public:
+  using clock_type = std::chrono::steady_clock;
+
+  struct check {
+    condition cond;
+    // Where it was written, e.g. "panel.txt:12".
+    std::string where;
+  };
+
+  expect_suite(std::string name, std::vector<check> &&checks,
+               const conf::io_parser &parser);
+
+  // Checks in 'file', resolved and validated before anything is read.
+  static expect_suite load(const std::filesystem::path &file,
+                           const conf::io_parser &parser, double tol);
+
+  // Returns whether every check holds; a timeout retries failing ones.
+  bool run(const wait_options &opts);
+
+  // Prints the failed checks, or every check with 'all'.
+  void report(std::ostream &os, bool all) const;
+  void summary(std::ostream &os) const;
+  void write_junit(const std::filesystem::path &file) const;
+  void write_json(const std::filesystem::path &file) const;
+
+private:
+  enum class status_type { pass, fail, error };
+
+  struct outcome {
+    std::optional<double> value;
+    status_type status = status_type::error;
+    clock_type::duration time{};
+  };
+
+  // More than this many items per thread before reads are spread out.
+  static constexpr std::size_t reads_per_thread = 32;
+  static constexpr std::size_t max_threads = 8;
+
+  void read_all();
+  std::size_t count(status_type s) const {
+    return std::size_t(std::count_if(
+        outcomes_.begin(), outcomes_.end(),
+        [s](const outcome &o) { return o.status == s; }));
+  }
+
+  static std::string xml_string(std::string_view s);
+  static std::string describe(const check &c) {
+    auto os = std::ostringstream();
+    os << c.cond;
+    return os.str();
+  }
+
+  std::string name_;
+  std::vector<check> checks_;
+  std::vector<outcome> outcomes_;
+  // Distinct items, and which of them each check reads.
+  std::vector<channel> channels_;
+  std::vector<std::size_t> channel_of_;
+  std::uint64_t reads_ = 0;
+  clock_type::duration elapsed_{};
+  bool stopped_ = false;
+};
+
+inline expect_suite::expect_suite(std::string name,
+                                  std::vector<check> &&checks,
+                                  const conf::io_parser &parser)
+    : name_(std::move(name)), checks_(std::move(checks)),
+      outcomes_(checks_.size()) {
+  auto index = std::unordered_map<std::string, std::size_t>();
+  for (const auto &c : checks_) {
+    const auto prefix = c.where.empty() ? std::string() : c.where + ": ";
+    auto [it, added] = index.try_emplace(c.cond.item, channels_.size());
+    if (added) {
+      auto item = parser.find_item(c.cond.item);
+      if (!item)
+        throw std::invalid_argument(prefix + "invalid item of module \"" +
+                                    c.cond.item + "\"");
+      auto ch = channel(*item);
+      if (!ch.readable() || !ch.numeric())
+        throw std::invalid_argument(prefix + "the item \"" + c.cond.item +
+                                    "\" is not a readable number");
+      channels_.push_back(std::move(ch));
+    }
+    channel_of_.push_back(it->second);
+  }
+}
+
+inline expect_suite expect_suite::load(const std::filesystem::path &file,
+                                       const conf::io_parser &parser,
+                                       double tol) {
+  auto is = std::ifstream(file);
+  if (!is)
+    throw std::runtime_error("could not open \"" + file.string() + "\"");
+
+  auto checks = std::vector<check>();
+  auto line = std::string();
+  for (auto n = 1; std::getline(is, line); ++n) {
+    const auto first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#')
+      continue;
+    const auto where = file.string() + ":" + std::to_string(n);
+    try {
+      const auto opts = termctl::options(termctl::split_args(line));
+      opts.expect_only({"tol"});
+      auto c = check{condition::parse(opts.positional()), where};
+      c.cond.set_tol(opts.get_double("tol", tol));
+      checks.push_back(std::move(c));
+    } catch (const std::invalid_argument &e) {
+      throw std::invalid_argument(where + ": " + e.what());
+    }
+  }
+  if (checks.empty())
+    throw std::invalid_argument("no checks in \"" + file.string() + "\"");
+  return expect_suite(file.filename().string(), std::move(checks), parser);
+}
+
+inline void expect_suite::read_all() {
+  auto values = std::vector<std::optional<double>>(channels_.size());
+  const auto read = [&](std::size_t from, std::size_t to) {
+    for (auto i = from; i < to; ++i)
+      values[i] = channels_[i].read_double();
+  };
+
+  // Each thread reads channels of its own, there is nothing to share.
+  const auto n = channels_.size();
+  const auto threads =
+      std::clamp<std::size_t>(n / reads_per_thread, 1, max_threads);
+  auto pool = std::vector<std::thread>();
+  const auto slice = (n + threads - 1) / threads;
+  for (std::size_t t = 1; t < threads; ++t)
+    pool.emplace_back(read, std::min(n, t * slice),
+                      std::min(n, (t + 1) * slice));
+  read(0, std::min(n, slice));
+  for (auto &t : pool)
+    t.join();
+  reads_ += n;
+
+  for (std::size_t i = 0; i < checks_.size(); ++i) {
+    auto &o = outcomes_[i];
+    o.value = values[channel_of_[i]];
+    o.status = !o.value                        ? status_type::error
+               : checks_[i].cond.eval(*o.value) ? status_type::pass
+                                                : status_type::fail;
+  }
+}
+
+inline bool expect_suite::run(const wait_options &opts) {
+  const auto start = clock_type::now();
+  read_all();
+  for (auto &o : outcomes_)
+    o.time = clock_type::now() - start;
+
+  auto retry = std::vector<std::size_t>();
+  for (std::size_t i = 0; i < checks_.size(); ++i)
+    if (outcomes_[i].status != status_type::pass)
+      retry.push_back(i);
+  if (!retry.empty() && opts.timeout && opts.timeout->count() > 0) {
+    auto conds = std::vector<std::pair<condition, channel>>();
+    for (const auto i : retry)
+      conds.emplace_back(checks_[i].cond, channels_[channel_of_[i]]);
+    auto w = waiter(std::move(conds), opts);
+    w.run();
+    stopped_ = w.stopped();
+    reads_ += w.polls();
+    for (std::size_t k = 0; k < retry.size(); ++k) {
+      auto &o = outcomes_[retry[k]];
+      if (const auto v = w.value(k); v) {
+        o.value = v;
+        o.status = w.holds(k) ? status_type::pass : status_type::fail;
+      }
+      o.time = clock_type::now() - start;
+    }
+  }
+  elapsed_ = clock_type::now() - start;
+  return count(status_type::pass) == checks_.size();
+}
+
+inline void expect_suite::report(std::ostream &os, bool all) const {
+  for (std::size_t i = 0; i < checks_.size(); ++i) {
+    const auto &o = outcomes_[i];
+    if (!all && o.status == status_type::pass)
+      continue;
+    os << "[" << (o.status == status_type::pass ? "OK" : "FAIL")
+       << "][expect]";
+    if (!checks_[i].where.empty())
+      os << "[" << checks_[i].where << "]";
+    os << "[" << checks_[i].cond << ": ";
+    if (o.value)
+      os << *o.value;
+    else
+      os << "unread";
+    os << "]\n";
+  }
+}
+
+inline void expect_suite::summary(std::ostream &os) const {
+  const auto flags = os.flags();
+  const auto precision = os.precision();
+  const auto passed = count(status_type::pass);
+  os << "["
+     << (passed == checks_.size() ? "OK"
+         : stopped_               ? "STOP"
+                                  : "FAIL")
+     << "][" << name_ << "] " << passed << " passed, "
+     << count(status_type::fail) << " failed, " << count(status_type::error)
+     << " unread of " << checks_.size() << " in " << std::fixed
+     << std::setprecision(3)
+     << std::chrono::duration<double>(elapsed_).count() << "s, " << reads_
+     << " reads";
+  os.flags(flags);
+  os.precision(precision);
+}
+
+inline void expect_suite::write_junit(const std::filesystem::path &file) const {
+  auto os = std::ofstream(file);
+  if (!os)
+    throw std::runtime_error("could not write \"" + file.string() + "\"");
+  const auto secs = [](clock_type::duration d) {
+    return std::chrono::duration<double>(d).count();
+  };
+
+  os << std::fixed << std::setprecision(6)
+     << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+     << "<testsuite name=\"" << xml_string(name_) << "\" tests=\""
+     << checks_.size() << "\" failures=\"" << count(status_type::fail)
+     << "\" errors=\"" << count(status_type::error) << "\" time=\""
+     << secs(elapsed_) << "\">\n";
+  for (std::size_t i = 0; i < checks_.size(); ++i) {
+    const auto &c = checks_[i];
+    const auto &o = outcomes_[i];
+    os << "  <testcase classname=\"" << xml_string(name_) << "\" name=\""
+       << xml_string(describe(c)) << "\" time=\"" << secs(o.time) << "\"";
+    if (o.status == status_type::pass) {
+      os << "/>\n";
+      continue;
+    }
+    os << ">\n";
+    auto msg = std::ostringstream();
+    if (o.value)
+      msg << c.cond.item << " is " << *o.value;
+    else
+      msg << c.cond.item << " could not be read";
+    if (!c.where.empty())
+      msg << " at " << c.where;
+    os << "    <" << (o.status == status_type::fail ? "failure" : "error")
+       << " message=\"" << xml_string(msg.str()) << "\"/>\n"
+       << "  </testcase>\n";
+  }
+  os << "</testsuite>\n";
+  if (!os.flush())
+    throw std::runtime_error("could not write \"" + file.string() + "\"");
+}
+
+inline void expect_suite::write_json(const std::filesystem::path &file) const {
+  auto os = std::ofstream(file);
+  if (!os)
+    throw std::runtime_error("could not write \"" + file.string() + "\"");
+
+  os << "{\"name\":" << termctl::json_string(name_)
+     << ",\"tests\":" << checks_.size()
+     << ",\"failures\":" << count(status_type::fail)
+     << ",\"errors\":" << count(status_type::error) << ",\"time\":"
+     << std::chrono::duration<double>(elapsed_).count() << ",\"checks\":[";
+  os << std::setprecision(17);
+  for (std::size_t i = 0; i < checks_.size(); ++i) {
+    const auto &c = checks_[i];
+    const auto &o = outcomes_[i];
+    os << (i ? "," : "") << "\n{\"item\":" << termctl::json_string(c.cond.item)
+       << ",\"op\":\"" << condition::op_to_str(c.cond.op)
+       << "\",\"value\":" << c.cond.value << ",\"tol\":" << c.cond.tol
+       << ",\"actual\":";
+    if (o.value && std::isfinite(*o.value))
+      os << *o.value;
+    else
+      os << "null";
+    os << ",\"status\":\""
+       << (o.status == status_type::pass   ? "pass"
+           : o.status == status_type::fail ? "fail"
+                                           : "error")
+       << "\"";
+    if (!c.where.empty())
+      os << ",\"where\":" << termctl::json_string(c.where);
+    os << "}";
+  }
+  os << "\n]}\n";
+  if (!os.flush())
+    throw std::runtime_error("could not write \"" + file.string() + "\"");
+}
+
+inline std::string expect_suite::xml_string(std::string_view s) {
+  auto xml = std::string();
+  for (const auto ch : s)
+    switch (ch) {
+    case '<':
+      xml += "&lt;";
+      break;
+    case '>':
+      xml += "&gt;";
+      break;
+    case '&':
+      xml += "&amp;";
+      break;
+    case '"':
+      xml += "&quot;";
+      break;
+    default:
+      xml += ch;
+    }
+  return xml;
+}
+} // namespace ctf_io
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <muParser.h>
+
+namespace ctf_io {
+// A muparser expression over item values, e.g. "(P1.Pressure - P2.Pressure)
+// * 0.5". It is compiled once; every name in it is handed to 'resolve' then,
+// which returns the slot the value of that item will be kept in, so
+// evaluating takes no lookup at all, only the caller filling the slots.
+class expression final {
+public:
+  using resolver = std::function<double *(const std::string &name)>;
+
+  expression(const std::string &text, const resolver &resolve)
+      : text_(text), resolve_(&resolve),
+        parser_(std::make_unique<mu::Parser>()) {
+    try {
+      // Item names are dotted.
+      parser_->DefineNameChars("0123456789_."
+                               "abcdefghijklmnopqrstuvwxyz"
+                               "ABCDEFGHIJKLMNOPQRSTUVWXYZ");
+      parser_->SetVarFactory(make_var, this);
+      parser_->SetExpr(text_);
+      // Compiles the bytecode later evaluations reuse, which reports syntax
+      // errors here and resolves every name; the value is discarded.
+      parser_->Eval();
+      resolve_ = nullptr;
+    } catch (const mu::Parser::exception_type &e) {
+      throw std::invalid_argument("bad expression \"" + text_ +
+                                  "\": " + e.GetMsg());
+    }
+  }
+
+  expression(const expression &) = delete;
+  expression &operator=(const expression &) = delete;
+
+  const std::string &text() const noexcept { return text_; }
+  // Item names in the order they first appear.
+  const std::vector<std::string> &inputs() const noexcept { return inputs_; }
+
+  double eval() const {
+    try {
+      return parser_->Eval();
+    } catch (const mu::Parser::exception_type &e) {
+      throw std::runtime_error(e.GetMsg());
+    }
+  }
+
+private:
+  static mu::value_type *make_var(const mu::char_type *name, void *self) {
+    auto *e = static_cast<expression *>(self);
+    if (e->resolve_ == nullptr)
+      throw mu::Parser::exception_type("unexpected variable");
+    e->inputs_.emplace_back(name);
+    return (*e->resolve_)(name);
+  }
+
+  std::string text_;
+  // Only set while the constructor compiles, 'resolve' need not outlive it.
+  const resolver *resolve_ = nullptr;
+  std::vector<std::string> inputs_;
+  std::unique_ptr<mu::Parser> parser_;
+};
+} // namespace ctf_io
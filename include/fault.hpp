@@ -0,0 +1,541 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <queue>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "condition.hpp"
+#include "conf_parser.hpp"
+#include "variant.hpp"
+
+namespace ctf_io {
+struct fault_params {
+  // Faults of one item apply in this order: the value is first replaced or
+  // shifted, then maybe dropped, and what is left maybe delayed.
+  enum class kind_type {
+    stuck,
+    drift,
+    noise,
+    spike,
+    quantize,
+    dropout,
+    latency
+  };
+
+  kind_type kind = kind_type::stuck;
+  // stuck: the value held, or the first value seen once active.
+  std::optional<double> value;
+  // spike: the amplitude added with a random sign.
+  double amp = 0.0;
+  // spike, dropout: the probability per write.
+  double prob = 1.0;
+  // drift: the bias added per second since activation.
+  double rate = 0.0;
+  // quantize: the step values are rounded to.
+  double step = 1.0;
+  // noise: the standard deviation of the gaussian noise added.
+  double sigma = 0.0;
+  // latency: how much later the value is written.
+  std::chrono::nanoseconds delay{0};
+
+  static kind_type parse_kind(const std::string &name) {
+    constexpr std::pair<const char *, kind_type> kinds[] = {
+        {"stuck", kind_type::stuck},       {"drift", kind_type::drift},
+        {"noise", kind_type::noise},       {"spike", kind_type::spike},
+        {"quantize", kind_type::quantize}, {"dropout", kind_type::dropout},
+        {"latency", kind_type::latency}};
+    for (const auto &[n, k] : kinds)
+      if (name == n)
+        return k;
+    throw std::invalid_argument("invalid fault \"" + name + "\"");
+  }
+
+  static const char *kind_to_str(kind_type kind) noexcept {
+    switch (kind) {
+    case kind_type::stuck:
+      return "stuck";
+    case kind_type::drift:
+      return "drift";
+    case kind_type::noise:
+      return "noise";
+    case kind_type::spike:
+      return "spike";
+    case kind_type::quantize:
+      return "quantize";
+    case kind_type::dropout:
+      return "dropout";
+    default:
+      return "latency";
+    }
+  }
+};
+
+// Random numbers drawn a block at a time, so a noisy write costs a load.
+class random_batch final {
+public:
+  random_batch() : gen_(std::random_device{}()) {}
+
+  double normal() {
+    if (normal_pos_ == size) {
+      auto dist = std::normal_distribution<double>();
+      for (auto &v : normal_)
+        v = dist(gen_);
+      normal_pos_ = 0;
+    }
+    return normal_[normal_pos_++];
+  }
+
+  double uniform() {
+    if (uniform_pos_ == size) {
+      auto dist = std::uniform_real_distribution<double>();
+      for (auto &v : uniform_)
+        v = dist(gen_);
+      uniform_pos_ = 0;
+    }
+    return uniform_[uniform_pos_++];
+  }
+
+private:
+  static constexpr std::size_t size = 256;
+
+  std::mt19937_64 gen_;
+  std::array<double, size> normal_{};
+  std::array<double, size> uniform_{};
+  std::size_t normal_pos_ = size;
+  std::size_t uniform_pos_ = size;
+};
+
+// A fault attached to one item, active within its time window and while its
+// condition, if any, holds.
+class fault final {
+public:
+  using ptr = std::shared_ptr<fault>;
+  using id_type = std::uint32_t;
+  using clock_type = std::chrono::steady_clock;
+  using kind_type = fault_params::kind_type;
+
+  fault(id_type id, std::string item, std::string key,
+        const fault_params &params, clock_type::time_point from,
+        clock_type::time_point until)
+      : id_(id), item_(std::move(item)), key_(std::move(key)), params_(params),
+        from_(from), until_(until) {
+    if (params_.kind == kind_type::quantize)
+      inv_step_ = 1.0 / params_.step;
+  }
+
+  // The condition is polled by the engine on 'reader', the 'pr' of its item.
+  void watch(const condition &cond, const variant &reader) {
+    when_ = cond;
+    reader_.emplace(reader);
+    holds_ = false;
+  }
+
+  id_type id() const noexcept { return id_; }
+  const std::string &item() const noexcept { return item_; }
+  // The IO key whose writes the fault applies to.
+  const std::string &key() const noexcept { return key_; }
+  kind_type kind() const noexcept { return params_.kind; }
+  std::uint64_t hits() const noexcept { return hits_.load(); }
+
+  bool active(clock_type::time_point now) const noexcept {
+    return now >= from_ && now < until_ &&
+           holds_.load(std::memory_order_relaxed);
+  }
+
+  void print(std::ostream &os) const;
+
+private:
+  friend class fault_slot;
+  friend class fault_engine;
+
+  id_type id_;
+  std::string item_;
+  std::string key_;
+  fault_params params_;
+  double inv_step_ = 1.0;
+  clock_type::time_point from_;
+  clock_type::time_point until_;
+  std::optional<condition> when_;
+  std::optional<variant> reader_;
+  std::atomic_bool holds_ = true;
+  std::atomic<std::uint64_t> hits_ = 0;
+
+  // Owned by the slot, under its lock.
+  bool was_active_ = false;
+  clock_type::time_point since_;
+  std::optional<double> held_;
+};
+
+// What is left of a write once the faults of its item applied.
+struct fault_result {
+  double value = 0.0;
+  bool drop = false;
+  std::chrono::nanoseconds delay{0};
+};
+
+// The faults of one IO key, in the order they apply. Writers of the key keep
+// a reference, so a write checks one flag while no fault is attached.
+class fault_slot final {
+public:
+  using ptr = std::shared_ptr<fault_slot>;
+  using clock_type = fault::clock_type;
+
+  bool armed() const noexcept {
+    return armed_.load(std::memory_order_acquire) != 0;
+  }
+
+  fault_result apply(double v);
+
+private:
+  friend class fault_engine;
+
+  void add(const fault::ptr &f) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    faults_.insert(std::upper_bound(faults_.begin(), faults_.end(), f,
+                                    [](const auto &a, const auto &b) {
+                                      return a->kind() < b->kind();
+                                    }),
+                   f);
+    armed_.store(faults_.size(), std::memory_order_release);
+  }
+
+  void remove(const fault::ptr &f) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    faults_.erase(std::remove(faults_.begin(), faults_.end(), f),
+                  faults_.end());
+    armed_.store(faults_.size(), std::memory_order_release);
+  }
+
+  std::mutex mutex_;
+  std::vector<fault::ptr> faults_;
+  random_batch random_;
+  std::atomic<std::size_t> armed_ = 0;
+};
+
+inline fault_result fault_slot::apply(double v) {
+  auto r = fault_result{v};
+  const auto now = clock_type::now();
+  std::lock_guard<std::mutex> lock(mutex_);
+  // Expired faults leave the slot, so an idle one is back to a flag check.
+  if (std::erase_if(faults_, [now](const fault::ptr &f) {
+        return now >= f->until_;
+      }))
+    armed_.store(faults_.size(), std::memory_order_release);
+  for (auto &f : faults_) {
+    const auto active = f->active(now);
+    if (active && !f->was_active_) {
+      f->since_ = now;
+      f->held_.reset();
+    }
+    f->was_active_ = active;
+    if (!active)
+      continue;
+
+    const auto &p = f->params_;
+    auto hit = true;
+    switch (p.kind) {
+    case fault::kind_type::stuck:
+      if (!f->held_)
+        f->held_ = p.value ? *p.value : r.value;
+      r.value = *f->held_;
+      break;
+    case fault::kind_type::drift:
+      r.value +=
+          p.rate * std::chrono::duration<double>(now - f->since_).count();
+      break;
+    case fault::kind_type::noise:
+      r.value += p.sigma * random_.normal();
+      break;
+    case fault::kind_type::spike:
+      if ((hit = random_.uniform() < p.prob))
+        r.value += random_.uniform() < 0.5 ? -p.amp : p.amp;
+      break;
+    case fault::kind_type::quantize:
+      r.value = std::round(r.value * f->inv_step_) * p.step;
+      break;
+    case fault::kind_type::dropout:
+      hit = r.drop = p.prob >= 1.0 || random_.uniform() < p.prob;
+      break;
+    case fault::kind_type::latency:
+      r.delay += p.delay;
+      break;
+    }
+    if (hit)
+      f->hits_.fetch_add(1, std::memory_order_relaxed);
+    if (r.drop)
+      break;
+  }
+  return r;
+}
+
+// Keeps every fault by IO key, polls their conditions and performs the writes
+// delayed by latency faults, on one thread started with the first fault.
+class fault_engine final {
+public:
+  using clock_type = fault::clock_type;
+
+  fault_engine(const fault_engine &) = delete;
+  fault_engine &operator=(const fault_engine &) = delete;
+
+  static fault_engine &shared() {
+    static fault_engine engine_;
+    return engine_;
+  }
+
+  // Bumped whenever a slot is created, so writers holding none look again.
+  std::uint64_t generation() const noexcept {
+    return generation_.load(std::memory_order_acquire);
+  }
+
+  fault_slot::ptr find(const std::string &key) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = slots_.find(key);
+    return it != slots_.end() ? it->second : nullptr;
+  }
+
+  fault::ptr add(const std::string &item, const std::string &key,
+                 const fault_params &params, std::chrono::nanoseconds after,
+                 std::optional<std::chrono::nanoseconds> duration,
+                 const std::optional<std::pair<condition, variant>> &when);
+  // Removes faults by id, item name, IO key or "all", returns how many.
+  std::size_t clear(const std::string &which);
+  // Writes 'writer' once 'delay' has passed.
+  void defer(std::chrono::nanoseconds delay, const variant &writer);
+  void print(std::ostream &os) const;
+
+private:
+  struct deferred {
+    clock_type::time_point due;
+    std::uint64_t seq;
+    variant writer;
+
+    bool operator>(const deferred &other) const noexcept {
+      return due != other.due ? due > other.due : seq > other.seq;
+    }
+  };
+
+  // How often conditions are evaluated.
+  static constexpr auto poll_interval = std::chrono::milliseconds(10);
+
+  fault_engine() = default;
+  ~fault_engine() { halt(); }
+
+  void halt();
+  void run();
+  // Reads the condition items of 'watched', without the engine's lock.
+  static void poll(const std::vector<fault::ptr> &watched);
+
+  mutable std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  std::thread thread_;
+  fault::id_type next_id_ = 1;
+  std::vector<fault::ptr> faults_;
+  std::map<std::string, fault_slot::ptr> slots_;
+  std::atomic<std::uint64_t> generation_ = 0;
+  std::priority_queue<deferred, std::vector<deferred>, std::greater<>> queue_;
+  std::uint64_t seq_ = 0;
+  std::uint64_t delayed_ = 0;
+};
+
+inline fault::ptr
+fault_engine::add(const std::string &item, const std::string &key,
+                  const fault_params &params, std::chrono::nanoseconds after,
+                  std::optional<std::chrono::nanoseconds> duration,
+                  const std::optional<std::pair<condition, variant>> &when) {
+  const auto from = clock_type::now() + after;
+  const auto until =
+      duration ? from + *duration : clock_type::time_point::max();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto f =
+      std::make_shared<fault>(next_id_++, item, key, params, from, until);
+  if (when)
+    f->watch(when->first, when->second);
+  auto &slot = slots_[key];
+  if (!slot) {
+    slot = std::make_shared<fault_slot>();
+    generation_.fetch_add(1, std::memory_order_acq_rel);
+  }
+  slot->add(f);
+  faults_.push_back(f);
+
+  if (!thread_.joinable()) {
+    stop_ = false;
+    thread_ = std::thread(&fault_engine::run, this);
+  }
+  lock.unlock();
+  cv_.notify_all();
+  return f;
+}
+
+inline std::size_t fault_engine::clear(const std::string &which) {
+  auto removed = std::vector<fault::ptr>();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = std::stable_partition(
+        faults_.begin(), faults_.end(), [&](const fault::ptr &f) {
+          return !(which == "all" || which == f->item() ||
+                   which == f->key() || which == std::to_string(f->id()));
+        });
+    removed.assign(it, faults_.end());
+    faults_.erase(it, faults_.end());
+    for (const auto &f : removed)
+      slots_.at(f->key())->remove(f);
+  }
+  return removed.size();
+}
+
+inline void fault_engine::defer(std::chrono::nanoseconds delay,
+                                const variant &writer) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push({clock_type::now() + delay, seq_++, writer});
+  }
+  cv_.notify_all();
+}
+
+inline void fault_engine::halt() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+inline void fault_engine::poll(const std::vector<fault::ptr> &watched) {
+  for (const auto &f : watched)
+    if (f->reader_->read())
+      if (const auto v = std::visit(
+              [](const auto &x) -> std::optional<double> {
+                if constexpr (std::is_arithmetic_v<std::decay_t<decltype(x)>>)
+                  return double(x);
+                else
+                  return std::nullopt;
+              },
+              f->reader_->get()))
+        f->holds_.store(f->when_->eval(*v), std::memory_order_relaxed);
+}
+
+inline void fault_engine::run() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  auto next_poll = clock_type::now();
+  while (!stop_) {
+    const auto now = clock_type::now();
+    if (now >= next_poll) {
+      // Only this thread touches the readers, and the copies keep faults
+      // cleared meanwhile alive.
+      auto watched = std::vector<fault::ptr>();
+      for (const auto &f : faults_)
+        if (f->reader_)
+          watched.push_back(f);
+      lock.unlock();
+      poll(watched);
+      lock.lock();
+      next_poll = now + poll_interval;
+    }
+
+    // Delayed writes go out in order; the queue is short while a latency
+    // fault is active and empty otherwise.
+    while (!queue_.empty() && queue_.top().due <= clock_type::now()) {
+      auto writer = queue_.top().writer;
+      queue_.pop();
+      ++delayed_;
+      lock.unlock();
+      writer.write();
+      lock.lock();
+    }
+
+    // Stopped while the lock was let go.
+    if (stop_)
+      break;
+    auto wake = clock_type::time_point::max();
+    if (std::any_of(faults_.begin(), faults_.end(),
+                    [](const auto &f) { return f->reader_.has_value(); }))
+      wake = next_poll;
+    if (!queue_.empty())
+      wake = std::min(wake, queue_.top().due);
+    if (wake == clock_type::time_point::max())
+      cv_.wait(lock);
+    else
+      cv_.wait_until(lock, wake);
+  }
+}
+
+inline void fault::print(std::ostream &os) const {
+  os << "[" << id_ << "][" << item_ << "][" << key_ << "]["
+     << fault_params::kind_to_str(kind());
+  switch (kind()) {
+  case kind_type::stuck:
+    if (params_.value)
+      os << " value=" << *params_.value;
+    break;
+  case kind_type::drift:
+    os << " rate=" << params_.rate << "/s";
+    break;
+  case kind_type::noise:
+    os << " sigma=" << params_.sigma;
+    break;
+  case kind_type::spike:
+    os << " amp=" << params_.amp << " prob=" << params_.prob;
+    break;
+  case kind_type::quantize:
+    os << " step=" << params_.step;
+    break;
+  case kind_type::dropout:
+    os << " prob=" << params_.prob;
+    break;
+  case kind_type::latency:
+    os << " delay=" << std::chrono::duration<double>(params_.delay).count()
+       << "s";
+    break;
+  }
+  os << "]";
+
+  const auto now = clock_type::now();
+  if (from_ > now)
+    os << "[in " << std::chrono::duration<double>(from_ - now).count() << "s]";
+  if (until_ != clock_type::time_point::max())
+    os << "[until +"
+       << std::chrono::duration<double>(std::max(until_ - now,
+                                                 clock_type::duration::zero()))
+              .count()
+       << "s]";
+  if (when_)
+    os << "[when " << *when_ << "]";
+  os << "[" << (active(now) ? "active" : now >= until_ ? "expired" : "armed")
+     << "][hits: " << hits() << "]";
+}
+
+inline void fault_engine::print(std::ostream &os) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (const auto &f : faults_) {
+    f->print(os);
+    os << "\n";
+  }
+  os << "[fault][" << faults_.size() << " faults][delayed writes: " << delayed_
+     << ", pending: " << queue_.size() << "]";
+}
+} // namespace ctf_io
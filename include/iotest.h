@@ -0,0 +1,114 @@
+#ifndef IOTEST_H
+#define IOTEST_H
+
+/*
+ * libiotest: injects and queries emulated IO from other programs in-process,
+ * the same way the io_test commands do.
+ *
+ * A session holds a loaded conf-io.xml, items are resolved once to handles
+ * and then read or written without any lookup. Calls on one session must not
+ * overlap; use one session per thread. Subscriptions poll on a thread of
+ * their own and call back on it.
+ *
+ * Every function returning int returns IOTEST_OK or a negative status,
+ * iotest_last_error() describes the last failure of the calling thread.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32) && defined(IOTEST_SHARED)
+#ifdef IOTEST_BUILD
+#define IOTEST_API __declspec(dllexport)
+#else
+#define IOTEST_API __declspec(dllimport)
+#endif
+#elif defined(__GNUC__)
+#define IOTEST_API __attribute__((visibility("default")))
+#else
+#define IOTEST_API
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum iotest_status {
+  IOTEST_OK = 0,
+  IOTEST_ERROR = -1,
+  IOTEST_NOT_FOUND = -2,
+  IOTEST_BAD_HANDLE = -3,
+  IOTEST_IO_FAILED = -4,
+  IOTEST_NOT_NUMERIC = -5,
+  IOTEST_TOO_SMALL = -6,
+};
+
+typedef struct iotest_session iotest_session;
+/* An item's index in its session, from 0 to iotest_item_count() - 1. */
+typedef int32_t iotest_item;
+typedef uint64_t iotest_subscription;
+
+/* Called with the new value of a subscribed item, 'value' is NaN for strings
+ * and 'text' the value as io_test prints it. */
+typedef void (*iotest_callback)(void *user, iotest_item item, double value,
+                                const char *text);
+
+/* Connects to the IO service, once per process before any read or write.
+ * io_test calls these itself. */
+IOTEST_API int iotest_init(void);
+IOTEST_API void iotest_uninit(void);
+
+IOTEST_API const char *iotest_last_error(void);
+
+/* Loads 'conf_path', or the conf-io.xml io_test would load if NULL. */
+IOTEST_API int iotest_open(const char *conf_path, iotest_session **session);
+IOTEST_API void iotest_close(iotest_session *session);
+
+IOTEST_API size_t iotest_item_count(const iotest_session *session);
+IOTEST_API const char *iotest_item_name(const iotest_session *session,
+                                        iotest_item item);
+IOTEST_API int iotest_resolve(iotest_session *session, const char *name,
+                              iotest_item *item);
+
+/* Reads the readback 'pr', writes go to 'pw' or to 'pr' without a 'pw'. */
+IOTEST_API int iotest_get(iotest_session *session, iotest_item item,
+                          double *value);
+IOTEST_API int iotest_get_text(iotest_session *session, iotest_item item,
+                               char *buf, size_t size);
+IOTEST_API int iotest_set(iotest_session *session, iotest_item item,
+                          double value);
+IOTEST_API int iotest_set_text(iotest_session *session, iotest_item item,
+                               const char *value);
+
+/* Batches go through every item even after a failure, 'status' may be NULL
+ * or receives each item's own status; the first failure is returned. */
+IOTEST_API int iotest_get_batch(iotest_session *session,
+                                const iotest_item *items, size_t count,
+                                double *values, int *status);
+IOTEST_API int iotest_set_batch(iotest_session *session,
+                                const iotest_item *items,
+                                const double *values, size_t count,
+                                int *status);
+
+/* Reads every item of the session in handle order, 'count' must be at least
+ * iotest_item_count(). Unreadable and string items read as NaN. */
+IOTEST_API int iotest_snapshot(iotest_session *session, double *values,
+                               size_t count);
+
+/* Polls 'items' every 'interval_us' and calls back for each value that
+ * changed, starting with the first value read. */
+IOTEST_API int iotest_subscribe(iotest_session *session,
+                                const iotest_item *items, size_t count,
+                                uint32_t interval_us, iotest_callback callback,
+                                void *user, iotest_subscription *sub);
+/* Returns once the callback of 'sub' is no longer running. Called from that
+ * callback, or iotest_close() from any callback of the session, it returns at
+ * once and no further callback follows the one running. */
+IOTEST_API int iotest_unsubscribe(iotest_session *session,
+                                  iotest_subscription sub);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
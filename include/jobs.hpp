@@ -0,0 +1,274 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "console.hpp"
+
+namespace termctl {
+class job final {
+public:
+  using ptr = std::shared_ptr<job>;
+  using id_type = std::uint32_t;
+  using body_type = std::function<void()>;
+
+  enum class state_type { running, done, cancelled };
+
+  job() = delete;
+  job(const job &) = delete;
+  job &operator=(const job &) = delete;
+
+  job(id_type id, const std::string &line, bool background)
+      : id_(id), line_(line), background_(background) {}
+
+  ~job() {
+    if (thread_.joinable())
+      thread_.join();
+  }
+
+  id_type id() const noexcept { return id_; }
+  const std::string &line() const noexcept { return line_; }
+  bool background() const noexcept { return background_; }
+  void set_background(bool background) noexcept { background_ = background; }
+
+  state_type state() const noexcept {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return state_;
+  }
+  bool done() const noexcept { return state() != state_type::running; }
+
+  bool stop_requested() const noexcept {
+    return stop_.load(std::memory_order_acquire);
+  }
+
+  void request_stop() noexcept {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_.store(true, std::memory_order_release);
+    }
+    cv_.notify_all();
+  }
+
+  // Sleeps until the deadline, returns false if woken by a stop request.
+  template <typename Clock, typename Duration>
+  bool sleep_until(const std::chrono::time_point<Clock, Duration> &tp) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return !cv_.wait_until(lock, tp, [this] { return stop_requested(); });
+  }
+
+  // Waits for the job to finish.
+  void wait() const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return state_ != state_type::running; });
+  }
+
+  // Waits for the job to finish, returns false on timeout.
+  template <typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period> &d) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, d,
+                        [this] { return state_ != state_type::running; });
+  }
+
+  void start(body_type &&body);
+
+private:
+  void finish(state_type state) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      state_ = state;
+    }
+    cv_.notify_all();
+  }
+
+  id_type id_;
+  std::string line_;
+  std::atomic_bool background_;
+  std::atomic_bool stop_ = false;
+  state_type state_ = state_type::running;
+  mutable std::mutex mutex_;
+  mutable std::condition_variable cv_;
+  std::thread thread_;
+};
+
+namespace this_job {
+namespace detail {
+inline thread_local job *current = nullptr;
+}
+
+inline job *current() noexcept { return detail::current; }
+
+// Long-running commands poll this to honor Ctrl-C and 'kill'.
+inline bool stop_requested() noexcept {
+  return detail::current && detail::current->stop_requested();
+}
+
+template <typename Clock, typename Duration>
+bool sleep_until(const std::chrono::time_point<Clock, Duration> &tp) {
+  if (detail::current)
+    return detail::current->sleep_until(tp);
+  std::this_thread::sleep_until(tp);
+  return true;
+}
+
+template <typename Rep, typename Period>
+bool sleep_for(const std::chrono::duration<Rep, Period> &d) {
+  return sleep_until(std::chrono::steady_clock::now() + d);
+}
+
+// Makes 'j' the job of the calling thread for a while, so a command run
+// inline still honors stop requests made on 'j'.
+class scope final {
+public:
+  explicit scope(job &j) noexcept : prev_(std::exchange(detail::current, &j)) {}
+  ~scope() { detail::current = prev_; }
+
+  scope(const scope &) = delete;
+  scope &operator=(const scope &) = delete;
+
+private:
+  job *prev_;
+};
+
+// Blocks until the task behind 'h' is done, cancelling it once the job is
+// asked to stop.
+template <typename Handle> void await(const Handle &h) {
+  auto cancelled = false;
+  while (!h.wait_for(std::chrono::milliseconds(20)))
+    if (!cancelled && stop_requested()) {
+      h.cancel();
+      cancelled = true;
+    }
+  h.rethrow();
+}
+} // namespace this_job
+
+inline void job::start(body_type &&body) {
+  thread_ = std::thread([this, body = std::move(body)] {
+    this_job::detail::current = this;
+    auto state = state_type::done;
+    {
+      console_buf outbuf(console::stream_type::out);
+      console_buf errbuf(console::stream_type::err);
+      std::ostream os(&outbuf), es(&errbuf);
+      scoped_output redirect(os, es);
+      try {
+        body();
+      } catch (const std::exception &e) {
+        es << "Error: " << e.what() << std::endl;
+      } catch (...) {
+        es << "Error: unexpected error" << std::endl;
+      }
+
+      if (stop_requested())
+        state = state_type::cancelled;
+      if (background_)
+        os << "[" << id_ << "] "
+           << (state == state_type::cancelled ? "Cancelled" : "Done") << "  "
+           << line_ << std::endl;
+    }
+    this_job::detail::current = nullptr;
+    finish(state);
+    console::shared().notify(console::wake_event);
+  });
+}
+
+class job_table final {
+public:
+  using jobs_type = std::map<job::id_type, job::ptr>;
+
+  job_table(const job_table &) = delete;
+  job_table &operator=(const job_table &) = delete;
+
+  static job_table &shared() {
+    static job_table table_;
+    return table_;
+  }
+
+  job::ptr spawn(const std::string &line, job::body_type &&body,
+                 bool background) {
+    reap();
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto id = job::id_type(1);
+    while (jobs_.count(id))
+      ++id;
+
+    auto j = std::make_shared<job>(id, line, background);
+    jobs_.emplace(id, j);
+    j->start(std::move(body));
+    return j;
+  }
+
+  job::ptr find(job::id_type id) const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (auto it = jobs_.find(id); it != jobs_.cend())
+      return it->second;
+    return nullptr;
+  }
+
+  // The most recently started background job, like '%+' of a shell.
+  job::ptr latest_background() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (auto it = jobs_.crbegin(); it != jobs_.crend(); ++it)
+      if (it->second->background() && !it->second->done())
+        return it->second;
+    return nullptr;
+  }
+
+  std::vector<job::ptr> list() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto vec = std::vector<job::ptr>();
+    for (const auto &[id, j] : jobs_)
+      if (j->background())
+        vec.push_back(j);
+    return vec;
+  }
+
+  // Drops finished jobs so their ids can be reused.
+  void reap() {
+    auto finished = std::vector<job::ptr>();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = jobs_.begin(); it != jobs_.end();)
+        if (it->second->done()) {
+          finished.push_back(std::move(it->second));
+          it = jobs_.erase(it);
+        } else {
+          ++it;
+        }
+    }
+  }
+
+  void stop_all() {
+    auto all = std::vector<job::ptr>();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto &[id, j] : jobs_)
+        all.push_back(std::move(j));
+      jobs_.clear();
+    }
+
+    for (auto &j : all)
+      j->request_stop();
+  }
+
+private:
+  job_table() = default;
+
+  mutable std::mutex mutex_;
+  jobs_type jobs_;
+};
+} // namespace termctl
@@ -0,0 +1,323 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <sqlite3.h>
+
+namespace ctf_io {
+// Records the result of every 'get' and 'set' in an SQLite database, when
+// IOTEST_JOURNAL names one. Recording only queues the entry; a writer thread
+// inserts what has queued up in one transaction, in WAL mode, so commands
+// never wait on the disk and readers never block the writer.
+class journal final {
+public:
+  using clock_type = std::chrono::system_clock;
+
+  struct entry {
+    clock_type::time_point t;
+    const char *op;
+    std::string item;
+    std::string key;
+    std::string value;
+    bool ok;
+    std::chrono::nanoseconds latency;
+  };
+
+  journal(const journal &) = delete;
+  journal &operator=(const journal &) = delete;
+
+  static journal &shared() {
+    static journal journal_;
+    return journal_;
+  }
+
+  bool enabled() const noexcept { return db_ != nullptr; }
+  const std::string &path() const noexcept { return path_; }
+
+  void record(entry &&e) {
+    if (!enabled())
+      return;
+    auto full = false;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back(std::move(e));
+      full = queue_.size() >= batch_size;
+    }
+    if (full)
+      cv_.notify_one();
+  }
+
+  // Returns once everything recorded so far is committed.
+  void flush();
+
+  // Prints the entries of 'item', a GLOB pattern, recorded in the last
+  // 'since', oldest first; at most the latest 'limit' of them.
+  void query(std::ostream &os, const std::string &item,
+             std::chrono::nanoseconds since, std::size_t limit) const;
+
+private:
+  // Commits at the latest after this long, or once this many are queued.
+  static constexpr auto batch_interval = std::chrono::milliseconds(200);
+  static constexpr std::size_t batch_size = 1000;
+
+  using db_ptr = std::unique_ptr<sqlite3, decltype(&sqlite3_close)>;
+  using stmt_ptr = std::unique_ptr<sqlite3_stmt, decltype(&sqlite3_finalize)>;
+
+  journal();
+  ~journal();
+
+  void open();
+  static void exec(sqlite3 *db, const char *sql);
+  static stmt_ptr prepare(sqlite3 *db, const char *sql);
+  static double to_seconds(clock_type::time_point t) {
+    return std::chrono::duration<double>(t.time_since_epoch()).count();
+  }
+
+  void run();
+  void commit(const std::vector<entry> &batch);
+
+  std::string path_;
+  db_ptr db_{nullptr, sqlite3_close};
+  stmt_ptr insert_{nullptr, sqlite3_finalize};
+  std::int64_t session_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::condition_variable flushed_;
+  std::vector<entry> queue_;
+  std::uint64_t queued_ = 0;
+  std::uint64_t committed_ = 0;
+  bool flush_ = false;
+  bool stop_ = false;
+  std::thread thread_;
+};
+
+inline void journal::exec(sqlite3 *db, const char *sql) {
+  char *msg = nullptr;
+  if (sqlite3_exec(db, sql, nullptr, nullptr, &msg) != SQLITE_OK) {
+    auto what = std::string(msg ? msg : sqlite3_errmsg(db));
+    sqlite3_free(msg);
+    throw std::runtime_error("journal: " + what);
+  }
+}
+
+inline journal::stmt_ptr journal::prepare(sqlite3 *db, const char *sql) {
+  sqlite3_stmt *stmt = nullptr;
+  if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) != SQLITE_OK)
+    throw std::runtime_error(std::string("journal: ") + sqlite3_errmsg(db));
+  return stmt_ptr(stmt, sqlite3_finalize);
+}
+
+inline journal::journal() {
+  const auto env = std::getenv("IOTEST_JOURNAL");
+  if (env == nullptr || *env == '\0')
+    return;
+  path_ = env;
+
+  // A journal that cannot be opened is reported once and stays off.
+  try {
+    open();
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+    insert_.reset();
+    db_.reset();
+  }
+}
+
+inline void journal::open() {
+  sqlite3 *db = nullptr;
+  const auto ret = sqlite3_open_v2(
+      path_.c_str(), &db,
+      SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX,
+      nullptr);
+  auto owner = db_ptr(db, sqlite3_close);
+  if (ret != SQLITE_OK)
+    throw std::runtime_error("journal: " +
+                             std::string(db ? sqlite3_errmsg(db)
+                                            : sqlite3_errstr(ret)));
+
+  // Shard workers journal to the same file, each from its own process.
+  sqlite3_busy_timeout(db, 2000);
+
+  // WAL commits append to the log without syncing each time, which is as
+  // durable as a journal of a test session needs to be.
+  exec(db, "PRAGMA journal_mode=WAL;"
+           "PRAGMA synchronous=NORMAL;"
+           "CREATE TABLE IF NOT EXISTS journal ("
+           "  id INTEGER PRIMARY KEY,"
+           "  session INTEGER NOT NULL,"
+           "  t REAL NOT NULL,"
+           "  op TEXT NOT NULL,"
+           "  item TEXT NOT NULL,"
+           "  key TEXT NOT NULL,"
+           "  value TEXT,"
+           "  ok INTEGER NOT NULL,"
+           "  latency_us REAL NOT NULL);"
+           "CREATE INDEX IF NOT EXISTS journal_item_t ON journal (item, t);"
+           "CREATE INDEX IF NOT EXISTS journal_t ON journal (t);");
+  insert_ = prepare(db, "INSERT INTO journal (session, t, op, item, key, "
+                        "value, ok, latency_us) VALUES (?, ?, ?, ?, ?, ?, ?, "
+                        "?)");
+  session_ = std::int64_t(std::time(nullptr));
+  db_ = std::move(owner);
+  thread_ = std::thread(&journal::run, this);
+}
+
+inline journal::~journal() {
+  if (!thread_.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  thread_.join();
+  insert_.reset();
+}
+
+inline void journal::run() {
+  auto batch = std::vector<entry>();
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (;;) {
+    cv_.wait_for(lock, batch_interval, [this] {
+      return stop_ || flush_ || queue_.size() >= batch_size;
+    });
+    flush_ = false;
+    if (!queue_.empty()) {
+      batch.swap(queue_);
+      queued_ += batch.size();
+      lock.unlock();
+      try {
+        commit(batch);
+      } catch (const std::exception &e) {
+        // Losing a batch must not take the session down with it.
+        std::cerr << "Error: " << e.what() << std::endl;
+      }
+      lock.lock();
+      committed_ += batch.size();
+      batch.clear();
+      flushed_.notify_all();
+    } else if (stop_) {
+      return;
+    }
+  }
+}
+
+inline void journal::commit(const std::vector<entry> &batch) {
+  auto *db = db_.get();
+  auto *stmt = insert_.get();
+  exec(db, "BEGIN");
+  for (const auto &e : batch) {
+    sqlite3_bind_int64(stmt, 1, session_);
+    sqlite3_bind_double(stmt, 2, to_seconds(e.t));
+    sqlite3_bind_text(stmt, 3, e.op, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 4, e.item.c_str(), -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 5, e.key.c_str(), -1, SQLITE_STATIC);
+    if (e.ok)
+      sqlite3_bind_text(stmt, 6, e.value.c_str(), -1, SQLITE_STATIC);
+    else
+      sqlite3_bind_null(stmt, 6);
+    sqlite3_bind_int(stmt, 7, e.ok ? 1 : 0);
+    sqlite3_bind_double(stmt, 8,
+                        std::chrono::duration<double, std::micro>(e.latency)
+                            .count());
+    const auto ret = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    if (ret != SQLITE_DONE) {
+      const auto what = std::string(sqlite3_errmsg(db));
+      sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr);
+      throw std::runtime_error("journal: " + what);
+    }
+  }
+  exec(db, "COMMIT");
+}
+
+inline void journal::flush() {
+  if (!enabled())
+    return;
+  std::unique_lock<std::mutex> lock(mutex_);
+  const auto target = queued_ + queue_.size();
+  flush_ = true;
+  cv_.notify_one();
+  flushed_.wait(lock, [&] { return committed_ >= target || stop_; });
+}
+
+inline void journal::query(std::ostream &os, const std::string &item,
+                           std::chrono::nanoseconds since,
+                           std::size_t limit) const {
+  if (!enabled())
+    throw std::runtime_error("the journal is off, set IOTEST_JOURNAL to a "
+                             "database file to record one");
+
+  // A connection of its own; WAL lets it read while the writer commits.
+  sqlite3 *db = nullptr;
+  const auto ret = sqlite3_open_v2(path_.c_str(), &db, SQLITE_OPEN_READONLY,
+                                   nullptr);
+  auto owner = db_ptr(db, sqlite3_close);
+  if (ret != SQLITE_OK)
+    throw std::runtime_error("journal: " +
+                             std::string(db ? sqlite3_errmsg(db)
+                                            : sqlite3_errstr(ret)));
+
+  // Served by the (item, t) index, newest first so LIMIT keeps the latest.
+  const auto exact = item.find_first_of("*?[") == std::string::npos;
+  auto stmt = prepare(
+      db, exact ? "SELECT t, op, item, key, value, ok, latency_us FROM journal "
+                  "WHERE item = ?1 AND t >= ?2 ORDER BY t DESC LIMIT ?3"
+                : "SELECT t, op, item, key, value, ok, latency_us FROM journal "
+                  "WHERE item GLOB ?1 AND t >= ?2 ORDER BY t DESC LIMIT ?3");
+  const auto from =
+      since.count() > 0
+          ? to_seconds(clock_type::now() -
+                       std::chrono::duration_cast<clock_type::duration>(since))
+          : 0.0;
+  sqlite3_bind_text(stmt.get(), 1, item.c_str(), -1, SQLITE_STATIC);
+  sqlite3_bind_double(stmt.get(), 2, from);
+  sqlite3_bind_int64(stmt.get(), 3, std::int64_t(limit));
+
+  auto lines = std::vector<std::string>();
+  auto step = 0;
+  while ((step = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+    const auto text = [&](int col) {
+      const auto *s = sqlite3_column_text(stmt.get(), col);
+      return s ? std::string(reinterpret_cast<const char *>(s)) : "";
+    };
+    const auto t = sqlite3_column_double(stmt.get(), 0);
+    const auto secs = std::time_t(t);
+    const auto ms = int((t - double(secs)) * 1000);
+    char stamp[32];
+    const auto n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S",
+                                 std::localtime(&secs));
+    std::snprintf(stamp + n, sizeof(stamp) - n, ".%03d", ms);
+
+    const auto ok = sqlite3_column_int(stmt.get(), 5) != 0;
+    auto line = std::string("[") + stamp + "][" + (ok ? "OK" : "FAIL") +
+                "][" + text(1) + "][" + text(2) + "][" + text(3) + "] " +
+                (ok ? text(4) : "-");
+    char latency[32];
+    std::snprintf(latency, sizeof(latency), " (%.1fus)",
+                  sqlite3_column_double(stmt.get(), 6));
+    lines.push_back(line + latency);
+  }
+  if (step != SQLITE_DONE)
+    throw std::runtime_error(std::string("journal: ") + sqlite3_errmsg(db));
+
+  for (auto it = lines.rbegin(); it != lines.rend(); ++it)
+    os << *it << "\n";
+  os << "[history][" << item << "] " << lines.size() << " entries";
+}
+} // namespace ctf_io
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstdio>
+#include <string>
+#include <string_view>
+
+namespace termctl {
+// Quotes 's' as a JSON string.
+inline std::string json_string(std::string_view s) {
+  auto json = std::string("\"");
+  for (const auto ch : s)
+    switch (ch) {
+    case '"':
+      json += "\\\"";
+      break;
+    case '\\':
+      json += "\\\\";
+      break;
+    case '\n':
+      json += "\\n";
+      break;
+    case '\r':
+      json += "\\r";
+      break;
+    case '\t':
+      json += "\\t";
+      break;
+    default:
+      if (static_cast<unsigned char>(ch) < 0x20) {
+        char buf[8];
+        std::snprintf(buf, sizeof(buf), "\\u%04x",
+                      unsigned(static_cast<unsigned char>(ch)));
+        json += buf;
+      } else {
+        json += ch;
+      }
+    }
+  json += '"';
+  return json;
+}
+} // namespace termctl
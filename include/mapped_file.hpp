@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#ifdef _WIN32
+// Keeps min()/max() macros and the rest of Win32 out of the headers after
+// this one.
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ctf_io {
+// A read-only view of a whole file. Pages are faulted in on access, and
+// release() hands pages already consumed back to the kernel, so a file far
+// larger than memory can be streamed front to back.
+class mapped_file final {
+public:
+  mapped_file() = delete;
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+
+  explicit mapped_file(const std::filesystem::path &filepath) {
+#ifdef _WIN32
+    file_ = CreateFileW(filepath.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                        nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN,
+                        nullptr);
+    if (file_ == INVALID_HANDLE_VALUE)
+      throw std::runtime_error("cannot open file: " + filepath.string());
+
+    LARGE_INTEGER size;
+    GetFileSizeEx(file_, &size);
+    size_ = static_cast<std::size_t>(size.QuadPart);
+    if (size_ != 0) {
+      mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0,
+                                    nullptr);
+      if (mapping_ != nullptr)
+        data_ = static_cast<const char *>(
+            MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+      if (data_ == nullptr) {
+        close();
+        throw std::runtime_error("cannot map file: " + filepath.string());
+      }
+    }
+#else
+    fd_ = ::open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0)
+      throw std::runtime_error("cannot open file: " + filepath.string());
+
+    struct stat st;
+    if (::fstat(fd_, &st) != 0) {
+      close();
+      throw std::runtime_error("cannot stat file: " + filepath.string());
+    }
+
+    size_ = static_cast<std::size_t>(st.st_size);
+    if (size_ != 0) {
+      auto addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+      if (addr == MAP_FAILED) {
+        close();
+        throw std::runtime_error("cannot map file: " + filepath.string());
+      }
+      data_ = static_cast<const char *>(addr);
+      ::madvise(addr, size_, MADV_SEQUENTIAL);
+    }
+#endif
+  }
+
+  ~mapped_file() { close(); }
+
+  const char *data() const noexcept { return data_; }
+  std::size_t size() const noexcept { return size_; }
+  std::string_view view() const noexcept { return {data_, size_}; }
+
+  // Drops the pages before 'offset' from memory; they are read from the file
+  // again should they be touched later.
+  void release(std::size_t offset) noexcept {
+#ifndef _WIN32
+    static const auto page = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    offset -= offset % page;
+    if (offset > released_) {
+      ::madvise(const_cast<char *>(data_) + released_, offset - released_,
+                MADV_DONTNEED);
+      released_ = offset;
+    }
+#else
+    (void)offset;
+#endif
+  }
+
+private:
+  void close() noexcept {
+#ifdef _WIN32
+    if (data_ != nullptr)
+      UnmapViewOfFile(data_);
+    if (mapping_ != nullptr)
+      CloseHandle(mapping_);
+    if (file_ != INVALID_HANDLE_VALUE)
+      CloseHandle(file_);
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+#else
+    if (data_ != nullptr)
+      ::munmap(const_cast<char *>(data_), size_);
+    if (fd_ >= 0)
+      ::close(fd_);
+    fd_ = -1;
+#endif
+    data_ = nullptr;
+  }
+
+#ifdef _WIN32
+  HANDLE file_ = INVALID_HANDLE_VALUE;
+  HANDLE mapping_ = nullptr;
+#else
+  int fd_ = -1;
+  std::size_t released_ = 0;
+#endif
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+};
+} // namespace ctf_io
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "args.hpp"
+#include "channel.hpp"
+#include "conf_parser.hpp"
+#include "task.hpp"
+#include "variant.hpp"
+
+namespace ctf_io {
+struct plant_params {
+  enum class mode_type { follow, integrate };
+
+  // follow:    y -> gain * u + offset
+  // integrate: y -> y + gain * u * dt
+  // The target is reached through the deadtime on 'u', then a first order
+  // lag, then the slew limit, and is clamped to [min, max].
+  mode_type mode = mode_type::follow;
+  double gain = 1.0;
+  double offset = 0.0;
+  std::chrono::nanoseconds lag{0};
+  std::chrono::nanoseconds deadtime{0};
+  double slew = std::numeric_limits<double>::infinity();
+  double min = -std::numeric_limits<double>::infinity();
+  double max = std::numeric_limits<double>::infinity();
+
+  static mode_type parse_mode(const std::string &name) {
+    if (name == "follow")
+      return mode_type::follow;
+    else if (name == "integrate")
+      return mode_type::integrate;
+    throw std::invalid_argument("invalid mode \"" + name + "\"");
+  }
+
+  static const char *mode_to_str(mode_type mode) noexcept {
+    return mode == mode_type::follow ? "follow" : "integrate";
+  }
+};
+
+// Models the readback of items from their commanded value. All models step
+// together on one thread at a fixed rate; their state is kept as parallel
+// arrays so each stage of a step is one tight loop over every model.
+class plant_engine final {
+public:
+  using item = conf::io_parser::item;
+  using clock_type = std::chrono::steady_clock;
+
+  plant_engine(const plant_engine &) = delete;
+  plant_engine &operator=(const plant_engine &) = delete;
+
+  static plant_engine &shared() {
+    static plant_engine engine_;
+    return engine_;
+  }
+
+  double rate() const noexcept { return rate_; }
+
+  using binding = std::pair<item, item>;
+
+  // Models each 'first' from the 'pw' of 'second', replacing any model of
+  // that item.
+  void add(const std::vector<binding> &bindings, const plant_params &params);
+  // Removes models by item name or "all", returns how many.
+  std::size_t stop(const std::string &which);
+  void print(std::ostream &os) const;
+
+private:
+  struct model {
+    channel output;
+    std::string input_key;
+    variant input;
+    plant_params params;
+  };
+
+  plant_engine() {
+    // An invalid rate keeps the default.
+    if (const auto env = std::getenv("IOTEST_PLANT_RATE"); env != nullptr) {
+      try {
+        rate_ = termctl::parse_rate(env);
+      } catch (const std::invalid_argument &) {
+      }
+    }
+  }
+
+  ~plant_engine() { halt(); }
+
+  void rebuild();
+  void halt();
+  void run();
+  void step();
+
+  double rate_ = 1000.0;
+  // Serializes add() and stop(), which start and join the thread.
+  std::mutex control_;
+  mutable std::mutex mutex_;
+  std::vector<model> models_;
+  // Set when 'models_' changed; the thread then copies them before its next
+  // step. 'shown_' holds the outputs of the last step for print().
+  bool changed_ = false;
+  std::vector<double> shown_;
+
+  // Owned by the thread, which steps them without holding 'mutex_'.
+  std::vector<model> live_;
+  // Per model parameters and state, indexed like 'live_'.
+  std::vector<double> gain_, offset_, integrate_, alpha_, slew_, min_, max_;
+  std::vector<double> u_, delayed_, y_, written_;
+  std::vector<char> integer_;
+  std::vector<std::size_t> delay_off_, delay_len_;
+  std::vector<double> delay_;
+  std::uint64_t steps_ = 0;
+
+  std::thread thread_;
+  std::condition_variable cv_;
+  bool stop_ = false;
+  clock_type::time_point start_;
+  runtime::deadline_stats stats_;
+  std::atomic<std::int64_t> busy_sum_ = 0;
+  std::atomic<std::int64_t> busy_max_ = 0;
+  std::atomic<std::uint64_t> writes_ = 0;
+};
+
+inline void plant_engine::add(const std::vector<binding> &bindings,
+                              const plant_params &params) {
+  auto added = std::vector<model>();
+  for (const auto &[out, in] : bindings) {
+    if (out.pr.empty())
+      throw std::invalid_argument("the item \"" + out.name + "\" has no 'pr'");
+    if (in.pw.empty())
+      throw std::invalid_argument("the item \"" + in.name + "\" has no 'pw'");
+    if (in.pw == out.pr)
+      throw std::invalid_argument("the item \"" + in.name +
+                                  "\" has the same 'pw' and 'pr'");
+    auto &m = added.emplace_back(
+        model{channel(out, channel::side_type::readback), in.pw,
+              variant(in.dt, in.pw), params});
+    if (!m.output.numeric() || in.dt == item::data_type::string_val)
+      throw std::invalid_argument("plant models need numeric items");
+  }
+
+  std::lock_guard<std::mutex> control(control_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (auto &m : added) {
+    auto it = std::find_if(models_.begin(), models_.end(), [&](const model &e) {
+      return e.output.name() == m.output.name();
+    });
+    if (it != models_.end())
+      *it = std::move(m);
+    else
+      models_.push_back(std::move(m));
+  }
+  changed_ = true;
+
+  if (!thread_.joinable()) {
+    stop_ = false;
+    start_ = clock_type::now();
+    stats_.reset();
+    busy_sum_ = busy_max_ = 0;
+    thread_ = std::thread(&plant_engine::run, this);
+  }
+}
+
+inline std::size_t plant_engine::stop(const std::string &which) {
+  std::lock_guard<std::mutex> control(control_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  const auto before = models_.size();
+  models_.erase(std::remove_if(models_.begin(), models_.end(),
+                               [&](const model &m) {
+                                 return which == "all" ||
+                                        which == m.output.name();
+                               }),
+                models_.end());
+  const auto removed = before - models_.size();
+  changed_ = true;
+  const auto idle = models_.empty();
+  lock.unlock();
+
+  if (idle)
+    halt();
+  return removed;
+}
+
+inline void plant_engine::halt() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_all();
+  if (thread_.joinable())
+    thread_.join();
+}
+
+// Rebuilding restarts every model from its current readback and command.
+inline void plant_engine::rebuild() {
+  const auto n = live_.size();
+  const auto dt = 1.0 / rate_;
+  for (auto *v : {&gain_, &offset_, &integrate_, &alpha_, &slew_, &min_,
+                  &max_, &u_, &delayed_, &y_, &written_})
+    v->assign(n, 0.0);
+  integer_.assign(n, 0);
+  delay_off_.assign(n, 0);
+  delay_len_.assign(n, 0);
+  delay_.clear();
+
+  for (std::size_t i = 0; i < n; ++i) {
+    auto &m = live_[i];
+    const auto &p = m.params;
+    const auto lag = std::chrono::duration<double>(p.lag).count();
+    const auto deadtime = std::chrono::duration<double>(p.deadtime).count();
+    gain_[i] = p.gain;
+    offset_[i] = p.offset;
+    integrate_[i] = p.mode == plant_params::mode_type::integrate ? 1.0 : 0.0;
+    alpha_[i] = lag > 0 ? 1.0 - std::exp(-dt / lag) : 1.0;
+    slew_[i] = p.slew * dt;
+    min_[i] = p.min;
+    max_[i] = p.max;
+    integer_[i] = m.output.get_item().dt == item::data_type::int_val;
+
+    if (m.input.read())
+      u_[i] = channel::to_double(m.input).value_or(0.0);
+    y_[i] = m.output.read_double().value_or(0.0);
+    written_[i] = y_[i];
+
+    delay_off_[i] = delay_.size();
+    delay_len_[i] = std::size_t(std::llround(deadtime / dt)) + 1;
+    delay_.resize(delay_.size() + delay_len_[i], u_[i]);
+  }
+}
+
+inline void plant_engine::step() {
+  const auto n = live_.size();
+  const auto dt = 1.0 / rate_;
+
+  for (std::size_t i = 0; i < n; ++i)
+    if (live_[i].input.read())
+      u_[i] = channel::to_double(live_[i].input).value_or(u_[i]);
+
+  // A delay line of length L holds the last L inputs; the slot written L-1
+  // steps ago is the one read next, and is overwritten right after.
+  for (std::size_t i = 0; i < n; ++i) {
+    auto *line = &delay_[delay_off_[i]];
+    const auto len = delay_len_[i];
+    line[steps_ % len] = u_[i];
+    delayed_[i] = line[(steps_ + 1) % len];
+  }
+
+  for (std::size_t i = 0; i < n; ++i) {
+    const auto drive = gain_[i] * delayed_[i];
+    const auto target = integrate_[i] * (y_[i] + drive * dt) +
+                        (1.0 - integrate_[i]) * (drive + offset_[i]);
+    const auto dy = alpha_[i] * (target - y_[i]);
+    const auto limited = std::min(std::max(dy, -slew_[i]), slew_[i]);
+    y_[i] = std::min(std::max(y_[i] + limited, min_[i]), max_[i]);
+  }
+
+  // Only changes are written, so settled models cost the IO server nothing.
+  auto writes = std::uint64_t(0);
+  for (std::size_t i = 0; i < n; ++i) {
+    if (integer_[i] ? std::lround(y_[i]) == std::lround(written_[i])
+                    : std::fabs(y_[i] - written_[i]) <=
+                          1e-9 * std::max(1.0, std::fabs(y_[i])))
+      continue;
+    if (live_[i].output.write(y_[i]))
+      ++writes;
+    written_[i] = y_[i];
+  }
+  writes_.fetch_add(writes, std::memory_order_relaxed);
+  ++steps_;
+}
+
+inline void plant_engine::run() {
+  const auto period = runtime::rate_period(rate_);
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (std::int64_t k = 1;; ++k) {
+    auto deadline = start_ + period * k;
+    if (cv_.wait_until(lock, deadline, [this] { return stop_; }))
+      return;
+
+    auto lateness = clock_type::now() - deadline;
+    if (lateness >= period) {
+      const auto skipped = lateness / period;
+      stats_.miss(std::uint64_t(skipped));
+      k += skipped;
+      lateness -= period * skipped;
+    }
+
+    const auto changed = std::exchange(changed_, false);
+    if (changed)
+      live_ = models_;
+    lock.unlock();
+    if (changed)
+      rebuild();
+    const auto begin = clock_type::now();
+    step();
+    const auto busy = (clock_type::now() - begin).count();
+    busy_sum_.fetch_add(busy, std::memory_order_relaxed);
+    if (busy > busy_max_.load(std::memory_order_relaxed))
+      busy_max_.store(busy, std::memory_order_relaxed);
+    lock.lock();
+    stats_.record(lateness, true);
+    if (!changed_)
+      shown_ = y_;
+  }
+}
+
+inline void plant_engine::print(std::ostream &os) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto flags = os.flags();
+  const auto precision = os.precision();
+  for (std::size_t i = 0; i < models_.size(); ++i) {
+    const auto &m = models_[i];
+    const auto &p = m.params;
+    os << "[" << m.output.name() << "][" << m.input_key << " -> "
+       << m.output.write_key() << "][" << plant_params::mode_to_str(p.mode)
+       << " gain=" << p.gain;
+    if (p.mode == plant_params::mode_type::follow)
+      os << " offset=" << p.offset;
+    if (p.lag.count())
+      os << " lag=" << std::chrono::duration<double>(p.lag).count() << "s";
+    if (p.deadtime.count())
+      os << " deadtime=" << std::chrono::duration<double>(p.deadtime).count()
+         << "s";
+    if (std::isfinite(p.slew))
+      os << " slew=" << p.slew;
+    if (std::isfinite(p.min))
+      os << " min=" << p.min;
+    if (std::isfinite(p.max))
+      os << " max=" << p.max;
+    // Models added since the last step have no output yet.
+    if (!changed_ && i < shown_.size())
+      os << "][y: " << shown_[i] << "]\n";
+    else
+      os << "][y: -]\n";
+  }
+
+  const auto ticks = stats_.ticks();
+  const auto elapsed =
+      std::chrono::duration<double>(clock_type::now() - start_).count();
+  os << "[plant][" << models_.size() << " models at " << rate_ << "Hz]";
+  stats_.print(os, elapsed);
+  os << std::fixed << std::setprecision(1) << "[step avg/max: "
+     << (ticks ? double(busy_sum_.load()) / double(ticks) / 1e3 : 0.0) << "/"
+     << busy_max_.load() / 1e3 << "us][writes: " << writes_.load() << "]";
+  os.flags(flags);
+  os.precision(precision);
+}
+} // namespace ctf_io
@@ -0,0 +1,344 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <iomanip>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "channel.hpp"
+#include "console.hpp"
+#include "ring.hpp"
+#include "task.hpp"
+#include "trace.hpp"
+
+namespace ctf_io {
+// Samples items on a fixed grid into a binary trace. Sampler threads each
+// own a share of the items and hand samples to the writer thread through
+// their own ring, so reading the IO layer never waits on the disk and the
+// prompt never waits on either.
+class recorder final {
+public:
+  using clock_type = std::chrono::steady_clock;
+
+  recorder(const recorder &) = delete;
+  recorder &operator=(const recorder &) = delete;
+
+  static recorder &shared() {
+    static recorder recorder_;
+    return recorder_;
+  }
+
+  bool running() const noexcept {
+    return running_.load(std::memory_order_acquire);
+  }
+
+  void start(std::vector<channel> &&chs, double rate,
+             const std::filesystem::path &filepath);
+  void stop();
+  void print(std::ostream &os) const;
+
+private:
+  struct sample {
+    std::uint32_t column = 0;
+    std::int64_t t = 0;
+    trace_format::value_type value;
+  };
+
+  struct sampler {
+    explicit sampler(std::size_t capacity) : ring(capacity) {}
+
+    std::vector<std::pair<std::uint32_t, channel>> channels;
+    spsc_ring<sample> ring;
+    // Time of the last tick fully pushed to the ring.
+    std::atomic<std::int64_t> watermark = -1;
+    runtime::deadline_stats stats;
+    std::atomic<std::uint64_t> dropped = 0;
+    std::thread thread;
+  };
+
+  // Items per sampler thread before another one is started.
+  static constexpr std::size_t items_per_sampler = 1024;
+  static constexpr std::size_t max_samplers = 4;
+  static constexpr auto drain_interval = std::chrono::milliseconds(20);
+  static constexpr auto flush_interval = std::chrono::seconds(1);
+
+  recorder() = default;
+  ~recorder() { stop(); }
+
+  static trace_format::column_type column_type_of(const channel &ch) {
+    switch (ch.get_item().dt) {
+    case channel::item::data_type::int_val:
+      return trace_format::column_type::int_val;
+    case channel::item::data_type::double_val:
+      return trace_format::column_type::double_val;
+    default:
+      return trace_format::column_type::string_val;
+    }
+  }
+
+  bool wait_until(clock_type::time_point tp) {
+    std::unique_lock<std::mutex> lock(stop_mutex_);
+    return !stop_cv_.wait_until(lock, tp, [this] { return stop_; });
+  }
+
+  void join();
+  void run_sampler(sampler &s);
+  void run_writer();
+  std::size_t drain();
+
+  mutable std::mutex mutex_;
+  std::atomic_bool running_ = false;
+  std::filesystem::path filepath_;
+  double rate_ = 0;
+  std::size_t items_ = 0;
+  clock_type::time_point start_;
+  clock_type::time_point end_;
+  std::unique_ptr<trace_writer> writer_;
+  std::vector<std::unique_ptr<sampler>> samplers_;
+  std::thread writer_thread_;
+  std::atomic<std::uint64_t> samples_ = 0;
+  std::atomic<std::uint64_t> bytes_ = 0;
+  std::string error_;
+
+  mutable std::mutex stop_mutex_;
+  std::condition_variable stop_cv_;
+  bool stop_ = false;
+  bool writer_stop_ = false;
+};
+
+inline void recorder::start(std::vector<channel> &&chs, double rate,
+                            const std::filesystem::path &filepath) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running())
+    throw std::runtime_error("already recording to " + filepath_.string());
+  if (chs.empty())
+    throw std::invalid_argument("no item to record");
+  // A recording that failed on its own leaves its threads to join.
+  join();
+
+  const auto period = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      runtime::rate_period(rate));
+  const auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::system_clock::now().time_since_epoch());
+  auto writer =
+      std::make_unique<trace_writer>(filepath, wall.count(), period.count());
+
+  const auto hw = std::max<std::size_t>(std::thread::hardware_concurrency(), 1);
+  const auto count = std::clamp<std::size_t>(
+      (chs.size() + items_per_sampler - 1) / items_per_sampler, 1,
+      std::min(hw, max_samplers));
+  // Room for half a second of samples, far more than one drain interval.
+  const auto per_sampler = (chs.size() + count - 1) / count;
+  const auto capacity = std::min<std::size_t>(
+      per_sampler * std::max<std::size_t>(std::size_t(rate / 2), 16),
+      std::size_t(1) << 20);
+
+  samplers_.clear();
+  for (std::size_t i = 0; i < count; ++i)
+    samplers_.push_back(std::make_unique<sampler>(capacity));
+  for (std::size_t i = 0; i < chs.size(); ++i) {
+    const auto column = writer->add_column(chs[i].name(),
+                                           column_type_of(chs[i]));
+    samplers_[i % count]->channels.emplace_back(column, std::move(chs[i]));
+  }
+
+  writer_ = std::move(writer);
+  filepath_ = filepath;
+  rate_ = rate;
+  items_ = chs.size();
+  samples_ = 0;
+  bytes_ = 0;
+  error_.clear();
+  {
+    std::lock_guard<std::mutex> stop_lock(stop_mutex_);
+    stop_ = writer_stop_ = false;
+  }
+
+  start_ = clock_type::now();
+  // Set first, a writer that fails right away clears it.
+  running_ = true;
+  for (auto &s : samplers_)
+    s->thread = std::thread(&recorder::run_sampler, this, std::ref(*s));
+  writer_thread_ = std::thread(&recorder::run_writer, this);
+}
+
+inline void recorder::stop() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (!running()) {
+    join();
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> stop_lock(stop_mutex_);
+    stop_ = true;
+  }
+  stop_cv_.notify_all();
+  for (auto &s : samplers_)
+    s->thread.join();
+
+  // The writer drains what the samplers left and seals the trace.
+  {
+    std::lock_guard<std::mutex> stop_lock(stop_mutex_);
+    writer_stop_ = true;
+  }
+  stop_cv_.notify_all();
+  writer_thread_.join();
+  {
+    std::lock_guard<std::mutex> stop_lock(stop_mutex_);
+    end_ = clock_type::now();
+  }
+  running_ = false;
+}
+
+inline void recorder::join() {
+  for (auto &s : samplers_)
+    if (s->thread.joinable())
+      s->thread.join();
+  if (writer_thread_.joinable())
+    writer_thread_.join();
+}
+
+// Ticks fall on start + k * period and a sample is stamped with its tick, so
+// timestamps of a steady recording compress to a bit each.
+inline void recorder::run_sampler(sampler &s) {
+  // The rate was checked by start().
+  const auto period = runtime::rate_period(rate_);
+  for (std::int64_t k = 0;; ++k) {
+    auto deadline = start_ + period * k;
+    if (!wait_until(deadline))
+      return;
+
+    auto lateness = clock_type::now() - deadline;
+    if (lateness >= period) {
+      const auto skipped = lateness / period;
+      s.stats.miss(std::uint64_t(skipped));
+      k += skipped;
+      deadline += period * skipped;
+      lateness -= period * skipped;
+    }
+
+    const auto t =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - start_)
+            .count();
+    auto ok = true;
+    for (auto &[column, ch] : s.channels) {
+      auto v = ch.read();
+      if (v == nullptr) {
+        ok = false;
+        continue;
+      }
+      if (!s.ring.push(sample{column, t, v->get()}))
+        s.dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+    s.watermark.store(t, std::memory_order_release);
+    s.stats.record(lateness, ok);
+  }
+}
+
+inline std::size_t recorder::drain() {
+  auto n = std::size_t(0);
+  for (auto &s : samplers_)
+    n += s->ring.drain([this](sample &smp) {
+      writer_->append(smp.column, smp.t, std::move(smp.value));
+    });
+  return n;
+}
+
+inline void recorder::run_writer() {
+  auto next_flush = clock_type::now() + flush_interval;
+  try {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(stop_mutex_);
+        if (stop_cv_.wait_for(lock, drain_interval,
+                              [this] { return writer_stop_; }))
+          break;
+      }
+
+      // Read the watermarks first: whatever they cover is in the rings by
+      // now and is taken by the drain that follows.
+      auto watermark = std::numeric_limits<std::int64_t>::max();
+      for (const auto &s : samplers_)
+        watermark = std::min(watermark,
+                             s->watermark.load(std::memory_order_acquire));
+      drain();
+      if (clock_type::now() >= next_flush) {
+        writer_->flush(watermark);
+        samples_ = writer_->samples();
+        bytes_ = writer_->bytes();
+        next_flush += flush_interval;
+      }
+    }
+
+    drain();
+    writer_->close();
+    samples_ = writer_->samples();
+    bytes_ = writer_->bytes();
+  } catch (const std::exception &e) {
+    {
+      std::lock_guard<std::mutex> lock(stop_mutex_);
+      stop_ = true;
+      error_ = e.what();
+      end_ = clock_type::now();
+    }
+    stop_cv_.notify_all();
+    // The recording is over, the threads are joined by the next start() or
+    // stop().
+    termctl::err() << "[FAIL][record][" << filepath_.string() << "] "
+                   << e.what() << std::endl;
+    running_ = false;
+  }
+}
+
+inline void recorder::print(std::ostream &os) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (samplers_.empty()) {
+    os << "[record] not started";
+    return;
+  }
+
+  const auto flags = os.flags();
+  const auto precision = os.precision();
+  const auto samples = samples_.load();
+  const auto bytes = bytes_.load();
+  auto dropped = std::uint64_t(0);
+  for (const auto &s : samplers_)
+    dropped += s->dropped.load();
+
+  os << std::fixed << std::setprecision(1) << "[record][" << filepath_.string()
+     << "][" << items_ << " items at " << rate_ << "Hz on " << samplers_.size()
+     << " threads][written: " << samples << " samples, " << bytes
+     << " bytes, " << (samples ? double(bytes) * 8 / double(samples) : 0.0)
+     << " bits/sample][dropped: " << dropped << "]";
+  os.flags(flags);
+  os.precision(precision);
+  auto end = clock_type::now();
+  {
+    std::lock_guard<std::mutex> stop_lock(stop_mutex_);
+    if (!error_.empty())
+      os << "[error: " << error_ << "]";
+    if (!running())
+      end = end_;
+  }
+
+  const auto elapsed = std::chrono::duration<double>(end - start_).count();
+  for (const auto &s : samplers_) {
+    os << "\n  ";
+    s->stats.print(os, elapsed);
+  }
+}
+} // namespace ctf_io
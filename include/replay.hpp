@@ -0,0 +1,259 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <iomanip>
+#include <map>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "args.hpp"
+#include "channel.hpp"
+#include "conf_parser.hpp"
+#include "console.hpp"
+#include "jobs.hpp"
+#include "mapped_file.hpp"
+#include "trace.hpp"
+
+namespace ctf_io {
+// A text trace has one sample per line, "<seconds> <item> <value>", in
+// timestamp order; '#' starts a comment line. Samples are views into the
+// mapped file and stay valid until release() passes them.
+class text_trace final {
+public:
+  explicit text_trace(const std::filesystem::path &filepath)
+      : file_(filepath) {}
+
+  bool next(trace_sample &s) {
+    const auto data = file_.view();
+    while (pos_ < data.size()) {
+      auto end = data.find('\n', pos_);
+      if (end == std::string_view::npos)
+        end = data.size();
+      auto line = trim(data.substr(pos_, end - pos_));
+      pos_ = end + 1;
+      ++line_;
+      if (line.empty() || line.front() == '#')
+        continue;
+
+      auto t = 0.0;
+      const auto [ptr, ec] =
+          std::from_chars(line.data(), line.data() + line.size(), t);
+      if (ec != std::errc() || !std::isfinite(t))
+        throw error("invalid timestamp");
+      line.remove_prefix(ptr - line.data());
+
+      const auto sep = line.find_first_not_of(" \t");
+      const auto item_end = line.find_first_of(" \t", sep);
+      if (sep == 0 || sep == std::string_view::npos ||
+          item_end == std::string_view::npos)
+        throw error("expected \"<seconds> <item> <value>\"");
+
+      s.t_ns = std::llround(t * 1e9);
+      s.item = line.substr(sep, item_end - sep);
+      s.value = trim(line.substr(item_end));
+      return true;
+    }
+    return false;
+  }
+
+  // Text traces have no index, samples before 't' are skipped one by one.
+  void seek(std::int64_t) noexcept {}
+
+  std::size_t line() const noexcept { return line_; }
+  std::size_t offset() const noexcept { return pos_; }
+  void release(std::size_t offset) noexcept { file_.release(offset); }
+
+  std::invalid_argument error(const std::string &what) const {
+    return std::invalid_argument("line " + std::to_string(line_) + ": " +
+                                 what);
+  }
+
+private:
+  static std::string_view trim(std::string_view s) noexcept {
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+      s.remove_prefix(1);
+    while (!s.empty() &&
+           (s.back() == ' ' || s.back() == '\t' || s.back() == '\r'))
+      s.remove_suffix(1);
+    return s;
+  }
+
+  mapped_file file_;
+  std::size_t pos_ = 0;
+  std::size_t line_ = 0;
+};
+
+struct replay_options {
+  // Zero replays as fast as possible.
+  double speed = 1.0;
+  // The window, relative to the first sample of the trace.
+  std::chrono::nanoseconds from{0};
+  std::optional<std::chrono::nanoseconds> to;
+  // Glob patterns of items to replay, empty for all.
+  std::vector<std::string> items;
+};
+
+// Feeds a trace back through the write path on the calling job's thread,
+// keeping the original spacing of samples scaled by the speed factor. All
+// samples sharing a timestamp are resolved up front and written back to
+// back once their deadline comes. 'Trace' is a text_trace or binary_trace.
+template <typename Trace> class replayer final {
+public:
+  replayer(const std::filesystem::path &filepath,
+           const conf::io_parser &parser, const replay_options &opts)
+      : name_(filepath.string()), trace_(filepath), parser_(parser),
+        opts_(opts) {}
+
+  void run();
+  void report(std::ostream &os) const;
+
+private:
+  struct pending {
+    channel *ch;
+    std::string_view text;
+    std::optional<double> number;
+  };
+  using batch_type = std::vector<pending>;
+
+  // Keeps the page cache footprint of a replay bounded.
+  static constexpr std::size_t release_step = 16 << 20;
+
+  channel *resolve(std::string_view name) {
+    auto it = channels_.find(name);
+    if (it == channels_.end()) {
+      auto ch = std::optional<channel>();
+      const auto key = std::string(name);
+      if (selected(key)) {
+        if (auto item = parser_.find_item(key); !item)
+          termctl::err() << "Warning: unknown item \"" << key
+                         << "\" in the trace, skipped" << std::endl;
+        else if (!channel::write_key(*item).empty())
+          ch.emplace(*item);
+      }
+      it = channels_.emplace(key, std::move(ch)).first;
+    }
+    return it->second ? &*it->second : nullptr;
+  }
+
+  bool selected(const std::string &name) const {
+    if (opts_.items.empty())
+      return true;
+    return std::any_of(opts_.items.begin(), opts_.items.end(),
+                       [&](const auto &p) {
+                         return termctl::glob_match(p, name);
+                       });
+  }
+
+  void write(const batch_type &batch) {
+    for (const auto &[ch, text, number] : batch)
+      if (!(number ? ch->write(*number) : ch->write(std::string(text))))
+        ++failed_;
+    written_ += batch.size();
+    ++batches_;
+  }
+
+  std::string name_;
+  Trace trace_;
+  const conf::io_parser &parser_;
+  replay_options opts_;
+  std::map<std::string, std::optional<channel>, std::less<>> channels_;
+
+  std::uint64_t batches_ = 0;
+  std::uint64_t written_ = 0;
+  std::uint64_t skipped_ = 0;
+  std::uint64_t failed_ = 0;
+  std::int64_t late_sum_ = 0;
+  std::int64_t late_max_ = 0;
+  bool stopped_ = false;
+  std::chrono::steady_clock::duration elapsed_{};
+};
+
+template <typename Trace> void replayer<Trace>::run() {
+  auto s = trace_sample();
+  auto more = trace_.next(s);
+  if (!more)
+    return;
+
+  const auto first = s.t_ns;
+  const auto from = first + opts_.from.count();
+  if (from > first) {
+    trace_.seek(from);
+    more = trace_.next(s);
+  }
+  while (more && s.t_ns < from)
+    more = trace_.next(s);
+
+  const auto origin = s.t_ns;
+  const auto start = std::chrono::steady_clock::now();
+  auto batch = batch_type();
+  auto released = std::size_t(0);
+  while (more) {
+    const auto t = s.t_ns;
+    if (opts_.to && t - first > opts_.to->count())
+      break;
+
+    const auto offset = trace_.offset();
+    batch.clear();
+    for (; more && s.t_ns == t; more = trace_.next(s))
+      if (auto ch = resolve(s.item); ch)
+        batch.push_back({ch, s.value, s.number});
+      else
+        ++skipped_;
+    if (more && s.t_ns < t)
+      throw trace_.error("timestamp goes backwards");
+
+    if (opts_.speed > 0) {
+      const auto deadline =
+          start + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                      std::chrono::duration<double, std::nano>(
+                          double(t - origin) / opts_.speed));
+      if (!termctl::this_job::sleep_until(deadline)) {
+        stopped_ = true;
+        break;
+      }
+      const auto late = (std::chrono::steady_clock::now() - deadline).count();
+      late_sum_ += late;
+      late_max_ = std::max<std::int64_t>(late_max_, late);
+    } else if (termctl::this_job::stop_requested()) {
+      stopped_ = true;
+      break;
+    }
+
+    write(batch);
+    if (offset > released + release_step) {
+      released = offset - release_step;
+      trace_.release(released);
+    }
+  }
+  elapsed_ = std::chrono::steady_clock::now() - start;
+}
+
+template <typename Trace>
+void replayer<Trace>::report(std::ostream &os) const {
+  const auto flags = os.flags();
+  const auto precision = os.precision();
+  os << std::fixed << std::setprecision(3) << "["
+     << (stopped_ ? "STOP" : failed_ ? "FAIL" : "OK") << "][replay][" << name_
+     << "] " << written_ << " values in " << batches_ << " batches, "
+     << std::chrono::duration<double>(elapsed_).count() << "s";
+  if (opts_.speed > 0)
+    os << std::setprecision(1) << "[late avg/max: "
+       << (batches_ ? double(late_sum_) / double(batches_) / 1e3 : 0.0) << "/"
+       << late_max_ / 1e3 << "us]";
+  os << "[skipped: " << skipped_ << "][fail: " << failed_ << "]";
+  os.flags(flags);
+  os.precision(precision);
+}
+} // namespace ctf_io
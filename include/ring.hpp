@@ -0,0 +1,71 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+namespace ctf_io {
+// A bounded single-producer single-consumer queue. Neither side locks, and
+// the ring allocates nothing once constructed; assigning a 'T' to a slot
+// still may, as for a sample holding a string. A full ring rejects the push
+// instead of blocking the producer.
+template <typename T> class spsc_ring final {
+public:
+  spsc_ring() = delete;
+  spsc_ring(const spsc_ring &) = delete;
+  spsc_ring &operator=(const spsc_ring &) = delete;
+
+  // The capacity is rounded up to a power of two.
+  explicit spsc_ring(std::size_t capacity) {
+    auto n = std::size_t(1);
+    while (n < capacity)
+      n <<= 1;
+    slots_.resize(n);
+    mask_ = n - 1;
+  }
+
+  std::size_t capacity() const noexcept { return slots_.size(); }
+
+  std::size_t size() const noexcept {
+    return tail_.load(std::memory_order_acquire) -
+           head_.load(std::memory_order_acquire);
+  }
+
+  template <typename U> bool push(U &&val) {
+    const auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == slots_.size())
+      return false;
+    slots_[tail & mask_] = std::forward<U>(val);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T &val) {
+    const auto head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+      return false;
+    val = std::move(slots_[head & mask_]);
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Pops everything available into 'fn', returns how many were taken.
+  template <typename Fn> std::size_t drain(Fn &&fn) {
+    const auto head = head_.load(std::memory_order_relaxed);
+    const auto tail = tail_.load(std::memory_order_acquire);
+    for (auto i = head; i != tail; ++i)
+      fn(slots_[i & mask_]);
+    head_.store(tail, std::memory_order_release);
+    return tail - head;
+  }
+
+private:
+  static constexpr std::size_t line_size = 64;
+
+  std::vector<T> slots_;
+  std::size_t mask_ = 0;
+  alignas(line_size) std::atomic<std::size_t> head_ = 0;
+  alignas(line_size) std::atomic<std::size_t> tail_ = 0;
+};
+} // namespace ctf_io
@@ -0,0 +1,497 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "args.hpp"
+#include "channel.hpp"
+#include "condition.hpp"
+#include "conf_parser.hpp"
+#include "task.hpp"
+
+namespace ctf_io {
+// A scenario is a plain text file of steps, one per line:
+//
+//   # comment
+//   set <item> <value>
+//   wait <duration>                      e.g. wait 50ms
+//   wait <item> <op> <value> [tol=..] [timeout=..] [poll=..]
+//   at <offset> <step>                   run <step> at <offset> from the
+//                                        start of the enclosing block
+//   loop <count> ... end
+//   parallel
+//     branch ... end
+//     branch ... end
+//   end
+//   barrier <name>                       sync the branches of a parallel
+//
+// Waits are deadline based: 'wait 50ms' sleeps until 50ms after the previous
+// deadline rather than after whatever the last step took, so a sequence of
+// sets and waits stays on its grid.
+class scenario final {
+public:
+  using ptr = std::unique_ptr<scenario>;
+  using duration_type = std::chrono::nanoseconds;
+
+  struct step_stats {
+    std::uint64_t runs = 0;
+    std::int64_t late_sum = 0;
+    std::int64_t late_max = 0;
+    std::int64_t time_sum = 0;
+    std::int64_t time_max = 0;
+
+    void record(std::int64_t &sum, std::int64_t &max,
+                duration_type d) noexcept {
+      sum += d.count();
+      max = std::max<std::int64_t>(max, d.count());
+    }
+  };
+
+  struct step {
+    enum class kind_type { set, delay, until, loop, parallel, barrier };
+
+    kind_type kind;
+    std::size_t id;
+    std::size_t line;
+    std::string text;
+    std::optional<duration_type> at;
+
+    // set
+    std::optional<channel> ch;
+    std::string value;
+    // wait
+    duration_type delay{};
+    condition cond;
+    std::optional<duration_type> timeout;
+    duration_type poll = std::chrono::milliseconds(10);
+    // loop
+    std::size_t count = 0;
+    std::vector<step> body;
+    // parallel
+    std::vector<std::vector<step>> branches;
+    // barrier
+    std::string name;
+  };
+
+  static ptr load(const std::filesystem::path &filepath,
+                  const conf::io_parser &parser) {
+    auto ifs = std::ifstream(filepath);
+    if (!ifs.is_open())
+      throw std::runtime_error("cannot open file: " + filepath.string());
+    return std::make_unique<scenario>(filepath.string(), ifs, parser);
+  }
+
+  scenario(const std::string &name, std::istream &is,
+           const conf::io_parser &parser)
+      : name_(name) {
+    auto lines = std::vector<std::pair<std::size_t, std::string>>();
+    auto line = std::string();
+    for (std::size_t n = 1; std::getline(is, line); ++n) {
+      if (auto pos = line.find('#'); pos != std::string::npos)
+        line.erase(pos);
+      if (line.find_first_not_of(" \t\r") != std::string::npos)
+        lines.emplace_back(n, line);
+    }
+
+    auto errors = std::vector<std::string>();
+    auto pos = std::size_t(0);
+    steps_ = parse_block(lines, pos, parser, errors, false);
+    for (const auto &s : steps_)
+      validate_barriers(s, nullptr, errors);
+
+    if (!errors.empty()) {
+      auto msg = std::string("invalid scenario " + name_ + ":");
+      for (const auto &e : errors)
+        msg += "\n  " + e;
+      throw std::invalid_argument(msg);
+    }
+    stats_.resize(count_);
+  }
+
+  const std::string &name() const noexcept { return name_; }
+
+  runtime::task<void> run() {
+    const auto start = runtime::clock_type::now();
+    auto ctx = context{start, start, nullptr};
+    started_ = start;
+    co_await run_block(steps_, ctx);
+    finished_ = runtime::clock_type::now();
+  }
+
+  void report(std::ostream &os) const;
+
+private:
+  struct context {
+    runtime::time_point origin;
+    runtime::time_point cursor;
+    std::map<std::string, runtime::barrier> *barriers;
+  };
+
+  using lines_type = std::vector<std::pair<std::size_t, std::string>>;
+
+  std::vector<step> parse_block(const lines_type &lines, std::size_t &pos,
+                                const conf::io_parser &parser,
+                                std::vector<std::string> &errors,
+                                bool nested);
+  step parse_step(std::size_t line, std::vector<std::string> tokens,
+                  const lines_type &lines, std::size_t &pos,
+                  const conf::io_parser &parser,
+                  std::vector<std::string> &errors);
+  void validate_barriers(const step &s, const step *parallel,
+                         std::vector<std::string> &errors) const;
+
+  runtime::task<void> run_block(std::vector<step> &steps, context &ctx);
+  runtime::task<void> run_step(step &s, context &ctx);
+  runtime::task<void> run_branch(std::vector<step> &steps, context ctx,
+                                 runtime::time_point *end);
+
+  static std::vector<std::string> split(const std::string &line) {
+    auto iss = std::istringstream(line);
+    auto tokens = std::vector<std::string>();
+    for (std::string t; iss >> t;)
+      tokens.push_back(std::move(t));
+    return tokens;
+  }
+
+  // How often 'steps' pass each barrier, loops counted out.
+  static void collect_barriers(const std::vector<step> &steps,
+                               std::map<std::string, std::size_t> &passes,
+                               std::size_t times = 1) {
+    for (const auto &s : steps)
+      if (s.kind == step::kind_type::barrier)
+        passes[s.name] += times;
+      else if (s.kind == step::kind_type::loop)
+        collect_barriers(s.body, passes, times * s.count);
+  }
+
+  std::string name_;
+  std::vector<step> steps_;
+  std::size_t count_ = 0;
+  std::vector<step_stats> stats_;
+  runtime::time_point started_;
+  runtime::time_point finished_ = runtime::time_point::min();
+};
+
+inline std::vector<scenario::step>
+scenario::parse_block(const lines_type &lines, std::size_t &pos,
+                      const conf::io_parser &parser,
+                      std::vector<std::string> &errors, bool nested) {
+  auto steps = std::vector<step>();
+  while (pos < lines.size()) {
+    const auto &[line, text] = lines[pos++];
+    auto tokens = split(text);
+    if (tokens[0] == "end") {
+      if (nested)
+        return steps;
+      errors.push_back("line " + std::to_string(line) + ": unexpected 'end'");
+      continue;
+    }
+
+    try {
+      steps.push_back(parse_step(line, std::move(tokens), lines, pos, parser,
+                                 errors));
+    } catch (const std::exception &e) {
+      errors.push_back("line " + std::to_string(line) + ": " + e.what());
+    }
+  }
+
+  if (nested)
+    errors.push_back("missing 'end' at the end of file");
+  return steps;
+}
+
+inline scenario::step
+scenario::parse_step(std::size_t line, std::vector<std::string> tokens,
+                     const lines_type &lines, std::size_t &pos,
+                     const conf::io_parser &parser,
+                     std::vector<std::string> &errors) {
+  auto s = step();
+  s.line = line;
+  s.text = lines[pos - 1].second;
+  s.text.erase(0, s.text.find_first_not_of(" \t"));
+  s.id = count_++;
+
+  if (tokens[0] == "at") {
+    if (tokens.size() < 3)
+      throw std::invalid_argument("usage: at <offset> <step>");
+    s.at = termctl::parse_duration(tokens[1]);
+    tokens.erase(tokens.begin(), tokens.begin() + 2);
+    if (tokens[0] == "loop" || tokens[0] == "parallel")
+      throw std::invalid_argument("'at' cannot start a block");
+  }
+
+  const auto &keyword = tokens[0];
+  const auto args = std::vector<std::string>(tokens.begin() + 1, tokens.end());
+  if (keyword == "set") {
+    if (args.size() != 2)
+      throw std::invalid_argument("usage: set <item> <value>");
+    auto item = parser.find_item(args[0]);
+    if (!item)
+      throw std::invalid_argument("unknown item \"" + args[0] + "\"");
+    s.kind = step::kind_type::set;
+    s.ch.emplace(*item);
+    if (!s.ch->writable())
+      throw std::invalid_argument("the item \"" + args[0] +
+                                  "\" has neither 'pw' nor 'pr'");
+    // Converting once here rejects bad values before anything runs.
+    try {
+      variant(item->dt, {}, args[1]);
+    } catch (const std::logic_error &) {
+      throw std::invalid_argument("invalid value \"" + args[1] + "\" for " +
+                                  args[0]);
+    }
+    s.value = args[1];
+  } else if (keyword == "wait") {
+    const auto opts = termctl::options(args);
+    const auto &pos_args = opts.positional();
+    if (pos_args.size() == 1 && !opts.has("tol") &&
+        pos_args[0].find_first_of("<>=!") == std::string::npos) {
+      s.kind = step::kind_type::delay;
+      s.delay = termctl::parse_duration(pos_args[0]);
+      opts.expect_only({});
+    } else {
+      opts.expect_only({"tol", "timeout", "poll"});
+      s.kind = step::kind_type::until;
+      s.cond = condition::parse(pos_args);
+      s.cond.set_tol(opts.get_double("tol", 0.0));
+      if (opts.has("timeout"))
+        s.timeout = opts.get_duration("timeout", {});
+      s.poll = opts.get_duration<std::chrono::milliseconds>("poll", s.poll);
+      auto item = parser.find_item(s.cond.item);
+      if (!item)
+        throw std::invalid_argument("unknown item \"" + s.cond.item + "\"");
+      s.ch.emplace(*item);
+      if (!s.ch->readable() || !s.ch->numeric())
+        throw std::invalid_argument("the item \"" + s.cond.item +
+                                    "\" is not a readable number");
+    }
+  } else if (keyword == "loop") {
+    // The body goes first, so a bad count still consumes its 'end'.
+    s.kind = step::kind_type::loop;
+    s.body = parse_block(lines, pos, parser, errors, true);
+    if (args.size() != 1)
+      throw std::invalid_argument("usage: loop <count>");
+    s.count = termctl::parse_count(args[0]);
+  } else if (keyword == "parallel") {
+    if (!args.empty())
+      throw std::invalid_argument("usage: parallel");
+    s.kind = step::kind_type::parallel;
+    while (pos < lines.size()) {
+      const auto &[bline, btext] = lines[pos++];
+      const auto btokens = split(btext);
+      if (btokens[0] == "end")
+        break;
+      if (btokens[0] != "branch" || btokens.size() != 1) {
+        errors.push_back("line " + std::to_string(bline) +
+                         ": expected 'branch' or 'end' in 'parallel'");
+        continue;
+      }
+      s.branches.push_back(parse_block(lines, pos, parser, errors, true));
+    }
+    if (s.branches.empty())
+      throw std::invalid_argument("'parallel' has no branch");
+  } else if (keyword == "barrier") {
+    if (args.size() != 1)
+      throw std::invalid_argument("usage: barrier <name>");
+    s.kind = step::kind_type::barrier;
+    s.name = args[0];
+  } else {
+    throw std::invalid_argument("unknown step \"" + keyword + "\"");
+  }
+
+  return s;
+}
+
+// A barrier syncs the branches of its nearest enclosing 'parallel', so every
+// one of them has to pass it as often as the others or they would wait
+// forever.
+inline void
+scenario::validate_barriers(const step &s, const step *parallel,
+                            std::vector<std::string> &errors) const {
+  if (s.kind == step::kind_type::barrier) {
+    if (parallel == nullptr) {
+      errors.push_back("line " + std::to_string(s.line) +
+                       ": 'barrier' outside of 'parallel'");
+      return;
+    }
+
+    auto first = std::optional<std::size_t>();
+    for (const auto &branch : parallel->branches) {
+      auto passes = std::map<std::string, std::size_t>();
+      collect_barriers(branch, passes);
+      const auto it = passes.find(s.name);
+      const auto n = it != passes.end() ? it->second : 0;
+      if (first && n != *first) {
+        errors.push_back("line " + std::to_string(s.line) + ": barrier \"" +
+                         s.name +
+                         "\" is not passed as often by every branch");
+        return;
+      }
+      first = n;
+    }
+  } else if (s.kind == step::kind_type::loop) {
+    for (const auto &sub : s.body)
+      validate_barriers(sub, parallel, errors);
+  } else if (s.kind == step::kind_type::parallel) {
+    for (const auto &branch : s.branches)
+      for (const auto &sub : branch)
+        validate_barriers(sub, &s, errors);
+  }
+}
+
+inline runtime::task<void> scenario::run_block(std::vector<step> &steps,
+                                               context &ctx) {
+  for (auto &s : steps)
+    co_await run_step(s, ctx);
+}
+
+inline runtime::task<void> scenario::run_branch(std::vector<step> &steps,
+                                                context ctx,
+                                                runtime::time_point *end) {
+  co_await run_block(steps, ctx);
+  *end = ctx.cursor;
+}
+
+inline runtime::task<void> scenario::run_step(step &s, context &ctx) {
+  auto &stats = stats_[s.id];
+  ++stats.runs;
+  if (s.at) {
+    const auto deadline = ctx.origin + *s.at;
+    co_await runtime::sleep_until(deadline);
+    stats.record(stats.late_sum, stats.late_max,
+                 runtime::clock_type::now() - deadline);
+    ctx.cursor = deadline;
+  }
+
+  const auto begin = runtime::clock_type::now();
+  const auto where = "line " + std::to_string(s.line) + ": ";
+  switch (s.kind) {
+  case step::kind_type::set: {
+    const auto ok = co_await runtime::offload(
+        [ch = &*s.ch, val = &s.value] { return ch->write(*val); });
+    if (!ok)
+      throw std::runtime_error(where + "failed to write \"" + s.value +
+                               "\" to " + s.ch->name());
+    break;
+  }
+  case step::kind_type::delay: {
+    const auto deadline = ctx.cursor + s.delay;
+    co_await runtime::sleep_until(deadline);
+    stats.record(stats.late_sum, stats.late_max,
+                 runtime::clock_type::now() - deadline);
+    ctx.cursor = deadline;
+    break;
+  }
+  case step::kind_type::until: {
+    const auto deadline =
+        s.timeout ? std::optional(begin + *s.timeout) : std::nullopt;
+    auto next = begin;
+    for (;;) {
+      const auto val = co_await runtime::offload(
+          [ch = &*s.ch] { return ch->read_double(); });
+      if (val && s.cond.eval(*val))
+        break;
+      const auto now = runtime::clock_type::now();
+      if (deadline && now >= *deadline)
+        throw std::runtime_error(where + "timed out waiting for '" +
+                                 s.text + "'");
+      next = std::max(next + s.poll, now);
+      co_await runtime::sleep_until(deadline ? std::min(next, *deadline)
+                                             : next);
+    }
+    ctx.cursor = runtime::clock_type::now();
+    break;
+  }
+  case step::kind_type::loop:
+    for (std::size_t i = 0; i < s.count; ++i) {
+      // Each pass has its own origin; the enclosing block keeps its own.
+      auto pass = context{ctx.cursor, ctx.cursor, ctx.barriers};
+      co_await run_block(s.body, pass);
+      ctx.cursor = pass.cursor;
+    }
+    break;
+  case step::kind_type::parallel: {
+    auto barriers = std::map<std::string, runtime::barrier>();
+    auto passes = std::map<std::string, std::size_t>();
+    for (const auto &branch : s.branches)
+      collect_barriers(branch, passes);
+    for (const auto &[n, times] : passes)
+      barriers.try_emplace(n, s.branches.size());
+
+    auto ends = std::vector<runtime::time_point>(s.branches.size());
+    auto tasks = std::vector<runtime::task<void>>();
+    for (std::size_t i = 0; i < s.branches.size(); ++i)
+      tasks.push_back(run_branch(
+          s.branches[i], context{ctx.cursor, ctx.cursor, &barriers},
+          &ends[i]));
+    co_await runtime::when_all(std::move(tasks));
+    ctx.cursor = *std::max_element(ends.begin(), ends.end());
+    break;
+  }
+  case step::kind_type::barrier:
+    co_await ctx.barriers->at(s.name).arrive_and_wait();
+    ctx.cursor = std::max(ctx.cursor, runtime::clock_type::now());
+    break;
+  }
+
+  if (s.kind != step::kind_type::loop && s.kind != step::kind_type::parallel)
+    stats.record(stats.time_sum, stats.time_max,
+                 runtime::clock_type::now() - begin);
+}
+
+inline void scenario::report(std::ostream &os) const {
+  const auto flags = os.flags();
+  const auto precision = os.precision();
+  // A cancelled or failed run never sets 'finished_'.
+  const auto stopped = finished_ < started_;
+  const auto end = stopped ? runtime::clock_type::now() : finished_;
+  const auto total = std::chrono::duration<double>(end - started_).count();
+  os << std::fixed << std::setprecision(3) << "[RUN][" << name_ << "] "
+     << (stopped ? "stopped after " : "finished in ") << total << "s\n";
+  os << "  line   runs  late avg/max (us)  time avg/max (us)  step\n";
+
+  auto print = [&](const auto &self, const std::vector<step> &steps) -> void {
+    for (const auto &s : steps) {
+      const auto &st = stats_[s.id];
+      auto late = std::string("-");
+      auto time = std::string("-");
+      if (st.runs && (s.at || s.kind == step::kind_type::delay)) {
+        std::ostringstream ss;
+        ss << std::fixed << std::setprecision(1)
+           << st.late_sum / 1e3 / st.runs << "/" << st.late_max / 1e3;
+        late = ss.str();
+      }
+      if (st.runs && s.kind != step::kind_type::loop &&
+          s.kind != step::kind_type::parallel) {
+        std::ostringstream ss;
+        ss << std::fixed << std::setprecision(1)
+           << st.time_sum / 1e3 / st.runs << "/" << st.time_max / 1e3;
+        time = ss.str();
+      }
+      os << std::setw(6) << s.line << std::setw(7) << st.runs
+         << std::setw(19) << late << std::setw(19) << time << "  " << s.text
+         << "\n";
+      self(self, s.body);
+      for (const auto &branch : s.branches)
+        self(self, branch);
+    }
+  };
+  print(print, steps_);
+
+  os.flags(flags);
+  os.precision(precision);
+}
+} // namespace ctf_io
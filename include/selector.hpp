@@ -0,0 +1,358 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <cstddef>
+#include <cstdint>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "args.hpp"
+#include "conf_parser.hpp"
+
+namespace ctf_io {
+// Selects items by an expression, e.g. "Chamber.*&dt:Double" or
+// "drv:3 & !cat:Memory | /Temp[0-9]+$/". Terms are item names, '*'/'?'
+// globs, /regex/ (searched in the name), drv:<id|name|Nil>,
+// dt:Integer|Double|String|Nil and cat:IO|Memory; '!' (not), '&' (and),
+// '|' (or) and parentheses combine them, adjacent terms are and-ed. Text
+// that is an item's whole name selects that item alone.
+// Compiled once against the parser's load-time index: attributes are
+// precomputed sets, a glob only tests the names sharing its literal prefix,
+// and the right side of an '&' only tests what the left side selected.
+class item_selector final {
+public:
+  using item = conf::io_parser::item;
+
+  item_selector(std::string_view text, const conf::io_parser &parser);
+
+  // A single name, naming one item and nothing more.
+  bool is_name() const noexcept { return terms_[root_].op == kind::name; }
+
+  conf::item_set select() const { return eval(root_, nullptr); }
+
+  // The selected items, in name order.
+  std::vector<item> items() const {
+    auto v = std::vector<item>();
+    const auto &sorted = index_->items;
+    select().for_each([&](std::size_t k) { v.push_back(*sorted[k]); });
+    return v;
+  }
+
+private:
+  enum class kind { name, glob, regex, set, not_, and_, or_ };
+
+  struct term {
+    kind op;
+    std::string text;
+    std::regex re;
+    // No set for an attribute no item has, e.g. an unused driver.
+    const conf::item_set *set = nullptr;
+    std::size_t lhs = 0;
+    std::size_t rhs = 0;
+    // Rough work to evaluate: sets and names, globs, then regexes.
+    int cost = 0;
+  };
+
+  // Recursive descent over the text, one term per node.
+  std::size_t parse_or();
+  std::size_t parse_and();
+  std::size_t parse_unary();
+  std::size_t parse_atom();
+  std::size_t add(term &&t) {
+    terms_.push_back(std::move(t));
+    return terms_.size() - 1;
+  }
+
+  void skip_blanks() {
+    while (pos_ < text_.size() &&
+           std::isspace(static_cast<unsigned char>(text_[pos_])))
+      ++pos_;
+  }
+  bool at_term_end() const {
+    return pos_ == text_.size() ||
+           std::string_view("()!&| \t").find(text_[pos_]) !=
+               std::string_view::npos;
+  }
+  // A word operator, "and", "or" or "not", standing alone.
+  bool at_word(std::string_view word) const;
+  bool take_word(std::string_view word) {
+    skip_blanks();
+    if (!at_word(word))
+      return false;
+    pos_ += word.size();
+    return true;
+  }
+  [[noreturn]] void fail(const std::string &what) const {
+    throw std::invalid_argument(what + " in selector \"" + text_ + "\"");
+  }
+
+  // The set for "key:value"; false if 'key' is no attribute, in which case
+  // the whole word is an item name.
+  bool attribute(std::string_view key, std::string_view value,
+                 const conf::item_set *&set) const;
+  conf::item_set eval(std::size_t t, const conf::item_set *within) const;
+
+  std::string text_;
+  std::size_t pos_ = 0;
+  const conf::io_parser *parser_;
+  const conf::io_parser::index_type *index_;
+  std::vector<term> terms_;
+  std::size_t root_ = 0;
+};
+
+inline item_selector::item_selector(std::string_view text,
+                                    const conf::io_parser &parser)
+    : text_(text), parser_(&parser), index_(&parser.index()) {
+  // An item's whole name wins, whatever operators or globs it holds.
+  if (parser.find_item(text_)) {
+    root_ = add({kind::name, text_, {}, nullptr, 0, 0, 0});
+    return;
+  }
+  root_ = parse_or();
+  skip_blanks();
+  if (pos_ != text_.size())
+    fail("unexpected '" + std::string(1, text_[pos_]) + "'");
+}
+
+inline bool item_selector::at_word(std::string_view word) const {
+  const auto end = pos_ + word.size();
+  return text_.compare(pos_, word.size(), word) == 0 &&
+         (end == text_.size() ||
+          std::string_view(" \t(!").find(text_[end]) != std::string::npos);
+}
+
+inline std::size_t item_selector::parse_or() {
+  auto lhs = parse_and();
+  for (;;) {
+    skip_blanks();
+    if (pos_ < text_.size() && text_[pos_] == '|')
+      ++pos_;
+    else if (!take_word("or"))
+      return lhs;
+    const auto rhs = parse_and();
+    const auto cost = std::max(terms_[lhs].cost, terms_[rhs].cost);
+    lhs = add({kind::or_, {}, {}, nullptr, lhs, rhs, cost});
+  }
+}
+
+inline std::size_t item_selector::parse_and() {
+  auto lhs = parse_unary();
+  for (;;) {
+    skip_blanks();
+    if (pos_ < text_.size() && text_[pos_] == '&')
+      ++pos_;
+    else if (!take_word("and") &&
+             (pos_ == text_.size() || text_[pos_] == '|' ||
+              text_[pos_] == ')' || at_word("or")))
+      return lhs;
+    auto rhs = parse_unary();
+    // The cheaper side goes first, the other only tests what it selected.
+    if (terms_[rhs].cost < terms_[lhs].cost)
+      std::swap(lhs, rhs);
+    const auto cost = std::max(terms_[lhs].cost, terms_[rhs].cost);
+    lhs = add({kind::and_, {}, {}, nullptr, lhs, rhs, cost});
+  }
+}
+
+inline std::size_t item_selector::parse_unary() {
+  skip_blanks();
+  if (pos_ < text_.size() && text_[pos_] == '!') {
+    ++pos_;
+  } else if (!take_word("not")) {
+    return parse_atom();
+  }
+  const auto operand = parse_unary();
+  return add({kind::not_, {}, {}, nullptr, operand, 0,
+              terms_[operand].cost});
+}
+
+inline std::size_t item_selector::parse_atom() {
+  skip_blanks();
+  if (pos_ == text_.size())
+    fail("missing a term");
+
+  if (text_[pos_] == '(') {
+    ++pos_;
+    const auto t = parse_or();
+    skip_blanks();
+    if (pos_ == text_.size() || text_[pos_] != ')')
+      fail("missing ')'");
+    ++pos_;
+    return t;
+  }
+
+  if (text_[pos_] == '/') {
+    const auto end = text_.find('/', pos_ + 1);
+    if (end == std::string::npos)
+      fail("missing the closing '/'");
+    auto pattern = text_.substr(pos_ + 1, end - pos_ - 1);
+    pos_ = end + 1;
+    try {
+      auto re = std::regex(pattern, std::regex::ECMAScript |
+                                        std::regex::optimize);
+      return add({kind::regex, std::move(pattern), std::move(re), nullptr, 0,
+                  0, 3});
+    } catch (const std::regex_error &e) {
+      fail("invalid regex /" + pattern + "/: " + e.what());
+    }
+  }
+
+  const auto first = pos_;
+  while (!at_term_end())
+    ++pos_;
+  const auto word = std::string_view(text_).substr(first, pos_ - first);
+  if (word.empty())
+    fail("unexpected '" + std::string(1, text_[pos_]) + "'");
+
+  const conf::item_set *set = nullptr;
+  if (const auto colon = word.find(':');
+      colon != std::string_view::npos &&
+      attribute(word.substr(0, colon), word.substr(colon + 1), set))
+    return add({kind::set, std::string(word), {}, set, 0, 0, 0});
+
+  if (word.find_first_of("*?") != std::string_view::npos) {
+    // Only the names sharing the literal prefix are tested.
+    const auto literal = word.substr(0, word.find_first_of("*?"));
+    return add({kind::glob, std::string(word), {}, nullptr, 0, 0,
+                literal.empty() ? 2 : 1});
+  }
+
+  if (!parser_->find_item(std::string(word)))
+    throw std::invalid_argument("invalid item of module \"" +
+                                std::string(word) + "\"");
+  return add({kind::name, std::string(word), {}, nullptr, 0, 0, 0});
+}
+
+inline bool item_selector::attribute(std::string_view key,
+                                     std::string_view value,
+                                     const conf::item_set *&set) const {
+  const auto equals = [](std::string_view a, std::string_view b) {
+    return a.size() == b.size() &&
+           std::equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+             return std::tolower(static_cast<unsigned char>(x)) ==
+                    std::tolower(static_cast<unsigned char>(y));
+           });
+  };
+  if (key == "drv") {
+    auto id = std::int32_t(-1);
+    if (!equals(value, "Nil")) {
+      auto found = false;
+      for (const auto &entry : parser_->drivers())
+        if (const auto &d = entry.second;
+            d.name == value || std::to_string(d.id) == value) {
+          id = d.id;
+          found = true;
+        }
+      if (!found)
+        fail("invalid driver \"" + std::string(value) + "\"");
+    }
+    const auto it = index_->drivers.find(id);
+    set = it != index_->drivers.cend() ? &it->second : nullptr;
+    return true;
+  } else if (key == "dt") {
+    using data_type = item::data_type;
+    constexpr std::pair<std::string_view, data_type> types[] = {
+        {"Integer", data_type::int_val},
+        {"Double", data_type::double_val},
+        {"String", data_type::string_val},
+        {"Nil", data_type::unknown}};
+    for (const auto &[name, dt] : types)
+      if (equals(value, name)) {
+        set = &index_->types[std::size_t(dt)];
+        return true;
+      }
+    fail("invalid data type \"" + std::string(value) + "\"");
+  } else if (key == "cat") {
+    using category_type = item::category_type;
+    if (equals(value, "IO") || equals(value, "Memory")) {
+      set = &index_->categories[std::size_t(
+          equals(value, "IO") ? category_type::io : category_type::memory)];
+      return true;
+    }
+    fail("invalid category \"" + std::string(value) + "\"");
+  }
+  return false;
+}
+
+inline conf::item_set
+item_selector::eval(std::size_t t, const conf::item_set *within) const {
+  const auto &term = terms_[t];
+  const auto &sorted = index_->items;
+  const auto n = sorted.size();
+  const auto wanted = [&](std::size_t k) {
+    return within == nullptr || within->test(k);
+  };
+
+  auto s = conf::item_set(n);
+  switch (term.op) {
+  case kind::name: {
+    const auto [first, last] = index_->range(term.text);
+    if (first != last && sorted[first]->name == term.text && wanted(first))
+      s.set(first);
+    break;
+  }
+  case kind::glob: {
+    const auto literal =
+        std::string_view(term.text).substr(0, term.text.find_first_of("*?"));
+    const auto [first, last] = index_->range(literal);
+    for (auto k = first; k < last; ++k)
+      if (wanted(k) && termctl::glob_match(term.text, sorted[k]->name))
+        s.set(k);
+    break;
+  }
+  case kind::regex: {
+    const auto test = [&](std::size_t k) {
+      if (std::regex_search(sorted[k]->name, term.re))
+        s.set(k);
+    };
+    if (within != nullptr)
+      within->for_each(test);
+    else
+      for (std::size_t k = 0; k < n; ++k)
+        test(k);
+    break;
+  }
+  case kind::set:
+    if (term.set == nullptr)
+      break;
+    s = *term.set;
+    if (within != nullptr)
+      s &= *within;
+    break;
+  case kind::not_:
+    s = eval(term.lhs, within);
+    s.flip();
+    if (within != nullptr)
+      s &= *within;
+    break;
+  case kind::and_: {
+    const auto lhs = eval(term.lhs, within);
+    s = eval(term.rhs, &lhs);
+    break;
+  }
+  case kind::or_:
+    s = eval(term.lhs, within);
+    s |= eval(term.rhs, within);
+    break;
+  }
+  return s;
+}
+
+// Items matching any of 'selectors', in name order.
+inline std::vector<conf::io_parser::item>
+select_items(const conf::io_parser &parser,
+             const std::vector<std::string> &selectors) {
+  auto all = conf::item_set(parser.index().items.size());
+  for (const auto &text : selectors)
+    all |= item_selector(text, parser).select();
+  auto items = std::vector<conf::io_parser::item>();
+  all.for_each(
+      [&](std::size_t k) { items.push_back(*parser.index().items[k]); });
+  return items;
+}
+} // namespace ctf_io
@@ -0,0 +1,479 @@
+#pragma once
+
+#ifndef _WIN32
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "console.hpp"
+#include "jobs.hpp"
+#include "json.hpp"
+#include "terminal.hpp"
+
+namespace termctl {
+// Serves the command language on a Unix domain socket, for test harnesses to
+// drive the emulator without a pty. A request is one line, "<id> <command>",
+// answered by one line of JSON carrying the same id:
+//
+//   7 get Chamber.Pressure
+//   {"id":"7","ok":true,"out":["[OK][Chamber.Pressure][cp_r] read: 1.5"],
+//    "err":[]}
+//
+// A client may send requests without waiting for replies; its requests run
+// one after another in the order sent, so a 'get' pipelined after a 'set'
+// sees the write. Clients are served concurrently by one epoll loop, each
+// request runs as a job on the same command table as the terminal. A
+// trailing '&' starts a background job and is answered with its number.
+class server final {
+public:
+  server(terminal &term, const std::string &path);
+  ~server();
+
+  server(const server &) = delete;
+  server &operator=(const server &) = delete;
+
+private:
+  struct request {
+    std::string id;
+    std::string line;
+  };
+
+  struct connection {
+    int fd = -1;
+    std::uint32_t events = 0;
+    std::string in;
+    std::string out;
+    std::deque<request> queue;
+    job::ptr running;
+    bool eof = false;
+    // The peer hung up: what it sent still runs, the replies are dropped.
+    bool hup = false;
+    // The peer is gone, nothing can be answered any more.
+    bool broken = false;
+  };
+
+  struct reply {
+    std::uint64_t conn;
+    std::string text;
+  };
+
+  // Requests longer than this close the connection.
+  static constexpr std::size_t max_line = 1 << 20;
+  // epoll tags, connections count up from first_conn.
+  static constexpr std::uint64_t listen_tag = 0;
+  static constexpr std::uint64_t wake_tag = 1;
+  static constexpr std::uint64_t first_conn = 2;
+
+  void run();
+  void accept_clients();
+  void read_from(connection &c);
+  void write_to(connection &c);
+  void start_next(std::uint64_t id, connection &c);
+  void finish(std::uint64_t id, std::string &&text);
+  void collect();
+  void update(std::uint64_t id, connection &c);
+  void close_all();
+
+  static std::string json_lines(const std::string &text);
+  static std::string format(const std::string &id, bool ok,
+                            const std::string &out, const std::string &err,
+                            bool cancelled);
+
+  terminal &term_;
+  std::string path_;
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  int wake_fd_ = -1;
+  std::map<std::uint64_t, connection> conns_;
+  std::uint64_t next_conn_ = first_conn;
+  std::atomic_bool stop_{false};
+
+  // Replies of finished jobs, handed to the loop thread.
+  std::mutex mutex_;
+  std::vector<reply> replies_;
+  std::vector<job::ptr> orphans_;
+  std::thread thread_;
+};
+
+inline server::server(terminal &term, const std::string &path)
+    : term_(term), path_(path) {
+  auto addr = sockaddr_un{};
+  addr.sun_family = AF_UNIX;
+  if (path_.empty() || path_.size() >= sizeof(addr.sun_path))
+    throw std::invalid_argument("bad socket path \"" + path_ + "\"");
+  path_.copy(addr.sun_path, path_.size());
+
+  // A socket left behind by an earlier run is replaced, anything else at
+  // the path is not.
+  struct stat st = {};
+  if (::stat(path_.c_str(), &st) == 0) {
+    if (!S_ISSOCK(st.st_mode))
+      throw std::runtime_error("\"" + path_ + "\" is not a socket");
+    ::unlink(path_.c_str());
+  }
+
+  const auto fail = [this](const char *what) {
+    const auto error = errno;
+    close_all();
+    throw std::system_error(error, std::generic_category(), what);
+  };
+
+  listen_fd_ =
+      ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0)
+    fail("socket");
+  if (::bind(listen_fd_, reinterpret_cast<const sockaddr *>(&addr),
+             sizeof(addr)) < 0)
+    fail(path_.c_str());
+  // Clients drive IO writes, so only the owner may connect; done before
+  // listen(), so nobody gets in meanwhile.
+  if (::chmod(path_.c_str(), S_IRUSR | S_IWUSR) < 0)
+    fail(path_.c_str());
+  if (::listen(listen_fd_, SOMAXCONN) < 0)
+    fail("listen");
+
+  epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+  wake_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (epoll_fd_ < 0 || wake_fd_ < 0)
+    fail("epoll");
+  auto ev = epoll_event{};
+  ev.events = EPOLLIN;
+  ev.data.u64 = listen_tag;
+  ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev);
+  ev.data.u64 = wake_tag;
+  ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wake_fd_, &ev);
+
+  thread_ = std::thread(&server::run, this);
+}
+
+inline server::~server() {
+  stop_.store(true, std::memory_order_release);
+  const auto one = std::uint64_t(1);
+  [[maybe_unused]] auto n = ::write(wake_fd_, &one, sizeof(one));
+  if (thread_.joinable())
+    thread_.join();
+
+  // Running jobs still post their replies and write wake_fd_, every one of
+  // them has to end before the fds go.
+  auto running = std::vector<job::ptr>();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running = std::move(orphans_);
+  }
+  for (auto &[id, c] : conns_)
+    if (c.running)
+      running.push_back(std::move(c.running));
+  for (auto &j : running) {
+    j->request_stop();
+    j->wait();
+  }
+  close_all();
+}
+
+inline void server::close_all() {
+  for (auto &[id, c] : conns_)
+    ::close(c.fd);
+  conns_.clear();
+  for (auto *fd : {&listen_fd_, &epoll_fd_, &wake_fd_})
+    if (*fd >= 0)
+      ::close(std::exchange(*fd, -1));
+  ::unlink(path_.c_str());
+}
+
+inline void server::run() {
+  epoll_event events[64];
+  while (!stop_.load(std::memory_order_acquire)) {
+    const auto n = ::epoll_wait(epoll_fd_, events, 64, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      err() << "Error: " << std::system_category().message(errno)
+            << std::endl;
+      break;
+    }
+
+    for (auto i = 0; i < n; ++i) {
+      const auto tag = events[i].data.u64;
+      if (tag == listen_tag) {
+        accept_clients();
+        continue;
+      }
+      if (tag == wake_tag) {
+        std::uint64_t count;
+        [[maybe_unused]] auto r = ::read(wake_fd_, &count, sizeof(count));
+        collect();
+        continue;
+      }
+
+      auto it = conns_.find(tag);
+      if (it == conns_.end())
+        continue;
+      auto &c = it->second;
+      const auto ev = events[i].events;
+      if (ev & EPOLLERR) {
+        c.broken = true;
+      } else if (ev & EPOLLHUP) {
+        // Requests already sent are read and run before the close. A hangup
+        // cannot be masked, so the fd leaves epoll rather than spin.
+        read_from(c);
+        c.hup = true;
+        c.eof = true;
+        ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, c.fd, nullptr);
+      } else if (ev & EPOLLIN) {
+        read_from(c);
+      }
+      if (ev & EPOLLOUT)
+        write_to(c);
+      start_next(tag, c);
+      update(tag, c);
+    }
+  }
+}
+
+inline void server::accept_clients() {
+  for (;;) {
+    const auto fd = ::accept4(listen_fd_, nullptr, nullptr,
+                              SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+      return;
+
+    const auto id = next_conn_++;
+    auto &c = conns_[id];
+    c.fd = fd;
+    c.events = EPOLLIN;
+    auto ev = epoll_event{};
+    ev.events = c.events;
+    ev.data.u64 = id;
+    ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+inline void server::read_from(connection &c) {
+  char buf[4096];
+  for (;;) {
+    const auto n = ::recv(c.fd, buf, sizeof(buf), 0);
+    if (n > 0) {
+      c.in.append(buf, std::size_t(n));
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n < 0 && errno == EINTR)
+      continue;
+    // The client is done sending, requests in flight are still answered.
+    c.eof = true;
+    break;
+  }
+
+  auto pos = std::string::size_type(0);
+  for (auto eol = c.in.find('\n'); eol != std::string::npos;
+       eol = c.in.find('\n', pos)) {
+    auto line = std::string_view(c.in).substr(pos, eol - pos);
+    pos = eol + 1;
+    if (!line.empty() && line.back() == '\r')
+      line.remove_suffix(1);
+    const auto first = line.find_first_not_of(" \t");
+    if (first == std::string_view::npos)
+      continue;
+    line.remove_prefix(first);
+    const auto space = line.find_first_of(" \t");
+    auto req = request{std::string(line.substr(0, space)), {}};
+    if (space != std::string_view::npos)
+      req.line = std::string(line.substr(space + 1));
+    c.queue.push_back(std::move(req));
+  }
+  c.in.erase(0, pos);
+
+  if (c.in.size() > max_line) {
+    c.out += format({}, false, {}, "Error: request too long\n", false);
+    c.in.clear();
+    c.queue.clear();
+    c.eof = true;
+  }
+}
+
+inline void server::write_to(connection &c) {
+  if (c.hup)
+    c.out.clear();
+  while (!c.out.empty()) {
+    const auto n = ::send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+    if (n > 0) {
+      c.out.erase(0, std::size_t(n));
+      continue;
+    }
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return;
+    c.broken = true;
+    return;
+  }
+}
+
+inline void server::start_next(std::uint64_t id, connection &c) {
+  while (!c.broken && !c.running && !c.queue.empty()) {
+    auto req = std::move(c.queue.front());
+    c.queue.pop_front();
+
+    auto cl = terminal::command_line();
+    try {
+      if (req.line.empty())
+        throw std::invalid_argument("bad input, expects \"<id> <command>\"");
+      cl = terminal::parse_line(req.line);
+    } catch (const std::exception &e) {
+      c.out += format(req.id, false, {},
+                      std::string("Error: ") + e.what() + "\n", false);
+      continue;
+    }
+
+    if (cl.background) {
+      auto j = job_table::shared().spawn(
+          req.line,
+          [this, cl = std::move(cl)]() mutable {
+            term_.execute(std::move(cl));
+          },
+          true);
+      c.out += "{\"id\":" + json_string(req.id) +
+               ",\"ok\":true,\"job\":" + std::to_string(j->id()) + "}\n";
+      continue;
+    }
+
+    c.running = job_table::shared().spawn(
+        req.line,
+        [this, id, req_id = std::move(req.id), cl = std::move(cl)]() mutable {
+          auto os = std::ostringstream();
+          auto es = std::ostringstream();
+          // Set by a throw, or by mark_failed() from a command that prints
+          // its failures and goes on.
+          auto failed = false;
+          {
+            scoped_output redirect(os, es, &failed);
+            try {
+              term_.execute(std::move(cl));
+            } catch (const std::exception &e) {
+              es << "Error: " << e.what() << std::endl;
+              failed = true;
+            } catch (...) {
+              es << "Error: unexpected error" << std::endl;
+              failed = true;
+            }
+          }
+          finish(id, format(req_id, !failed, os.str(), es.str(),
+                            this_job::stop_requested()));
+        },
+        false);
+  }
+  write_to(c);
+}
+
+// Called on the job's thread.
+inline void server::finish(std::uint64_t id, std::string &&text) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    replies_.push_back({id, std::move(text)});
+  }
+  const auto one = std::uint64_t(1);
+  [[maybe_unused]] auto n = ::write(wake_fd_, &one, sizeof(one));
+}
+
+inline void server::collect() {
+  auto replies = std::vector<reply>();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    replies.swap(replies_);
+    // Jobs of closed connections have posted their last reply by now.
+    std::erase_if(orphans_, [](const job::ptr &j) { return j->done(); });
+  }
+
+  for (auto &r : replies) {
+    auto it = conns_.find(r.conn);
+    if (it == conns_.end())
+      continue;
+    auto &c = it->second;
+    c.running.reset();
+    c.out += r.text;
+    start_next(r.conn, c);
+    update(r.conn, c);
+  }
+}
+
+// Re-arms epoll for what the connection waits on, or closes it once it has
+// nothing left to send or run. A job left running by a client that went
+// away is cancelled.
+inline void server::update(std::uint64_t id, connection &c) {
+  if (c.broken && c.running) {
+    c.running->request_stop();
+    std::lock_guard<std::mutex> lock(mutex_);
+    orphans_.push_back(std::move(c.running));
+  }
+  if (c.broken || (c.eof && c.out.empty() && c.queue.empty() && !c.running)) {
+    ::close(c.fd);
+    conns_.erase(id);
+    return;
+  }
+
+  if (c.hup)
+    return;
+  auto events = std::uint32_t(c.eof ? 0 : EPOLLIN);
+  if (!c.out.empty())
+    events |= EPOLLOUT;
+  if (events == c.events)
+    return;
+
+  c.events = events;
+  auto ev = epoll_event{};
+  ev.events = events;
+  ev.data.u64 = id;
+  ::epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+// Output as an array of its lines.
+inline std::string server::json_lines(const std::string &text) {
+  auto json = std::string("[");
+  auto pos = std::string::size_type(0);
+  while (pos < text.size()) {
+    auto eol = text.find('\n', pos);
+    if (eol == std::string::npos)
+      eol = text.size();
+    if (json.size() > 1)
+      json += ',';
+    json += json_string(std::string_view(text).substr(pos, eol - pos));
+    pos = eol + 1;
+  }
+  json += ']';
+  return json;
+}
+
+inline std::string server::format(const std::string &id, bool ok,
+                                  const std::string &out,
+                                  const std::string &err, bool cancelled) {
+  auto json = "{\"id\":" + json_string(id) +
+              ",\"ok\":" + (ok ? "true" : "false") +
+              ",\"out\":" + json_lines(out) + ",\"err\":" + json_lines(err);
+  if (cancelled)
+    json += ",\"cancelled\":true";
+  json += "}\n";
+  return json;
+}
+} // namespace termctl
+#endif
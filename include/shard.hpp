@@ -0,0 +1,620 @@
+#pragma once
+
+#ifndef _WIN32
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#include "conf_parser.hpp"
+#include "console.hpp"
+#include "jobs.hpp"
+#include "terminal.hpp"
+
+namespace termctl {
+namespace detail {
+// A message, or a piece of one, in a shard queue.
+struct shard_slot {
+  static constexpr std::size_t data_size = 496;
+
+  std::uint64_t id;
+  std::uint32_t kind;
+  std::uint32_t size;
+  char data[data_size];
+};
+
+// A single-producer single-consumer ring living in memory shared by the
+// coordinator and one worker, so the indices must stay lock-free.
+struct shard_ring {
+  static constexpr std::size_t slots = 256;
+  static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+  alignas(64) std::atomic<std::uint64_t> head{0};
+  alignas(64) std::atomic<std::uint64_t> tail{0};
+  shard_slot slot[slots];
+
+  bool push(std::uint64_t id, std::uint32_t kind, std::string_view data) {
+    const auto t = tail.load(std::memory_order_relaxed);
+    if (t - head.load(std::memory_order_acquire) == slots)
+      return false;
+    auto &s = slot[t % slots];
+    s.id = id;
+    s.kind = kind;
+    s.size = std::uint32_t(data.copy(s.data, shard_slot::data_size));
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  const shard_slot *front() const {
+    const auto h = head.load(std::memory_order_relaxed);
+    if (h == tail.load(std::memory_order_acquire))
+      return nullptr;
+    return &slot[h % slots];
+  }
+
+  void pop() {
+    head.store(head.load(std::memory_order_relaxed) + 1,
+               std::memory_order_release);
+  }
+};
+
+struct shard_queues {
+  shard_ring requests;
+  shard_ring replies;
+  // Requests numbered below this are dropped, or stopped if running.
+  alignas(64) std::atomic<std::uint64_t> cancel_before{0};
+};
+} // namespace detail
+
+// Runs commands in worker processes forked at startup, each with an IO
+// client of its own, so stimulus loads too large for one process and one
+// connection spread across cores. Items are partitioned across workers by
+// driver or by a hash of the name; a command goes to the worker owning the
+// first item it names, and every worker runs its commands one after another
+// in the order sent. Commands and their output travel through a pair of
+// rings in shared memory per worker, an eventfd only wakes the other side.
+class shard_pool final {
+public:
+  enum class policy_type { driver, hash };
+  using hook_type = std::function<void()>;
+
+  struct result {
+    bool ok = false;
+    bool cancelled = false;
+    std::string out;
+    std::string err;
+  };
+
+  // A line for a worker and what became of it.
+  struct request {
+    std::size_t worker;
+    std::string line;
+    result res;
+  };
+
+  shard_pool(const shard_pool &) = delete;
+  shard_pool &operator=(const shard_pool &) = delete;
+
+  static shard_pool &shared() {
+    static shard_pool pool_;
+    return pool_;
+  }
+
+  // Parses IOTEST_WORKERS and IOTEST_SHARD_BY.
+  static std::size_t parse_workers(const std::string &text);
+  static policy_type parse_policy(const std::string &text);
+
+  // Forks the workers; must run before any other thread is started. 'init'
+  // and 'uninit' run in every worker around serving its queue.
+  void start(terminal &term, conf::io_parser::shared_ptr parser,
+             std::size_t workers, policy_type policy, hook_type init = {},
+             hook_type uninit = {});
+  // Asks every worker to exit and reaps it.
+  void stop();
+
+  bool started() const noexcept { return !workers_.empty(); }
+  std::size_t size() const noexcept { return workers_.size(); }
+  // The worker owning 'item', which need not exist.
+  std::size_t owner(const std::string &item) const;
+  // The worker owning the first item 'line' names, throws if it names none.
+  std::size_t route(const std::string &line) const;
+
+  // Runs every request on its worker and fills in its result; a stop
+  // request of the calling job cancels what has not finished.
+  void dispatch(std::vector<request> &batch);
+
+  void print(std::ostream &os) const;
+
+private:
+  enum : std::uint32_t { line_kind, quit_kind, out_kind, err_kind, done_kind };
+
+  struct worker {
+    pid_t pid = -1;
+    int wake_fd = -1;
+    detail::shard_queues *q = nullptr;
+    std::size_t items = 0;
+    std::uint64_t done = 0;
+    std::uint64_t failed = 0;
+    bool alive = false;
+    int status = 0;
+    // Requests sent and not finished yet, oldest first.
+    std::deque<std::size_t> pending;
+  };
+
+  shard_pool() = default;
+  ~shard_pool() { stop(); }
+
+  [[noreturn]] void serve(std::size_t index);
+  void execute(std::uint64_t id, const std::string &line);
+  void watch_cancel();
+  void send_reply(std::uint64_t id, std::uint32_t kind, std::string_view text);
+  static void signal(int fd) {
+    const auto one = std::uint64_t(1);
+    [[maybe_unused]] auto n = ::write(fd, &one, sizeof(one));
+  }
+
+  void require_started() const;
+  bool reap(worker &w);
+  void release();
+
+  terminal *term_ = nullptr;
+  conf::io_parser::shared_ptr parser_;
+  policy_type policy_ = policy_type::driver;
+  hook_type uninit_;
+  std::vector<worker> workers_;
+  void *mapping_ = nullptr;
+  std::size_t mapping_size_ = 0;
+  // Workers to coordinator.
+  int reply_fd_ = -1;
+  std::uint64_t next_id_ = 1;
+  // One dispatch at a time owns the coordinator side of the rings; in a
+  // worker it guards 'running_'.
+  std::mutex mutex_;
+
+  // Set in a worker process.
+  bool is_worker_ = false;
+  std::size_t index_ = 0;
+  pid_t parent_ = -1;
+  std::pair<std::uint64_t, job *> running_{0, nullptr};
+};
+
+inline std::size_t shard_pool::parse_workers(const std::string &text) {
+  auto n = std::size_t(0);
+  const auto [end, ec] =
+      std::from_chars(text.data(), text.data() + text.size(), n);
+  if (ec != std::errc() || end != text.data() + text.size() || n == 0 ||
+      n > 256)
+    throw std::invalid_argument("bad worker count \"" + text +
+                                "\", expects 1 to 256");
+  return n;
+}
+
+inline shard_pool::policy_type
+shard_pool::parse_policy(const std::string &text) {
+  if (text.empty() || text == "drv")
+    return policy_type::driver;
+  if (text == "hash")
+    return policy_type::hash;
+  throw std::invalid_argument("bad shard policy \"" + text +
+                              "\", expects drv or hash");
+}
+
+inline std::size_t shard_pool::owner(const std::string &item) const {
+  if (policy_ == policy_type::driver)
+    if (auto i = parser_->find_item(item); i && i->driver_id >= 0)
+      return std::size_t(i->driver_id) % workers_.size();
+
+  // FNV-1a, the same in every process and every run.
+  auto h = std::uint64_t(14695981039346656037ull);
+  for (const auto c : item)
+    h = (h ^ std::uint8_t(c)) * 1099511628211ull;
+  return std::size_t(h % workers_.size());
+}
+
+inline void shard_pool::require_started() const {
+  if (is_worker_)
+    throw std::runtime_error("shard workers cannot hand out commands");
+  if (!started())
+    throw std::runtime_error("no shard workers, set IOTEST_WORKERS to start "
+                             "some");
+}
+
+inline std::size_t shard_pool::route(const std::string &line) const {
+  require_started();
+  const auto cl = terminal::parse_line(line);
+  for (const auto &arg : cl.args)
+    if (parser_->find_item(arg))
+      return owner(arg);
+  throw std::invalid_argument("\"" + line + "\" names no item, use "
+                              "'shard all' to run it on every worker");
+}
+
+inline void shard_pool::start(terminal &term,
+                              conf::io_parser::shared_ptr parser,
+                              std::size_t workers, policy_type policy,
+                              hook_type init, hook_type uninit) {
+  if (started())
+    throw std::runtime_error("the shard workers are already running");
+  term_ = &term;
+  parser_ = std::move(parser);
+  policy_ = policy;
+  uninit_ = std::move(uninit);
+  workers_.resize(workers);
+
+  const auto fail = [this](const char *what) {
+    const auto error = errno;
+    release();
+    throw std::system_error(error, std::generic_category(), what);
+  };
+
+  mapping_size_ = sizeof(detail::shard_queues) * workers;
+  mapping_ = ::mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mapping_ == MAP_FAILED) {
+    mapping_ = nullptr;
+    fail("mmap");
+  }
+  reply_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (reply_fd_ < 0)
+    fail("eventfd");
+  for (std::size_t i = 0; i < workers; ++i) {
+    auto &w = workers_[i];
+    w.q = new (static_cast<detail::shard_queues *>(mapping_) + i)
+        detail::shard_queues();
+    w.wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (w.wake_fd < 0)
+      fail("eventfd");
+  }
+  for (const auto &[name, item] : parser_->items())
+    ++workers_[owner(name)].items;
+
+  parent_ = ::getpid();
+  for (std::size_t i = 0; i < workers; ++i) {
+    const auto pid = ::fork();
+    if (pid < 0)
+      fail("fork");
+    if (pid == 0) {
+      is_worker_ = true;
+      index_ = i;
+#ifdef __linux__
+      ::prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+      // Out of the terminal's process group, so Ctrl-C stays with the
+      // coordinator, and off its input.
+      ::setpgid(0, 0);
+      if (const auto fd = ::open("/dev/null", O_RDONLY); fd >= 0) {
+        ::dup2(fd, STDIN_FILENO);
+        ::close(fd);
+      }
+      try {
+        if (init)
+          init();
+      } catch (const std::exception &e) {
+        std::cerr << "Error: shard worker " << i << ": " << e.what()
+                  << std::endl;
+        ::_exit(EXIT_FAILURE);
+      }
+      serve(i);
+    }
+    workers_[i].pid = pid;
+    workers_[i].alive = true;
+  }
+}
+
+inline void shard_pool::stop() {
+  if (!started() || is_worker_)
+    return;
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto &w : workers_)
+    if (w.alive) {
+      w.q->requests.push(next_id_, quit_kind, {});
+      signal(w.wake_fd);
+    }
+
+  // A worker stuck in a command is not waited on for long.
+  const auto deadline =
+      std::chrono::steady_clock::now() + std::chrono::seconds(3);
+  for (auto &w : workers_) {
+    while (w.alive && !reap(w) &&
+           std::chrono::steady_clock::now() < deadline)
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    if (w.alive) {
+      ::kill(w.pid, SIGKILL);
+      ::waitpid(w.pid, &w.status, 0);
+      w.alive = false;
+    }
+  }
+  release();
+}
+
+inline void shard_pool::release() {
+  for (auto &w : workers_)
+    if (w.wake_fd >= 0)
+      ::close(w.wake_fd);
+  workers_.clear();
+  if (reply_fd_ >= 0)
+    ::close(std::exchange(reply_fd_, -1));
+  if (mapping_ != nullptr)
+    ::munmap(std::exchange(mapping_, nullptr), mapping_size_);
+}
+
+// Returns whether the worker has exited, and reaps it if so.
+inline bool shard_pool::reap(worker &w) {
+  if (!w.alive)
+    return true;
+  if (::waitpid(w.pid, &w.status, WNOHANG) != w.pid)
+    return false;
+  w.alive = false;
+  return true;
+}
+
+inline void shard_pool::dispatch(std::vector<request> &batch) {
+  require_started();
+  for (const auto &r : batch)
+    if (r.line.size() > detail::shard_slot::data_size)
+      throw std::invalid_argument("\"" + r.line.substr(0, 32) +
+                                  "...\" is too long for a shard worker");
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  const auto first_id = next_id_;
+  next_id_ += batch.size();
+  const auto index_of = [&](std::uint64_t id) {
+    return std::size_t(id - first_id);
+  };
+
+  // Per worker, the next request of the batch not sent yet.
+  auto unsent = std::vector<std::deque<std::size_t>>(workers_.size());
+  for (std::size_t i = 0; i < batch.size(); ++i)
+    unsent[batch[i].worker].push_back(i);
+  auto outstanding = batch.size();
+  auto cancelled = false;
+
+  const auto finish = [&](worker &w, std::size_t i, bool ok, bool cancel) {
+    auto &res = batch[i].res;
+    res.ok = ok;
+    res.cancelled = cancel;
+    ++(ok ? w.done : w.failed);
+    --outstanding;
+  };
+
+  while (outstanding) {
+    if (!cancelled && this_job::stop_requested()) {
+      cancelled = true;
+      for (std::size_t k = 0; k < workers_.size(); ++k) {
+        for (const auto i : unsent[k])
+          finish(workers_[k], i, false, true);
+        unsent[k].clear();
+        workers_[k].q->cancel_before.store(next_id_,
+                                           std::memory_order_release);
+        signal(workers_[k].wake_fd);
+      }
+    }
+
+    for (std::size_t k = 0; k < workers_.size(); ++k) {
+      auto &w = workers_[k];
+      auto sent = false;
+      while (!unsent[k].empty()) {
+        const auto i = unsent[k].front();
+        if (!w.q->requests.push(first_id + i, line_kind, batch[i].line))
+          break;
+        w.pending.push_back(i);
+        unsent[k].pop_front();
+        sent = true;
+      }
+      if (sent)
+        signal(w.wake_fd);
+
+      // Replies come in the order the requests were sent.
+      for (auto *s = w.q->replies.front(); s; s = w.q->replies.front()) {
+        const auto i = index_of(s->id);
+        auto &res = batch[i].res;
+        if (s->kind == out_kind)
+          res.out.append(s->data, s->size);
+        else if (s->kind == err_kind)
+          res.err.append(s->data, s->size);
+        else if (s->kind == done_kind) {
+          finish(w, i, s->data[0] == 'o', s->data[0] == 'c');
+          if (!w.pending.empty())
+            w.pending.pop_front();
+        }
+        w.q->replies.pop();
+      }
+    }
+    if (!outstanding)
+      break;
+
+    auto pfd = pollfd{reply_fd_, POLLIN, 0};
+    if (::poll(&pfd, 1, 20) > 0) {
+      std::uint64_t count;
+      [[maybe_unused]] auto n = ::read(reply_fd_, &count, sizeof(count));
+      continue;
+    }
+
+    // Nothing came back for a while, check nobody died with work left.
+    for (std::size_t k = 0; k < workers_.size(); ++k) {
+      auto &w = workers_[k];
+      if (w.alive && !reap(w))
+        continue;
+      if (w.q->replies.front() != nullptr)
+        continue;
+      auto lost = std::move(w.pending);
+      w.pending.clear();
+      lost.insert(lost.end(), unsent[k].begin(), unsent[k].end());
+      unsent[k].clear();
+      for (const auto i : lost) {
+        batch[i].res.err +=
+            "Error: shard worker " + std::to_string(k) + " has exited\n";
+        finish(w, i, false, false);
+      }
+    }
+  }
+}
+
+inline void shard_pool::print(std::ostream &os) const {
+  if (is_worker_) {
+    os << "[shard][worker " << index_ << " of " << workers_.size() << "]";
+    return;
+  }
+  for (std::size_t k = 0; k < workers_.size(); ++k) {
+    const auto &w = workers_[k];
+    os << "[worker " << k << "][pid: " << w.pid << "][items: " << w.items
+       << "][done: " << w.done << "][failed: " << w.failed << "][";
+    if (w.alive)
+      os << "running";
+    else if (WIFEXITED(w.status))
+      os << "exited " << WEXITSTATUS(w.status);
+    else
+      os << "killed by signal " << WTERMSIG(w.status);
+    os << "]\n";
+  }
+  os << "[shard][" << workers_.size() << " workers by "
+     << (policy_ == policy_type::driver ? "drv" : "hash") << "]";
+}
+
+// The worker side, in the forked process; never returns.
+inline void shard_pool::serve(std::size_t index) {
+  auto &w = workers_[index];
+  auto &q = *w.q;
+  std::thread(&shard_pool::watch_cancel, this).detach();
+  for (;;) {
+    const auto *s = q.requests.front();
+    if (s == nullptr) {
+      if (::getppid() != parent_)
+        break;
+      auto pfd = pollfd{w.wake_fd, POLLIN, 0};
+      if (::poll(&pfd, 1, 1000) > 0) {
+        std::uint64_t count;
+        [[maybe_unused]] auto n = ::read(w.wake_fd, &count, sizeof(count));
+      }
+      continue;
+    }
+
+    const auto id = s->id;
+    const auto kind = s->kind;
+    const auto line = std::string(s->data, s->size);
+    q.requests.pop();
+    if (kind == quit_kind)
+      break;
+    if (id < q.cancel_before.load(std::memory_order_acquire))
+      send_reply(id, done_kind, "c");
+    else
+      execute(id, line);
+  }
+
+  try {
+    if (uninit_)
+      uninit_();
+  } catch (...) {
+  }
+  ::_exit(EXIT_SUCCESS);
+}
+
+inline void shard_pool::execute(std::uint64_t id, const std::string &line) {
+  auto cl = terminal::command_line();
+  try {
+    cl = terminal::parse_line(line);
+    if (cl.background)
+      throw std::invalid_argument("shard workers run no background jobs");
+  } catch (const std::exception &e) {
+    send_reply(id, err_kind, std::string("Error: ") + e.what() + "\n");
+    send_reply(id, done_kind, "f");
+    return;
+  }
+
+  // Run inline under a job of its own, which the watchdog stops should the
+  // request be cancelled; a thread per command would cost more than most
+  // commands take.
+  auto j = job(0, line, false);
+  auto os = std::ostringstream();
+  auto es = std::ostringstream();
+  // Set by a throw, or by mark_failed() from a command that prints its
+  // failures and goes on.
+  auto failed = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = {id, &j};
+  }
+  {
+    this_job::scope as(j);
+    scoped_output redirect(os, es, &failed);
+    try {
+      term_->execute(std::move(cl));
+    } catch (const std::exception &e) {
+      es << "Error: " << e.what() << std::endl;
+      failed = true;
+    } catch (...) {
+      es << "Error: unexpected error" << std::endl;
+      failed = true;
+    }
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    running_ = {};
+  }
+
+  send_reply(id, out_kind, os.str());
+  send_reply(id, err_kind, es.str());
+  send_reply(id, done_kind, j.stop_requested() ? "c" : failed ? "f" : "o");
+}
+
+// Stops the running command once its request is cancelled.
+inline void shard_pool::watch_cancel() {
+  auto &q = *workers_[index_].q;
+  for (;;) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (running_.second != nullptr &&
+        running_.first < q.cancel_before.load(std::memory_order_acquire))
+      running_.second->request_stop();
+  }
+}
+
+inline void shard_pool::send_reply(std::uint64_t id, std::uint32_t kind,
+                                   std::string_view text) {
+  auto &q = *workers_[index_].q;
+  while (!text.empty() || kind == done_kind) {
+    const auto chunk = text.substr(0, detail::shard_slot::data_size);
+    // The coordinator drains replies as it waits, a full ring is brief.
+    while (!q.replies.push(id, kind, chunk)) {
+      signal(reply_fd_);
+      if (::getppid() != parent_)
+        ::_exit(EXIT_FAILURE);
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    text.remove_prefix(chunk.size());
+    if (kind == done_kind)
+      break;
+  }
+  if (kind == done_kind)
+    signal(reply_fd_);
+}
+} // namespace termctl
+#endif
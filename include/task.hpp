@@ -0,0 +1,864 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#endif
+
+namespace runtime {
+using clock_type = std::chrono::steady_clock;
+using time_point = clock_type::time_point;
+
+class cancelled_error : public std::runtime_error {
+public:
+  cancelled_error() : std::runtime_error("task cancelled") {}
+};
+
+// The tick period of 'rate' Hz; throws if it rounds to zero, which would
+// stall the schedule and divide by zero when counting missed ticks.
+inline clock_type::duration rate_period(double rate) {
+  const auto period = std::chrono::duration_cast<clock_type::duration>(
+      std::chrono::duration<double>(1.0 / rate));
+  if (period.count() <= 0)
+    throw std::invalid_argument("rate too high \"" + std::to_string(rate) +
+                                "\"");
+  return period;
+}
+
+// Timing of a periodic writer against its ideal, drift-free schedule.
+class deadline_stats final {
+public:
+  void record(std::chrono::nanoseconds lateness, bool ok) noexcept {
+    const auto ns = lateness.count();
+    ticks_.fetch_add(1, std::memory_order_relaxed);
+    late_sum_.fetch_add(ns, std::memory_order_relaxed);
+    if (ns > late_max_.load(std::memory_order_relaxed))
+      late_max_.store(ns, std::memory_order_relaxed);
+    if (!ok)
+      failures_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void miss(std::uint64_t n) noexcept {
+    missed_.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  void reset() noexcept {
+    ticks_ = missed_ = failures_ = 0;
+    late_sum_ = late_max_ = 0;
+  }
+
+  std::uint64_t ticks() const noexcept { return ticks_.load(); }
+  std::uint64_t missed() const noexcept { return missed_.load(); }
+  std::uint64_t failures() const noexcept { return failures_.load(); }
+
+  double mean_jitter_us() const noexcept {
+    const auto n = ticks();
+    return n ? double(late_sum_.load()) / double(n) / 1e3 : 0.0;
+  }
+
+  double max_jitter_us() const noexcept { return late_max_.load() / 1e3; }
+
+  void print(std::ostream &os, double elapsed_s) const {
+    const auto flags = os.flags();
+    const auto precision = os.precision();
+    os << std::fixed << std::setprecision(1)
+       << "[rate: " << (elapsed_s > 0 ? double(ticks()) / elapsed_s : 0.0)
+       << "Hz][ticks: " << ticks() << "][missed: " << missed()
+       << "][jitter avg/max: " << mean_jitter_us() << "/" << max_jitter_us()
+       << "us][fail: " << failures() << "]";
+    os.flags(flags);
+    os.precision(precision);
+  }
+
+private:
+  std::atomic<std::uint64_t> ticks_ = 0;
+  std::atomic<std::uint64_t> missed_ = 0;
+  std::atomic<std::uint64_t> failures_ = 0;
+  std::atomic<std::int64_t> late_sum_ = 0;
+  std::atomic<std::int64_t> late_max_ = 0;
+};
+
+// Shared between a spawned task and whoever holds its handle. A task spawned
+// as part of a group is also cancelled with the group.
+class task_state final {
+public:
+  task_state() = default;
+  explicit task_state(task_state *group) noexcept : group_(group) {}
+
+  bool cancelled() const noexcept {
+    for (auto s = this; s != nullptr; s = s->group_)
+      if (s->cancelled_.load(std::memory_order_acquire))
+        return true;
+    return false;
+  }
+
+  bool done() const noexcept {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return done_;
+  }
+
+  template <typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period> &d) const {
+    std::unique_lock<std::mutex> lock(mutex_);
+    return cv_.wait_for(lock, d, [this] { return done_; });
+  }
+
+  std::exception_ptr exception() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return exception_;
+  }
+
+private:
+  friend class scheduler;
+  friend struct join_awaiter;
+
+  void finish(std::exception_ptr e);
+
+  std::atomic_bool cancelled_ = false;
+  task_state *group_ = nullptr;
+  // Tasks joining this one, only touched on the scheduler thread.
+  std::vector<std::coroutine_handle<>> joiners_;
+  bool done_ = false;
+  std::exception_ptr exception_;
+  mutable std::mutex mutex_;
+  mutable std::condition_variable cv_;
+};
+
+class task_handle final {
+public:
+  task_handle() = default;
+  explicit task_handle(std::shared_ptr<task_state> state)
+      : state_(std::move(state)) {}
+
+  explicit operator bool() const noexcept { return state_ != nullptr; }
+
+  task_state *state() const noexcept { return state_.get(); }
+  void cancel() const;
+  bool done() const noexcept { return state_->done(); }
+  bool cancelled() const noexcept { return state_->cancelled(); }
+
+  template <typename Rep, typename Period>
+  bool wait_for(const std::chrono::duration<Rep, Period> &d) const {
+    return state_->wait_for(d);
+  }
+
+  // Rethrows what the task failed with, cancellation is not a failure.
+  void rethrow() const {
+    if (auto e = state_->exception(); e) {
+      try {
+        std::rethrow_exception(e);
+      } catch (const cancelled_error &) {
+      }
+    }
+  }
+
+private:
+  std::shared_ptr<task_state> state_;
+};
+
+template <typename T = void> class task;
+
+namespace detail {
+template <typename T> class promise_base {
+public:
+  struct final_awaiter {
+    bool await_ready() const noexcept { return false; }
+
+    template <typename P>
+    std::coroutine_handle<>
+    await_suspend(std::coroutine_handle<P> h) const noexcept {
+      if (auto next = h.promise().continuation_; next)
+        return next;
+      return std::noop_coroutine();
+    }
+
+    void await_resume() const noexcept {}
+  };
+
+  std::suspend_always initial_suspend() const noexcept { return {}; }
+  final_awaiter final_suspend() const noexcept { return {}; }
+
+  void unhandled_exception() noexcept {
+    result_.template emplace<2>(std::current_exception());
+  }
+
+  void set_continuation(std::coroutine_handle<> h) noexcept {
+    continuation_ = h;
+  }
+
+protected:
+  using value_type = std::conditional_t<std::is_void_v<T>, std::monostate, T>;
+
+  std::variant<std::monostate, value_type, std::exception_ptr> result_;
+  std::coroutine_handle<> continuation_;
+};
+
+template <typename T> class promise final : public promise_base<T> {
+public:
+  task<T> get_return_object() noexcept;
+
+  template <typename U> void return_value(U &&val) {
+    this->result_.template emplace<1>(std::forward<U>(val));
+  }
+
+  T result() {
+    if (auto e = std::get_if<2>(&this->result_))
+      std::rethrow_exception(*e);
+    return std::move(std::get<1>(this->result_));
+  }
+};
+
+template <> class promise<void> final : public promise_base<void> {
+public:
+  task<void> get_return_object() noexcept;
+
+  void return_void() noexcept {}
+
+  void result() {
+    if (auto e = std::get_if<2>(&this->result_))
+      std::rethrow_exception(*e);
+  }
+};
+
+// The fire-and-forget coroutine at the root of every spawned task.
+struct detached {
+  struct promise_type {
+    detached get_return_object() noexcept {
+      return {std::coroutine_handle<promise_type>::from_promise(*this)};
+    }
+    std::suspend_always initial_suspend() const noexcept { return {}; }
+    std::suspend_never final_suspend() const noexcept { return {}; }
+    void return_void() const noexcept {}
+    void unhandled_exception() const noexcept { std::terminate(); }
+  };
+
+  std::coroutine_handle<promise_type> handle;
+};
+} // namespace detail
+
+// A lazily started coroutine, it runs once awaited or spawned.
+template <typename T> class task final {
+public:
+  using promise_type = detail::promise<T>;
+  using handle_type = std::coroutine_handle<promise_type>;
+
+  task() = delete;
+  task(const task &) = delete;
+  task &operator=(const task &) = delete;
+
+  explicit task(handle_type h) noexcept : coro_(h) {}
+  task(task &&other) noexcept : coro_(std::exchange(other.coro_, {})) {}
+  task &operator=(task &&other) noexcept {
+    if (this != &other) {
+      if (coro_)
+        coro_.destroy();
+      coro_ = std::exchange(other.coro_, {});
+    }
+    return *this;
+  }
+
+  ~task() {
+    if (coro_)
+      coro_.destroy();
+  }
+
+  auto operator co_await() && noexcept {
+    struct awaiter {
+      handle_type coro;
+
+      bool await_ready() const noexcept { return !coro || coro.done(); }
+
+      std::coroutine_handle<>
+      await_suspend(std::coroutine_handle<> h) const noexcept {
+        coro.promise().set_continuation(h);
+        return coro;
+      }
+
+      T await_resume() const { return coro.promise().result(); }
+    };
+    return awaiter{coro_};
+  }
+
+private:
+  handle_type coro_;
+};
+
+template <typename T> task<T> detail::promise<T>::get_return_object() noexcept {
+  return task<T>(std::coroutine_handle<promise<T>>::from_promise(*this));
+}
+
+inline task<void> detail::promise<void>::get_return_object() noexcept {
+  return task<void>(std::coroutine_handle<promise<void>>::from_promise(*this));
+}
+
+// Runs every task on one thread, so hundreds of timed sequences cost one OS
+// thread in total. Blocking work is offloaded to a small worker pool and
+// resumes back on the scheduler thread once complete.
+class scheduler final {
+public:
+  scheduler(const scheduler &) = delete;
+  scheduler &operator=(const scheduler &) = delete;
+
+  static scheduler &shared() {
+    static scheduler sched_;
+    return sched_;
+  }
+
+  ~scheduler() { shutdown(); }
+
+  // Spawns 't', a non-null 'group' makes it part of that group.
+  task_handle spawn(task<void> &&t, task_state *group = nullptr);
+
+  // Resumes 'h' on the scheduler thread as soon as possible, or at 'tp'.
+  void post(std::coroutine_handle<> h, task_state *state) {
+    schedule({time_point::min(), 0, h, state});
+  }
+
+  void post_at(time_point tp, std::coroutine_handle<> h, task_state *state) {
+    schedule({tp, 0, h, state});
+  }
+
+  // Runs 'fn' on the worker pool.
+  void offload(std::function<void()> &&fn);
+
+  // Suspends 'h' until unpark(), or until its task is cancelled, in which
+  // case 'detach' is called first to unregister it. Scheduler thread only.
+  void park(std::coroutine_handle<> h, task_state *state,
+            std::function<void()> &&detach) {
+    parked_.push_back({h, state, std::move(detach)});
+  }
+
+  void unpark(std::coroutine_handle<> h) {
+    auto it = std::find_if(parked_.begin(), parked_.end(),
+                           [h](const parked &p) { return p.handle == h; });
+    if (it != parked_.end()) {
+      ready_.push_back({time_point::min(), seq_++, it->handle, it->state});
+      parked_.erase(it);
+    }
+  }
+
+  // The task resumed last on this thread, used by awaitables to carry
+  // cancellation across suspension points.
+  static task_state *current() noexcept { return current_; }
+
+  static bool on_scheduler_thread() noexcept { return is_scheduler_thread_; }
+
+  std::size_t active_tasks() const noexcept {
+    return active_.load(std::memory_order_relaxed);
+  }
+
+  void cancel(task_state *state);
+
+private:
+  struct entry {
+    time_point deadline;
+    std::uint64_t seq;
+    std::coroutine_handle<> handle;
+    task_state *state;
+
+    bool operator>(const entry &other) const noexcept {
+      return deadline != other.deadline ? deadline > other.deadline
+                                        : seq > other.seq;
+    }
+  };
+
+  struct parked {
+    std::coroutine_handle<> handle;
+    task_state *state;
+    std::function<void()> detach;
+  };
+
+  scheduler() = default;
+
+  void start();
+  void shutdown();
+  void schedule(entry &&e);
+  void run();
+  void wait(std::unique_lock<std::mutex> &lock);
+  void wake() noexcept;
+  void sweep_cancelled();
+  void worker_run();
+
+  static detail::detached root(task<void> t,
+                               std::shared_ptr<task_state> state);
+
+  static inline thread_local task_state *current_ = nullptr;
+  static inline thread_local bool is_scheduler_thread_ = false;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<entry> incoming_;
+  std::vector<entry> timers_;
+  std::deque<entry> ready_;
+  std::vector<parked> parked_;
+  std::uint64_t seq_ = 0;
+  bool stopping_ = false;
+  bool sweep_ = false;
+  std::once_flag started_;
+  std::thread thread_;
+  std::atomic<std::size_t> active_ = 0;
+
+  std::mutex workers_mutex_;
+  std::condition_variable workers_cv_;
+  std::deque<std::function<void()>> jobs_;
+  std::vector<std::thread> workers_;
+  bool workers_stopping_ = false;
+
+#ifdef __linux__
+  int timer_fd_ = -1;
+  int event_fd_ = -1;
+#endif
+};
+
+inline detail::detached scheduler::root(task<void> t,
+                                        std::shared_ptr<task_state> state) {
+  auto e = std::exception_ptr();
+  try {
+    co_await std::move(t);
+  } catch (const cancelled_error &) {
+    e = std::current_exception();
+  } catch (...) {
+    e = std::current_exception();
+    // A failing member takes the rest of its group down with it.
+    if (state->group_)
+      shared().cancel(state->group_);
+  }
+
+  shared().active_.fetch_sub(1, std::memory_order_relaxed);
+  state->finish(std::move(e));
+}
+
+inline void task_state::finish(std::exception_ptr e) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    exception_ = std::move(e);
+    done_ = true;
+  }
+  cv_.notify_all();
+  for (auto h : std::exchange(joiners_, {}))
+    scheduler::shared().unpark(h);
+}
+
+inline task_handle scheduler::spawn(task<void> &&t, task_state *group) {
+  std::call_once(started_, &scheduler::start, this);
+  auto state = std::make_shared<task_state>(group);
+  auto r = root(std::move(t), state);
+  active_.fetch_add(1, std::memory_order_relaxed);
+  post(r.handle, state.get());
+  return task_handle(std::move(state));
+}
+
+inline void task_handle::cancel() const {
+  scheduler::shared().cancel(state_.get());
+}
+
+inline void scheduler::cancel(task_state *state) {
+  state->cancelled_.store(true, std::memory_order_release);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    sweep_ = true;
+  }
+  wake();
+}
+
+inline void scheduler::start() {
+#ifdef __linux__
+  timer_fd_ = ::timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (timer_fd_ < 0 || event_fd_ < 0)
+    throw std::runtime_error("failed to create the scheduler timer");
+#endif
+  thread_ = std::thread(&scheduler::run, this);
+}
+
+inline void scheduler::shutdown() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  wake();
+  if (thread_.joinable())
+    thread_.join();
+
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    workers_stopping_ = true;
+  }
+  workers_cv_.notify_all();
+  for (auto &w : workers_)
+    w.join();
+
+#ifdef __linux__
+  for (auto fd : {timer_fd_, event_fd_})
+    if (fd >= 0)
+      ::close(fd);
+#endif
+}
+
+inline void scheduler::schedule(entry &&e) {
+  if (on_scheduler_thread()) {
+    e.seq = seq_++;
+    if (e.deadline == time_point::min()) {
+      ready_.push_back(e);
+    } else {
+      timers_.push_back(e);
+      std::push_heap(timers_.begin(), timers_.end(), std::greater<>());
+    }
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    incoming_.push_back(e);
+  }
+  wake();
+}
+
+inline void scheduler::offload(std::function<void()> &&fn) {
+  {
+    std::lock_guard<std::mutex> lock(workers_mutex_);
+    if (workers_.empty()) {
+      const auto n = std::max(2u, std::thread::hardware_concurrency() / 2);
+      for (auto i = 0u; i < n; ++i)
+        workers_.emplace_back(&scheduler::worker_run, this);
+    }
+    jobs_.push_back(std::move(fn));
+  }
+  workers_cv_.notify_one();
+}
+
+inline void scheduler::worker_run() {
+  for (;;) {
+    auto fn = std::function<void()>();
+    {
+      std::unique_lock<std::mutex> lock(workers_mutex_);
+      workers_cv_.wait(lock,
+                       [this] { return workers_stopping_ || !jobs_.empty(); });
+      if (jobs_.empty())
+        return;
+      fn = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+    fn();
+  }
+}
+
+inline void scheduler::wake() noexcept {
+#ifdef __linux__
+  const std::uint64_t one = 1;
+  if (event_fd_ >= 0)
+    [[maybe_unused]] auto n = ::write(event_fd_, &one, sizeof(one));
+#else
+  cv_.notify_one();
+#endif
+}
+
+// Moves sleepers of cancelled tasks to the ready queue, they throw
+// cancelled_error once resumed.
+inline void scheduler::sweep_cancelled() {
+  for (auto it = parked_.begin(); it != parked_.end();)
+    if (it->state && it->state->cancelled()) {
+      if (it->detach)
+        it->detach();
+      ready_.push_back({time_point::min(), seq_++, it->handle, it->state});
+      it = parked_.erase(it);
+    } else {
+      ++it;
+    }
+
+  auto it = std::partition(timers_.begin(), timers_.end(), [](const entry &e) {
+    return !(e.state && e.state->cancelled());
+  });
+  if (it == timers_.end())
+    return;
+
+  ready_.insert(ready_.end(), it, timers_.end());
+  timers_.erase(it, timers_.end());
+  std::make_heap(timers_.begin(), timers_.end(), std::greater<>());
+}
+
+inline void scheduler::wait(std::unique_lock<std::mutex> &lock) {
+#ifdef __linux__
+  auto spec = itimerspec{};
+  if (!timers_.empty()) {
+    // Arm an absolute CLOCK_MONOTONIC deadline so sleeps never drift.
+    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        timers_.front().deadline.time_since_epoch())
+                        .count();
+    spec.it_value.tv_sec = std::max<std::int64_t>(ns / 1000000000, 0);
+    spec.it_value.tv_nsec = ns > 0 ? ns % 1000000000 : 1;
+  }
+  ::timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr);
+
+  lock.unlock();
+  pollfd fds[] = {{event_fd_, POLLIN, 0}, {timer_fd_, POLLIN, 0}};
+  if (::poll(fds, 2, -1) > 0) {
+    std::uint64_t val;
+    for (const auto &fd : fds)
+      if (fd.revents & POLLIN)
+        [[maybe_unused]] auto n = ::read(fd.fd, &val, sizeof(val));
+  }
+  lock.lock();
+#else
+  auto pending = [this] { return stopping_ || sweep_ || !incoming_.empty(); };
+  if (timers_.empty())
+    cv_.wait(lock, pending);
+  else
+    cv_.wait_until(lock, timers_.front().deadline, pending);
+#endif
+}
+
+inline void scheduler::run() {
+  is_scheduler_thread_ = true;
+  auto lock = std::unique_lock<std::mutex>(mutex_);
+  while (!stopping_) {
+    for (auto &e : incoming_) {
+      e.seq = seq_++;
+      if (e.deadline == time_point::min()) {
+        ready_.push_back(e);
+      } else {
+        timers_.push_back(e);
+        std::push_heap(timers_.begin(), timers_.end(), std::greater<>());
+      }
+    }
+    incoming_.clear();
+    if (std::exchange(sweep_, false))
+      sweep_cancelled();
+    lock.unlock();
+
+    const auto now = clock_type::now();
+    while (!timers_.empty() && timers_.front().deadline <= now) {
+      std::pop_heap(timers_.begin(), timers_.end(), std::greater<>());
+      ready_.push_back(timers_.back());
+      timers_.pop_back();
+    }
+
+    // Tasks posted while running wait for the next round, so a task that
+    // keeps yielding cannot starve the timers.
+    for (auto n = ready_.size(); n > 0; --n) {
+      auto e = ready_.front();
+      ready_.pop_front();
+      current_ = e.state;
+      e.handle.resume();
+    }
+    current_ = nullptr;
+
+    lock.lock();
+    if (ready_.empty() && incoming_.empty() && !sweep_ && !stopping_)
+      wait(lock);
+  }
+}
+
+// Awaitables, they all throw cancelled_error when the task was cancelled.
+namespace detail {
+inline void throw_if_cancelled() {
+  if (auto s = scheduler::current(); s && s->cancelled())
+    throw cancelled_error();
+}
+} // namespace detail
+
+struct sleep_until_awaiter {
+  time_point deadline;
+
+  // A cancelled task does not wait out its deadline before throwing.
+  bool await_ready() const noexcept {
+    if (auto s = scheduler::current(); s && s->cancelled())
+      return true;
+    return deadline <= clock_type::now();
+  }
+
+  void await_suspend(std::coroutine_handle<> h) const {
+    scheduler::shared().post_at(deadline, h, scheduler::current());
+  }
+
+  void await_resume() const { detail::throw_if_cancelled(); }
+};
+
+inline sleep_until_awaiter sleep_until(time_point tp) noexcept { return {tp}; }
+
+template <typename Rep, typename Period>
+sleep_until_awaiter sleep_for(const std::chrono::duration<Rep, Period> &d) {
+  return sleep_until(clock_type::now() +
+                     std::chrono::duration_cast<clock_type::duration>(d));
+}
+
+// Gives other ready tasks a turn.
+inline auto yield() noexcept {
+  struct awaiter {
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> h) const {
+      scheduler::shared().post(h, scheduler::current());
+    }
+    void await_resume() const { detail::throw_if_cancelled(); }
+  };
+  return awaiter{};
+}
+
+// Runs a blocking call (typically an IO request) on a worker thread and
+// resumes with its result once it has completed. Note that GCC 12 destroys
+// closure temporaries in a co_await expression twice, so 'fn' must only
+// capture trivially destructible values.
+template <typename Fn> auto offload(Fn &&fn) {
+  static_assert(std::is_trivially_destructible_v<std::decay_t<Fn>>,
+                "offload() needs trivially destructible captures (GCC 12)");
+  using result_type = std::invoke_result_t<Fn>;
+  using value_type = std::conditional_t<std::is_void_v<result_type>,
+                                        std::monostate, result_type>;
+
+  struct awaiter {
+    std::decay_t<Fn> fn;
+    std::variant<std::monostate, value_type, std::exception_ptr> result;
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> h) {
+      scheduler::shared().offload([this, h, state = scheduler::current()] {
+        try {
+          if constexpr (std::is_void_v<result_type>) {
+            fn();
+            result.template emplace<1>();
+          } else {
+            result.template emplace<1>(fn());
+          }
+        } catch (...) {
+          result.template emplace<2>(std::current_exception());
+        }
+        scheduler::shared().post(h, state);
+      });
+    }
+
+    result_type await_resume() {
+      if (auto e = std::get_if<2>(&result))
+        std::rethrow_exception(*e);
+      detail::throw_if_cancelled();
+      if constexpr (!std::is_void_v<result_type>)
+        return std::move(std::get<1>(result));
+    }
+  };
+
+  return awaiter{std::forward<Fn>(fn), {}};
+}
+
+// Polls 'pred' until it holds, returns false if 'timeout' expires first.
+template <typename Pred>
+task<bool> until(Pred pred, clock_type::duration interval,
+                 std::optional<clock_type::duration> timeout = std::nullopt) {
+  const auto deadline = timeout ? std::optional(clock_type::now() + *timeout)
+                                : std::nullopt;
+  auto next = clock_type::now();
+  while (!pred()) {
+    const auto now = clock_type::now();
+    if (deadline && now >= *deadline)
+      co_return false;
+
+    next = std::max(next + interval, now);
+    co_await sleep_until(deadline ? std::min(next, *deadline) : next);
+  }
+  co_return true;
+}
+
+inline task_handle spawn(task<void> &&t) {
+  return scheduler::shared().spawn(std::move(t));
+}
+
+// Waits for a spawned task to finish; never throws, so a cancelled joiner can
+// still wait for its children to wind down.
+struct join_awaiter {
+  task_state *state;
+
+  bool await_ready() const noexcept { return state->done(); }
+
+  void await_suspend(std::coroutine_handle<> h) const {
+    state->joiners_.push_back(h);
+    scheduler::shared().park(h, scheduler::current(), [s = state, h] {
+      auto &v = s->joiners_;
+      v.erase(std::remove(v.begin(), v.end(), h), v.end());
+    });
+  }
+
+  void await_resume() const noexcept {}
+};
+
+inline join_awaiter join(const task_handle &h) noexcept { return {h.state()}; }
+
+// Runs 'tasks' concurrently and completes once all of them have. The first
+// failure cancels the others and is rethrown, as is cancellation of the
+// awaiting task.
+inline task<void> when_all(std::vector<task<void>> tasks) {
+  auto group = task_state(scheduler::current());
+  auto handles = std::vector<task_handle>();
+  for (auto &t : tasks)
+    handles.push_back(scheduler::shared().spawn(std::move(t), &group));
+
+  for (const auto &h : handles)
+    while (!h.done())
+      co_await join(h);
+
+  for (const auto &h : handles)
+    h.rethrow();
+  detail::throw_if_cancelled();
+}
+
+// Releases its waiters once 'count' tasks have arrived, then resets for the
+// next round. Scheduler thread only.
+class barrier final {
+public:
+  explicit barrier(std::size_t count) : count_(count) {}
+
+  auto arrive_and_wait() noexcept {
+    struct awaiter {
+      barrier *self;
+
+      bool await_ready() const {
+        if (auto s = scheduler::current(); s && s->cancelled())
+          return true;
+        if (self->waiters_.size() + 1 < self->count_)
+          return false;
+
+        for (auto h : std::exchange(self->waiters_, {}))
+          scheduler::shared().unpark(h);
+        return true;
+      }
+
+      void await_suspend(std::coroutine_handle<> h) const {
+        self->waiters_.push_back(h);
+        scheduler::shared().park(h, scheduler::current(), [b = self, h] {
+          auto &v = b->waiters_;
+          v.erase(std::remove(v.begin(), v.end(), h), v.end());
+        });
+      }
+
+      void await_resume() const { detail::throw_if_cancelled(); }
+    };
+    return awaiter{this};
+  }
+
+private:
+  std::size_t count_;
+  std::vector<std::coroutine_handle<>> waiters_;
+};
+} // namespace runtime
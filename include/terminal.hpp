@@ -1,19 +1,38 @@
 #pragma once
 
+#include <algorithm>
 #include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iostream>
 #include <memory>
-#include <sstream>
+#include <stdexcept>
 #include <string>
 #include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <csignal>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 #include <readline/history.h>
 #include <readline/readline.h>
 
+#include "args.hpp"
 #include "command.hpp"
 #include "completion.hpp"
+#include "console.hpp"
+#include "jobs.hpp"
 
 namespace termctl {
 class terminal final {
@@ -32,15 +51,77 @@ public:
   void register_commands(commands::vec_type &&cmds);
 
   void run(const std::string &name);
-  void stop() noexcept { running_.store(false, std::memory_order_release); }
+  // Runs without a tty: executes the command lines of 'script', then serves
+  // lines written to the 'control' FIFO until stopped. Either may be empty.
+  void run_headless(const std::string &script, const std::string &control);
+  void stop() noexcept {
+    running_.store(false, std::memory_order_release);
+    console::shared().notify(console::wake_event);
+  }
+
+  struct command_line {
+    std::string name;
+    basic_command::exec_args args;
+    bool background = false;
+  };
+
+  // Splits a command line into its words, a trailing '&' marks it to run as
+  // a background job.
+  static command_line parse_line(const std::string &line);
+
+  // Runs a parsed command on the calling thread.
+  void execute(command_line &&cl) {
+    cmds_.execute_command(cl.name, std::move(cl.args));
+  }
+
+  // Parses and executes one command line, a trailing '&' runs it as a
+  // background job.
+  void execute_line(const std::string &line);
 
 private:
   terminal() : running_(false) {
     rl_attempted_completion_function = command_completion;
+    // Generators hand out their matches in order already.
+    rl_sort_completion_matches = 0;
+    rl_completion_display_matches_hook = display_matches;
+  }
+
+#ifndef _WIN32
+  static void line_handler(char *line);
+  static void interrupt_handler(int) {
+    console::shared().notify(console::interrupt_event);
+  }
+
+  void install_line_handler() {
+    if (!handler_installed_) {
+      rl_callback_handler_install(prompt().c_str(), line_handler);
+      handler_installed_ = true;
+    }
+  }
+
+  void remove_line_handler() {
+    if (handler_installed_) {
+      rl_callback_handler_remove();
+      handler_installed_ = false;
+    }
   }
 
+  void handle_interrupt();
+  void print_pending();
+  void run_loop();
+
+  static void stop_handler(int) { shared().stop(); }
+  void serve_control(const std::string &control);
+  void execute_pending(std::string &pending);
+#endif
+
+  void run_script(const std::string &script);
+  void await_foreground();
+
   static char **command_completion(const char *text, int start, int end);
 
+  static void display_matches(char **matches, int num, int max_length);
+
   static char *generic_generator(const char *text, int state) {
     return shared().generator_ ? shared().generator_(text, state) : nullptr;
   }
@@ -48,19 +129,28 @@ private:
   void assign_cmd_generator() noexcept {
     generator_ = std::bind(&basic_completion::generator, cmd_completion_.get(),
                            std::placeholders::_1, std::placeholders::_2);
+    completing_ = cmd_completion_.get();
   }
 
   void assign_param_generator(const std::string &name) {
     generator_ = cmds_.find_param_generator(name);
+    completing_ = cmds_.find_param_completion(name);
   }
 
-  void reset_generator() { generator_ = nullptr; }
+  void reset_generator() {
+    generator_ = nullptr;
+    completing_ = nullptr;
+  }
 
   std::string prompt_;
   commands cmds_;
   basic_completion::ptr cmd_completion_;
   basic_completion::generator_func generator_;
+  // Whose page the last completion listed.
+  basic_completion *completing_ = nullptr;
   std::atomic_bool running_;
+  job::ptr foreground_;
+  bool handler_installed_ = false;
 };
 
 inline char **terminal::command_completion(const char *text, int start,
@@ -82,9 +172,64 @@ inline char **terminal::command_completion(const char *text, int start,
   if (shared().generator_)
     matches = rl_completion_matches(text, generic_generator);
 
+  // Fuzzy matches may share less than what was typed, which readline would
+  // then cut back to; keep the text until there is one match. With more
+  // pages to come, keep it as well, so the next Tab completes the same text.
+  const auto *completing = shared().completing_;
+  const auto more = completing != nullptr && completing->more() > 0;
+  // A last page of one name is listed too, rather than inserted.
+  if (matches != nullptr && matches[1] == nullptr && completing != nullptr &&
+      (more || completing->page() > 0)) {
+    auto *listed = static_cast<char **>(std::malloc(3 * sizeof(char *)));
+    listed[0] = strdup(text);
+    listed[1] = matches[0];
+    listed[2] = nullptr;
+    std::free(matches);
+    matches = listed;
+  }
+  if (matches != nullptr && matches[1] != nullptr &&
+      (more || std::strlen(matches[0]) < std::strlen(text))) {
+    std::free(matches[0]);
+    matches[0] = strdup(text);
+  }
+  // A common prefix standing in for too many names is no whole name.
+  if (completing != nullptr && completing->partial())
+    rl_completion_suppress_append = 1;
+
   return matches;
 }
 
+inline void terminal::display_matches(char **matches, int num,
+                                      int max_length) {
+  auto *completing = shared().completing_;
+  if (completing == nullptr) {
+    rl_crlf();
+    rl_display_match_list(matches, num, max_length);
+    rl_forced_update_display();
+    return;
+  }
+
+  // Segments are listed as what they add, with the names below them.
+  auto labels = std::vector<std::string>();
+  max_length = 0;
+  for (auto i = 1; i <= num; ++i) {
+    labels.push_back(completing->label(matches[i]));
+    max_length = std::max(max_length, int(labels.back().size()));
+  }
+  auto listed = std::vector<char *>{matches[0]};
+  for (auto &label : labels)
+    listed.push_back(label.data());
+  listed.push_back(nullptr);
+
+  rl_crlf();
+  rl_display_match_list(listed.data(), num, max_length);
+  if (const auto more = completing->more(); more > 0)
+    std::fprintf(rl_outstream, "... %zu more, Tab again for the next page\n",
+                 more);
+  completing->shown();
+  rl_forced_update_display();
+}
+
 inline void terminal::register_commands(commands::vec_type &&cmds) {
   auto names = completion::items_type();
   for (auto &cmd : cmds) {
@@ -95,6 +240,46 @@ inline void terminal::register_commands(commands::vec_type &&cmds) {
   cmd_completion_ = completion::make_unique(std::move(names));
 }
 
+inline terminal::command_line terminal::parse_line(const std::string &line) {
+  basic_command::exec_args args = split_args(line);
+  if (args.empty())
+    throw std::invalid_argument("bad input");
+
+  auto cl = command_line{std::move(args.front()), {}, false};
+  args.erase(args.begin());
+
+  if (!args.empty() && args.back() == "&") {
+    cl.background = true;
+    args.pop_back();
+  } else if (!args.empty() && !args.back().empty() &&
+             args.back().back() == '&') {
+    cl.background = true;
+    args.back().pop_back();
+  } else if (args.empty() && cl.name.size() > 1 && cl.name.back() == '&') {
+    cl.background = true;
+    cl.name.pop_back();
+  }
+  cl.args = std::move(args);
+  return cl;
+}
+
+inline void terminal::execute_line(const std::string &line) {
+  auto cl = parse_line(line);
+  // Lines come in on the thread that completes, see basic_completion::touch.
+  if (cmd_completion_)
+    cmd_completion_->touch(cl.name);
+  cmds_.touch(cl.name, cl.args);
+  const auto background = cl.background;
+  auto job = job_table::shared().spawn(
+      line, [this, cl = std::move(cl)]() mutable { execute(std::move(cl)); },
+      background);
+
+  if (background)
+    out() << "[" << job->id() << "] " << line << std::endl;
+  else
+    foreground_ = std::move(job);
+}
+
 inline void terminal::run(const std::string &name) {
   if (running_.load(std::memory_order_acquire)) {
     std::cerr << "Warning: terminal is already running ..." << std::endl;
@@ -103,31 +288,301 @@ inline void terminal::run(const std::string &name) {
     running_.store(true, std::memory_order_release);
   }
 
-  std::unique_ptr<char, decltype(&std::free)> input(nullptr, std::free);
   set_prompt(name);
+#ifndef _WIN32
+  run_loop();
+#else
+  std::unique_ptr<char, decltype(&std::free)> input(nullptr, std::free);
   while (running_.load(std::memory_order_acquire)) {
     try {
       input.reset(readline(prompt().c_str()));
       if (input == nullptr || std::strlen(input.get()) == 0)
         throw std::invalid_argument("input is empty");
 
-      std::istringstream iss(input.get());
-      std::string cmd, arg;
-      basic_command::exec_args args;
-      if (!iss.good())
-        throw std::invalid_argument("bad input");
-
-      iss >> cmd;
-      while (iss >> arg)
-        args.push_back(std::move(arg));
-
       add_history(input.get());
-      cmds_.execute_command(cmd, std::move(args));
+      execute_line(input.get());
+      if (foreground_) {
+        foreground_->wait();
+        foreground_.reset();
+      }
     } catch (const std::exception &e) {
       std::cerr << "Error: " << e.what() << std::endl;
     } catch (...) {
       std::cerr << "Error: unexpected error" << std::endl;
     }
   }
+#endif
+  job_table::shared().stop_all();
+}
+
+inline void terminal::await_foreground() {
+  while (foreground_ && !foreground_->wait_for(std::chrono::milliseconds(100)))
+    if (!running_.load(std::memory_order_acquire))
+      foreground_->request_stop();
+  foreground_.reset();
+}
+
+// One command per line, '#' starts a comment. A failing line is reported and
+// the rest still runs, as a shell script without 'set -e' would.
+inline void terminal::run_script(const std::string &script) {
+  auto is = std::ifstream(script);
+  if (!is)
+    throw std::runtime_error("could not open \"" + script + "\"");
+
+  auto line = std::string();
+  for (auto n = 1; running_.load(std::memory_order_acquire) &&
+                   std::getline(is, line);
+       ++n) {
+    const auto first = line.find_first_not_of(" \t\r");
+    if (first == std::string::npos || line[first] == '#')
+      continue;
+    try {
+      execute_line(line);
+      await_foreground();
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << script << ":" << n << ": " << e.what()
+                << std::endl;
+    }
+  }
+}
+
+inline void terminal::run_headless(const std::string &script,
+                                   const std::string &control) {
+  if (running_.exchange(true, std::memory_order_acq_rel)) {
+    std::cerr << "Warning: terminal is already running ..." << std::endl;
+    return;
+  }
+
+#ifndef _WIN32
+  struct sigaction action = {}, prev_int = {}, prev_term = {};
+  action.sa_handler = stop_handler;
+  sigemptyset(&action.sa_mask);
+  ::sigaction(SIGINT, &action, &prev_int);
+  ::sigaction(SIGTERM, &action, &prev_term);
+#endif
+
+  try {
+    if (!script.empty())
+      run_script(script);
+#ifndef _WIN32
+    serve_control(control);
+#else
+    if (!control.empty())
+      throw std::runtime_error("the control channel needs a POSIX FIFO");
+    while (running_.load(std::memory_order_acquire))
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+#endif
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+  }
+
+  job_table::shared().stop_all();
+#ifndef _WIN32
+  ::sigaction(SIGINT, &prev_int, nullptr);
+  ::sigaction(SIGTERM, &prev_term, nullptr);
+#endif
+}
+
+#ifndef _WIN32
+// Executes the complete lines of 'pending' until one runs in the foreground,
+// the rest waits for it to finish like typed-ahead input does.
+inline void terminal::execute_pending(std::string &pending) {
+  auto pos = std::string::size_type(0);
+  for (auto eol = pending.find('\n'); !foreground_ && eol != std::string::npos;
+       eol = pending.find('\n', pos)) {
+    auto line = pending.substr(pos, eol - pos);
+    pos = eol + 1;
+    if (!line.empty() && line.back() == '\r')
+      line.pop_back();
+    if (line.find_first_not_of(" \t") == std::string::npos)
+      continue;
+    try {
+      execute_line(line);
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+    }
+  }
+  pending.erase(0, pos);
+}
+
+inline void terminal::serve_control(const std::string &control) {
+  auto fd = -1, keep = -1;
+  auto created = false;
+  if (!control.empty()) {
+    struct stat st = {};
+    if (::stat(control.c_str(), &st) == 0) {
+      if (!S_ISFIFO(st.st_mode))
+        throw std::runtime_error("\"" + control + "\" is not a FIFO");
+    } else if (::mkfifo(control.c_str(), 0600) == 0) {
+      created = true;
+    } else {
+      throw std::system_error(errno, std::generic_category(), control);
+    }
+
+    fd = ::open(control.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    // Holding a write end ourselves keeps the FIFO from hanging up every
+    // time a client closes its own.
+    keep = ::open(control.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0 || keep < 0) {
+      const auto error = errno;
+      ::close(fd);
+      ::close(keep);
+      throw std::system_error(error, std::generic_category(), control);
+    }
+  }
+
+  auto &cons = console::shared();
+  auto pending = std::string();
+  while (running_.load(std::memory_order_acquire)) {
+    pollfd fds[] = {{cons.wake_fd(), POLLIN, 0},
+                    {foreground_ ? -1 : fd, POLLIN, 0}};
+    if (::poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "Error: " << std::strerror(errno) << std::endl;
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      char events[64];
+      while (::read(cons.wake_fd(), events, sizeof(events)) > 0)
+        ;
+    }
+
+    if (foreground_ && foreground_->done()) {
+      foreground_.reset();
+      execute_pending(pending);
+    }
+
+    if (fds[1].revents & POLLIN) {
+      char buf[4096];
+      ssize_t n;
+      while ((n = ::read(fd, buf, sizeof(buf))) > 0)
+        pending.append(buf, std::size_t(n));
+      execute_pending(pending);
+    }
+  }
+
+  if (fd >= 0) {
+    ::close(fd);
+    ::close(keep);
+    if (created)
+      ::unlink(control.c_str());
+  }
+}
+
+inline void terminal::line_handler(char *line) {
+  std::unique_ptr<char, decltype(&std::free)> input(line, std::free);
+  auto &term = shared();
+  try {
+    if (input == nullptr) {
+      std::cout << std::endl;
+      term.remove_line_handler();
+      term.stop();
+      return;
+    }
+
+    if (std::strlen(input.get()) == 0)
+      throw std::invalid_argument("input is empty");
+
+    add_history(input.get());
+    term.execute_line(input.get());
+    // The prompt stays hidden until the foreground job has finished.
+    if (term.foreground_)
+      term.remove_line_handler();
+  } catch (const std::exception &e) {
+    std::cerr << "Error: " << e.what() << std::endl;
+  } catch (...) {
+    std::cerr << "Error: unexpected error" << std::endl;
+  }
+}
+
+inline void terminal::handle_interrupt() {
+  if (foreground_) {
+    std::cout << std::endl;
+    foreground_->request_stop();
+    return;
+  }
+
+  // Discard the line being edited and start over, like a shell does.
+  rl_free_line_state();
+  rl_callback_sigcleanup();
+  std::cout << "^C" << std::endl;
+  rl_replace_line("", 0);
+  rl_on_new_line();
+  rl_redisplay();
+}
+
+inline void terminal::print_pending() {
+  auto msgs = console::shared().take();
+  if (msgs.empty())
+    return;
+
+  if (!handler_installed_) {
+    console::write(msgs);
+    return;
+  }
+
+  const auto saved_point = rl_point;
+  std::unique_ptr<char, decltype(&std::free)> saved_line(
+      rl_copy_text(0, rl_end), std::free);
+  rl_save_prompt();
+  rl_replace_line("", 0);
+  rl_redisplay();
+
+  console::write(msgs);
+
+  rl_restore_prompt();
+  rl_replace_line(saved_line.get(), 0);
+  rl_point = saved_point;
+  rl_redisplay();
+}
+
+inline void terminal::run_loop() {
+  struct sigaction action = {}, prev_action = {};
+  action.sa_handler = interrupt_handler;
+  sigemptyset(&action.sa_mask);
+  ::sigaction(SIGINT, &action, &prev_action);
+
+  auto &cons = console::shared();
+  rl_catch_signals = 0;
+  cons.attach();
+  install_line_handler();
+
+  while (running_.load(std::memory_order_acquire)) {
+    pollfd fds[] = {{cons.wake_fd(), POLLIN, 0},
+                    {handler_installed_ ? STDIN_FILENO : -1, POLLIN, 0}};
+    if (::poll(fds, 2, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      std::cerr << "Error: " << std::strerror(errno) << std::endl;
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      char events[64];
+      ssize_t n;
+      while ((n = ::read(cons.wake_fd(), events, sizeof(events))) > 0)
+        if (std::char_traits<char>::find(events, n, console::interrupt_event))
+          handle_interrupt();
+    }
+
+    if (foreground_ && foreground_->done()) {
+      foreground_.reset();
+      print_pending();
+      if (running_.load(std::memory_order_acquire))
+        install_line_handler();
+    }
+
+    print_pending();
+
+    if (fds[1].revents & (POLLIN | POLLHUP))
+      rl_callback_read_char();
+  }
+
+  remove_line_handler();
+  cons.detach();
+  ::sigaction(SIGINT, &prev_action, nullptr);
 }
+#endif
 } // namespace termctl
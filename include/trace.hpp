@@ -0,0 +1,670 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "mapped_file.hpp"
+
+namespace ctf_io {
+struct trace_sample {
+  std::int64_t t_ns = 0;
+  std::string_view item;
+  std::string_view value;
+  // Set by traces that keep numbers in binary.
+  std::optional<double> number;
+};
+
+// Binary trace layout, little endian:
+//
+//   header  "IOTRACE1" | i64 wall clock at start (ns) | i64 period (ns)
+//   'C'     u32 column | u8 type | u16 length | name
+//   'K'     i64 t_min | i64 t_max | u32 blocks, then that many 'B' records
+//   'B'     u32 column | u32 samples | u32 bytes | bit packed payload
+//   'I'     u64 previous 'I' offset | u32 n | n * (i64 t_max, u64 'K' offset)
+//   'E'     u64 last 'I' offset | "IOTRIDX1"
+//
+// Column records all precede the first chunk. Chunks are cut at a common
+// watermark, so every sample of a chunk is later than those of the chunk
+// before it. Times are relative to the start of the recording. In a block
+// timestamps are stored as delta-of-delta and doubles as the XOR of their
+// predecessor, both with variable length codes, so a steadily sampled,
+// slowly changing value takes a few bits per sample.
+namespace trace_format {
+inline constexpr char magic[] = {'I', 'O', 'T', 'R', 'A', 'C', 'E', '1'};
+inline constexpr char index_magic[] = {'I', 'O', 'T', 'R',
+                                       'I', 'D', 'X', '1'};
+inline constexpr std::size_t header_size = 24;
+inline constexpr std::size_t trailer_size = 17;
+
+enum class column_type : std::uint8_t { int_val, double_val, string_val };
+using value_type = std::variant<int, double, std::string>;
+
+class bit_writer final {
+public:
+  // Appends the low 'n' bits of 'v', most significant first.
+  void write(std::uint64_t v, unsigned n) {
+    while (n > 0) {
+      if (used_ == 0)
+        bytes_.push_back(0);
+      const auto room = 8u - used_;
+      const auto take = std::min(n, room);
+      const auto bits = (v >> (n - take)) & ((1u << take) - 1);
+      bytes_.back() |= static_cast<std::uint8_t>(bits << (room - take));
+      used_ = (used_ + take) % 8;
+      n -= take;
+    }
+  }
+
+  void write_bytes(std::string_view s) {
+    for (auto c : s)
+      write(static_cast<unsigned char>(c), 8);
+  }
+
+  const std::vector<std::uint8_t> &bytes() const noexcept { return bytes_; }
+
+  void clear() noexcept {
+    bytes_.clear();
+    used_ = 0;
+  }
+
+private:
+  std::vector<std::uint8_t> bytes_;
+  unsigned used_ = 0;
+};
+
+class bit_reader final {
+public:
+  bit_reader(const std::uint8_t *data, std::size_t size) noexcept
+      : data_(data), bits_(size * 8) {}
+
+  std::uint64_t read(unsigned n) {
+    if (pos_ + n > bits_)
+      throw std::runtime_error("corrupt trace block");
+    auto v = std::uint64_t(0);
+    while (n > 0) {
+      const auto used = unsigned(pos_ % 8);
+      const auto room = 8u - used;
+      const auto take = std::min(n, room);
+      const auto byte = data_[pos_ / 8];
+      v = (v << take) | ((byte >> (room - take)) & ((1u << take) - 1));
+      pos_ += take;
+      n -= take;
+    }
+    return v;
+  }
+
+  void read_bytes(std::string &s, std::size_t n) {
+    s.resize(n);
+    for (auto &c : s)
+      c = static_cast<char>(read(8));
+  }
+
+private:
+  const std::uint8_t *data_;
+  std::size_t bits_;
+  std::size_t pos_ = 0;
+};
+
+// Small values, the common case for delta-of-delta and integer deltas, take
+// a 1 to 4 bit prefix and a short payload.
+inline void write_signed(bit_writer &w, std::int64_t v) {
+  if (v == 0) {
+    w.write(0b0, 1);
+  } else if (v >= -63 && v <= 64) {
+    w.write(0b10, 2);
+    w.write(std::uint64_t(v + 63), 7);
+  } else if (v >= -255 && v <= 256) {
+    w.write(0b110, 3);
+    w.write(std::uint64_t(v + 255), 9);
+  } else if (v >= -2047 && v <= 2048) {
+    w.write(0b1110, 4);
+    w.write(std::uint64_t(v + 2047), 12);
+  } else {
+    w.write(0b1111, 4);
+    w.write(std::uint64_t(v), 64);
+  }
+}
+
+inline std::int64_t read_signed(bit_reader &r) {
+  if (r.read(1) == 0)
+    return 0;
+  if (r.read(1) == 0)
+    return std::int64_t(r.read(7)) - 63;
+  if (r.read(1) == 0)
+    return std::int64_t(r.read(9)) - 255;
+  if (r.read(1) == 0)
+    return std::int64_t(r.read(12)) - 2047;
+  return std::int64_t(r.read(64));
+}
+
+class block_encoder final {
+public:
+  explicit block_encoder(column_type type) : type_(type) {}
+
+  std::uint32_t count() const noexcept { return count_; }
+  const std::vector<std::uint8_t> &bytes() const noexcept {
+    return w_.bytes();
+  }
+
+  void append(std::int64_t t, const value_type &v) {
+    if (count_ == 0) {
+      w_.write(std::uint64_t(t), 64);
+    } else {
+      const auto delta = t - prev_t_;
+      write_signed(w_, delta - prev_delta_);
+      prev_delta_ = delta;
+    }
+    prev_t_ = t;
+
+    switch (type_) {
+    case column_type::int_val: {
+      const auto i = std::int64_t(std::get<int>(v));
+      write_signed(w_, i - prev_int_);
+      prev_int_ = i;
+      break;
+    }
+    case column_type::double_val:
+      append_double(std::bit_cast<std::uint64_t>(std::get<double>(v)));
+      break;
+    case column_type::string_val: {
+      const auto &s = std::get<std::string>(v);
+      if (count_ != 0 && s == prev_str_) {
+        w_.write(0b0, 1);
+      } else {
+        w_.write(0b1, 1);
+        w_.write(s.size(), 32);
+        w_.write_bytes(s);
+        prev_str_ = s;
+      }
+      break;
+    }
+    }
+    ++count_;
+  }
+
+  void clear() noexcept {
+    w_.clear();
+    count_ = 0;
+    prev_t_ = prev_delta_ = prev_int_ = 0;
+    prev_bits_ = 0;
+    leading_ = trailing_ = 0;
+    prev_str_.clear();
+  }
+
+private:
+  void append_double(std::uint64_t bits) {
+    const auto x = bits ^ prev_bits_;
+    prev_bits_ = bits;
+    if (x == 0) {
+      w_.write(0b0, 1);
+      return;
+    }
+
+    const auto leading = std::min(unsigned(std::countl_zero(x)), 31u);
+    const auto trailing = unsigned(std::countr_zero(x));
+    if (count_ != 0 && leading_ + trailing_ != 0 && leading >= leading_ &&
+        trailing >= trailing_) {
+      w_.write(0b10, 2);
+      w_.write(x >> trailing_, 64 - leading_ - trailing_);
+    } else {
+      const auto significant = 64 - leading - trailing;
+      w_.write(0b11, 2);
+      w_.write(leading, 5);
+      w_.write(significant - 1, 6);
+      w_.write(x >> trailing, significant);
+      leading_ = leading;
+      trailing_ = trailing;
+    }
+  }
+
+  column_type type_;
+  bit_writer w_;
+  std::uint32_t count_ = 0;
+  std::int64_t prev_t_ = 0;
+  std::int64_t prev_delta_ = 0;
+  std::int64_t prev_int_ = 0;
+  std::uint64_t prev_bits_ = 0;
+  unsigned leading_ = 0;
+  unsigned trailing_ = 0;
+  std::string prev_str_;
+};
+
+class block_decoder final {
+public:
+  block_decoder(column_type type, const std::uint8_t *data,
+                std::size_t size) noexcept
+      : type_(type), r_(data, size) {}
+
+  void next(std::int64_t &t, value_type &v) {
+    if (index_ == 0) {
+      prev_t_ = std::int64_t(r_.read(64));
+    } else {
+      prev_delta_ += read_signed(r_);
+      prev_t_ += prev_delta_;
+    }
+    t = prev_t_;
+
+    switch (type_) {
+    case column_type::int_val:
+      prev_int_ += read_signed(r_);
+      v = int(prev_int_);
+      break;
+    case column_type::double_val:
+      v = std::bit_cast<double>(next_double());
+      break;
+    case column_type::string_val:
+      if (r_.read(1) == 1)
+        r_.read_bytes(prev_str_, r_.read(32));
+      v = prev_str_;
+      break;
+    }
+    ++index_;
+  }
+
+private:
+  std::uint64_t next_double() {
+    if (r_.read(1) == 0)
+      return prev_bits_;
+
+    if (r_.read(1) == 0) {
+      const auto n = 64 - leading_ - trailing_;
+      prev_bits_ ^= r_.read(n) << trailing_;
+    } else {
+      leading_ = unsigned(r_.read(5));
+      const auto significant = unsigned(r_.read(6)) + 1;
+      trailing_ = 64 - leading_ - significant;
+      prev_bits_ ^= r_.read(significant) << trailing_;
+    }
+    return prev_bits_;
+  }
+
+  column_type type_;
+  bit_reader r_;
+  std::uint32_t index_ = 0;
+  std::int64_t prev_t_ = 0;
+  std::int64_t prev_delta_ = 0;
+  std::int64_t prev_int_ = 0;
+  std::uint64_t prev_bits_ = 0;
+  unsigned leading_ = 0;
+  unsigned trailing_ = 0;
+  std::string prev_str_;
+};
+
+template <typename T> void put(std::string &buf, T v) {
+  char raw[sizeof(T)];
+  std::memcpy(raw, &v, sizeof(T));
+  buf.append(raw, sizeof(T));
+}
+
+template <typename T> T get(std::string_view data, std::size_t &pos) {
+  if (pos + sizeof(T) > data.size())
+    throw std::runtime_error("truncated trace");
+  T v;
+  std::memcpy(&v, data.data() + pos, sizeof(T));
+  pos += sizeof(T);
+  return v;
+}
+} // namespace trace_format
+
+// Appends samples to a binary trace. Samples are buffered per column and
+// written out as one chunk per flush().
+class trace_writer final {
+public:
+  using column_type = trace_format::column_type;
+  using value_type = trace_format::value_type;
+
+  // A seek index record is written every this many chunks.
+  static constexpr std::size_t index_interval = 16;
+
+  trace_writer(const std::filesystem::path &filepath, std::int64_t wall_ns,
+               std::int64_t period_ns)
+      : ofs_(filepath, std::ios::binary | std::ios::trunc) {
+    if (!ofs_.is_open())
+      throw std::runtime_error("cannot open file: " + filepath.string());
+
+    auto buf = std::string(trace_format::magic, sizeof(trace_format::magic));
+    trace_format::put(buf, wall_ns);
+    trace_format::put(buf, period_ns);
+    emit(buf);
+  }
+
+  ~trace_writer() {
+    try {
+      close();
+    } catch (...) {
+    }
+  }
+
+  std::uint32_t add_column(const std::string &name, column_type type) {
+    if (chunks_ != 0)
+      throw std::logic_error("columns must be added before the first chunk");
+
+    const auto id = std::uint32_t(columns_.size());
+    auto buf = std::string(1, 'C');
+    trace_format::put(buf, id);
+    trace_format::put(buf, static_cast<std::uint8_t>(type));
+    trace_format::put(buf, static_cast<std::uint16_t>(name.size()));
+    buf += name;
+    emit(buf);
+    columns_.push_back({trace_format::block_encoder(type), {}});
+    return id;
+  }
+
+  // Samples of a column must come in time order.
+  void append(std::uint32_t column, std::int64_t t, value_type &&v) {
+    columns_[column].pending.emplace_back(t, std::move(v));
+  }
+
+  // Writes every buffered sample up to 'watermark' as one chunk, the rest
+  // stay buffered for the next one.
+  void flush(std::int64_t watermark) {
+    auto buf = std::string();
+    auto t_min = std::numeric_limits<std::int64_t>::max();
+    auto t_max = std::numeric_limits<std::int64_t>::min();
+    auto blocks = std::uint32_t(0);
+    for (std::uint32_t id = 0; id < columns_.size(); ++id) {
+      auto &col = columns_[id];
+      const auto end = std::upper_bound(
+          col.pending.begin(), col.pending.end(), watermark,
+          [](std::int64_t t, const auto &p) { return t < p.first; });
+      if (end == col.pending.begin())
+        continue;
+
+      col.encoder.clear();
+      for (auto it = col.pending.begin(); it != end; ++it)
+        col.encoder.append(it->first, it->second);
+      t_min = std::min(t_min, col.pending.front().first);
+      t_max = std::max(t_max, std::prev(end)->first);
+      col.pending.erase(col.pending.begin(), end);
+
+      const auto &bytes = col.encoder.bytes();
+      buf += 'B';
+      trace_format::put(buf, id);
+      trace_format::put(buf, col.encoder.count());
+      trace_format::put(buf, std::uint32_t(bytes.size()));
+      buf.append(reinterpret_cast<const char *>(bytes.data()), bytes.size());
+      samples_ += col.encoder.count();
+      ++blocks;
+    }
+    if (blocks == 0)
+      return;
+
+    auto head = std::string(1, 'K');
+    trace_format::put(head, t_min);
+    trace_format::put(head, t_max);
+    trace_format::put(head, blocks);
+    index_.emplace_back(t_max, offset_);
+    emit(head);
+    emit(buf);
+    if (++chunks_ % index_interval == 0)
+      write_index();
+    ofs_.flush();
+  }
+
+  // Flushes everything and seals the trace with its index.
+  void close() {
+    if (!ofs_.is_open())
+      return;
+    flush(std::numeric_limits<std::int64_t>::max());
+    write_index();
+
+    auto buf = std::string(1, 'E');
+    trace_format::put(buf, last_index_);
+    buf.append(trace_format::index_magic, sizeof(trace_format::index_magic));
+    emit(buf);
+    ofs_.close();
+  }
+
+  std::uint64_t samples() const noexcept { return samples_; }
+  std::uint64_t bytes() const noexcept { return offset_; }
+  bool good() const noexcept { return ofs_.good(); }
+
+private:
+  struct column {
+    trace_format::block_encoder encoder;
+    std::vector<std::pair<std::int64_t, value_type>> pending;
+  };
+
+  void emit(const std::string &buf) {
+    ofs_.write(buf.data(), std::streamsize(buf.size()));
+    if (!ofs_)
+      throw std::runtime_error("failed to write the trace");
+    offset_ += buf.size();
+  }
+
+  void write_index() {
+    if (index_.empty())
+      return;
+
+    auto buf = std::string(1, 'I');
+    trace_format::put(buf, last_index_);
+    trace_format::put(buf, std::uint32_t(index_.size()));
+    for (const auto &[t, off] : index_) {
+      trace_format::put(buf, t);
+      trace_format::put(buf, off);
+    }
+    last_index_ = offset_;
+    index_.clear();
+    emit(buf);
+  }
+
+  std::ofstream ofs_;
+  std::vector<column> columns_;
+  std::vector<std::pair<std::int64_t, std::uint64_t>> index_;
+  std::uint64_t offset_ = 0;
+  std::uint64_t last_index_ = 0;
+  std::uint64_t chunks_ = 0;
+  std::uint64_t samples_ = 0;
+};
+
+// Streams a binary trace one chunk at a time, in time order.
+class binary_trace final {
+public:
+  using column_type = trace_format::column_type;
+  using value_type = trace_format::value_type;
+
+  static bool is_trace(const std::filesystem::path &filepath) {
+    auto ifs = std::ifstream(filepath, std::ios::binary);
+    char buf[sizeof(trace_format::magic)] = {};
+    ifs.read(buf, sizeof(buf));
+    return ifs &&
+           std::memcmp(buf, trace_format::magic, sizeof(buf)) == 0;
+  }
+
+  explicit binary_trace(const std::filesystem::path &filepath)
+      : file_(filepath) {
+    const auto data = file_.view();
+    if (data.size() < trace_format::header_size ||
+        std::memcmp(data.data(), trace_format::magic,
+                    sizeof(trace_format::magic)) != 0)
+      throw std::invalid_argument("not a trace: " + filepath.string());
+
+    pos_ = sizeof(trace_format::magic);
+    wall_ns_ = trace_format::get<std::int64_t>(data, pos_);
+    period_ns_ = trace_format::get<std::int64_t>(data, pos_);
+    while (pos_ < data.size() && data[pos_] == 'C') {
+      ++pos_;
+      trace_format::get<std::uint32_t>(data, pos_);
+      const auto type = trace_format::get<std::uint8_t>(data, pos_);
+      const auto len = trace_format::get<std::uint16_t>(data, pos_);
+      if (type > std::uint8_t(column_type::string_val) ||
+          pos_ + len > data.size())
+        throw error("corrupt column");
+      columns_.push_back({std::string(data.substr(pos_, len)),
+                          static_cast<column_type>(type)});
+      pos_ += len;
+    }
+    load_index();
+  }
+
+  std::int64_t wall_ns() const noexcept { return wall_ns_; }
+  std::int64_t period_ns() const noexcept { return period_ns_; }
+
+  bool next(trace_sample &s) {
+    while (cursor_ == samples_.size())
+      if (!load_chunk())
+        return false;
+
+    const auto &e = samples_[cursor_++];
+    s.t_ns = e.t;
+    s.item = columns_[e.column].name;
+    s.value = {};
+    s.number.reset();
+    if (auto str = std::get_if<std::string>(&e.value))
+      s.value = *str;
+    else if (auto i = std::get_if<int>(&e.value))
+      s.number = *i;
+    else
+      s.number = std::get<double>(e.value);
+    return true;
+  }
+
+  // Skips to the chunk holding 't', when the trace has an index.
+  void seek(std::int64_t t) {
+    const auto it = std::lower_bound(
+        index_.begin(), index_.end(), t,
+        [](const auto &e, std::int64_t t) { return e.first < t; });
+    if (it == index_.end() || it->second <= chunk_offset_)
+      return;
+    pos_ = it->second;
+    samples_.clear();
+    cursor_ = 0;
+  }
+
+  std::size_t offset() const noexcept { return pos_; }
+  void release(std::size_t offset) noexcept { file_.release(offset); }
+
+  std::invalid_argument error(const std::string &what) const {
+    return std::invalid_argument("offset " + std::to_string(pos_) + ": " +
+                                 what);
+  }
+
+private:
+  // Last timestamp and offset of each chunk.
+  using index_type = std::vector<std::pair<std::int64_t, std::uint64_t>>;
+
+  struct column {
+    std::string name;
+    column_type type;
+  };
+
+  struct entry {
+    std::int64_t t;
+    std::uint32_t column;
+    value_type value;
+  };
+
+  // Follows the chain of index records back from the trailer, which only a
+  // cleanly closed trace has.
+  void load_index() {
+    const auto data = file_.view();
+    if (data.size() < trace_format::header_size + trace_format::trailer_size)
+      return;
+    auto pos = data.size() - trace_format::trailer_size;
+    if (data[pos] != 'E' ||
+        std::memcmp(data.data() + data.size() -
+                        sizeof(trace_format::index_magic),
+                    trace_format::index_magic,
+                    sizeof(trace_format::index_magic)) != 0)
+      return;
+
+    ++pos;
+    auto off = trace_format::get<std::uint64_t>(data, pos);
+    auto records = std::vector<index_type>();
+    while (off != 0 && off < data.size() && data[off] == 'I') {
+      pos = off + 1;
+      off = trace_format::get<std::uint64_t>(data, pos);
+      const auto n = trace_format::get<std::uint32_t>(data, pos);
+      auto &rec = records.emplace_back();
+      for (std::uint32_t i = 0; i < n; ++i) {
+        const auto t = trace_format::get<std::int64_t>(data, pos);
+        rec.emplace_back(t, trace_format::get<std::uint64_t>(data, pos));
+      }
+    }
+    for (auto it = records.rbegin(); it != records.rend(); ++it)
+      index_.insert(index_.end(), it->begin(), it->end());
+  }
+
+  bool load_chunk() {
+    const auto data = file_.view();
+    // The last samples handed out stay valid until the next chunk.
+    std::swap(samples_, previous_);
+    samples_.clear();
+    cursor_ = 0;
+    while (pos_ < data.size()) {
+      const auto tag = data[pos_];
+      const auto start = pos_++;
+      if (tag == 'E') {
+        pos_ = data.size();
+        return false;
+      } else if (tag == 'I') {
+        trace_format::get<std::uint64_t>(data, pos_);
+        const auto n = trace_format::get<std::uint32_t>(data, pos_);
+        pos_ += std::size_t(n) * 16;
+      } else if (tag == 'K') {
+        chunk_offset_ = start;
+        decode_chunk(data);
+        return true;
+      } else {
+        pos_ = start;
+        throw error("unexpected record");
+      }
+    }
+    return false;
+  }
+
+  void decode_chunk(std::string_view data) {
+    trace_format::get<std::int64_t>(data, pos_);
+    trace_format::get<std::int64_t>(data, pos_);
+    const auto blocks = trace_format::get<std::uint32_t>(data, pos_);
+    for (std::uint32_t b = 0; b < blocks; ++b) {
+      if (trace_format::get<char>(data, pos_) != 'B')
+        throw error("expected a block");
+      const auto id = trace_format::get<std::uint32_t>(data, pos_);
+      const auto count = trace_format::get<std::uint32_t>(data, pos_);
+      const auto bytes = trace_format::get<std::uint32_t>(data, pos_);
+      if (id >= columns_.size() || pos_ + bytes > data.size())
+        throw error("corrupt block");
+
+      auto dec = trace_format::block_decoder(
+          columns_[id].type,
+          reinterpret_cast<const std::uint8_t *>(data.data() + pos_), bytes);
+      for (std::uint32_t i = 0; i < count; ++i) {
+        auto &e = samples_.emplace_back();
+        e.column = id;
+        dec.next(e.t, e.value);
+      }
+      pos_ += bytes;
+    }
+
+    // Blocks are time ordered each; merge them into one stream.
+    std::stable_sort(
+        samples_.begin(), samples_.end(),
+        [](const entry &a, const entry &b) { return a.t < b.t; });
+  }
+
+  mapped_file file_;
+  std::size_t pos_ = 0;
+  std::size_t chunk_offset_ = 0;
+  std::int64_t wall_ns_ = 0;
+  std::int64_t period_ns_ = 0;
+  std::vector<column> columns_;
+  index_type index_;
+  std::vector<entry> samples_;
+  std::vector<entry> previous_;
+  std::size_t cursor_ = 0;
+};
+} // namespace ctf_io
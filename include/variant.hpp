@@ -0,0 +1,145 @@
+#pragma once
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+
+#include <ctf_io.h>
+#include <lb/drv_emu.hpp>
+
+#include "conf_parser.hpp"
+#include "console.hpp"
+
+namespace ctf_io {
+class variant final {
+public:
+  using raw_type = std::variant<int, double, std::string>;
+  using item = conf::io_parser::item;
+
+  template <typename T>
+  static constexpr auto is_member_v =
+      std::disjunction_v<std::is_same<T, int>, std::is_same<T, double>,
+                         std::is_same<T, std::string>>;
+
+  variant() = delete;
+  variant(const variant &) = default;
+  variant &operator=(const variant &) = default;
+  variant(variant &&) noexcept = default;
+  variant &operator=(variant &&) noexcept = default;
+  ~variant() = default;
+
+  template <typename T,
+            typename = std::enable_if_t<is_member_v<std::decay_t<T>>>>
+  variant &operator=(T &&val) {
+    set(std::forward<T>(val));
+    return *this;
+  }
+
+  friend std::ostream &operator<<(std::ostream &, const variant &);
+
+  explicit variant(item::data_type type, const std::string &param,
+                   const std::string &val = {}) {
+    reset(type, param, val);
+  }
+
+  void reset(item::data_type type, const std::string &param = {},
+             const std::string &val = {});
+  auto &get() noexcept { return var_; }
+  const auto &get() const noexcept { return var_; }
+
+  template <typename T,
+            typename = std::enable_if_t<is_member_v<std::decay_t<T>>>>
+  void set(T &&val) {
+    var_ = std::forward<T>(val);
+  }
+
+  void set_value_from_str(item::data_type type, const std::string &val);
+
+  bool read() noexcept;
+  bool write() noexcept;
+
+private:
+  raw_type var_;
+  std::string param_;
+};
+
+inline void variant::reset(item::data_type type, const std::string &param,
+                           const std::string &val) {
+  set_value_from_str(type, val);
+  if (!param.empty())
+    std::visit(
+        [&param, this](auto &&v) {
+          using Tv = std::decay_t<decltype(v)>;
+          if constexpr (std::is_same_v<Tv, std::string>)
+            param_ = lb::drv_emulator<char>{}.to_io_name(param.c_str());
+          else
+            param_ = lb::drv_emulator<Tv>{}.to_io_name(param.c_str());
+        },
+        var_);
+}
+
+inline void variant::set_value_from_str(item::data_type type,
+                                        const std::string &val) {
+  switch (type) {
+  case item::data_type::int_val:
+    set(val.empty() ? 0 : std::stoi(val));
+    break;
+  case item::data_type::double_val:
+    set(val.empty() ? 0.0 : std::stod(val));
+    break;
+  case item::data_type::string_val:
+    set(val);
+    break;
+  default:
+    throw std::invalid_argument("unsupported type for variant");
+  }
+}
+
+inline bool variant::read() noexcept {
+  try {
+    auto ret = IO_UNKNOWN_TYPE;
+    if (auto int_ptr = std::get_if<int>(&var_))
+      ret = io_read_int(param_.c_str(), int_ptr);
+    else if (auto double_ptr = std::get_if<double>(&var_))
+      ret = io_read_double(param_.c_str(), double_ptr);
+    else if (auto str_ptr = std::get_if<std::string>(&var_))
+      ret = io_read_string(param_, *str_ptr);
+    return ret == IO_SUCCESS;
+  } catch (const std::exception &e) {
+    termctl::err() << "Error: " << e.what() << std::endl;
+  }
+  return false;
+}
+
+inline bool variant::write() noexcept {
+  try {
+    auto ret = IO_UNKNOWN_TYPE;
+    if (auto int_ptr = std::get_if<int>(&var_))
+      ret = io_write_int(param_.c_str(), *int_ptr);
+    else if (auto double_ptr = std::get_if<double>(&var_))
+      ret = io_write_double(param_.c_str(), *double_ptr);
+    else if (auto str_ptr = std::get_if<std::string>(&var_))
+      ret = io_write_string(param_.c_str(), str_ptr->c_str());
+    return ret == IO_SUCCESS;
+  } catch (const std::exception &e) {
+    termctl::err() << "Error: " << e.what() << std::endl;
+  }
+  return false;
+}
+
+inline std::ostream &operator<<(std::ostream &os, const variant &v) {
+  std::visit(
+      [&os](auto &&val) {
+        using Tv = std::decay_t<decltype(val)>;
+        if constexpr (std::is_same_v<Tv, std::string>)
+          os << val;
+        else
+          os << std::to_string(val);
+      },
+      v.get());
+  return os;
+}
+} // namespace ctf_io
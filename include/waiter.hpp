@@ -0,0 +1,182 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iomanip>
+#include <optional>
+#include <ostream>
+#include <utility>
+#include <vector>
+
+#include "channel.hpp"
+#include "condition.hpp"
+#include "jobs.hpp"
+
+namespace ctf_io {
+struct wait_options {
+  enum class mode_type { all, any };
+
+  mode_type mode = mode_type::all;
+  std::optional<std::chrono::nanoseconds> timeout;
+  // Polling stays within [fast, slow].
+  std::chrono::nanoseconds fast = std::chrono::milliseconds(5);
+  std::chrono::nanoseconds slow = std::chrono::seconds(1);
+};
+
+// Blocks the calling job until its conditions hold, polling every item in
+// one loop. Each item is polled on its own schedule: while it moves towards
+// its target, at half the projected time to reach it, so polls get faster
+// as it comes near; otherwise backing off exponentially.
+class waiter final {
+public:
+  using clock_type = std::chrono::steady_clock;
+
+  waiter(std::vector<std::pair<condition, channel>> &&conds,
+         const wait_options &opts)
+      : opts_(opts) {
+    for (auto &[cond, ch] : conds)
+      points_.push_back({std::move(cond), std::move(ch)});
+  }
+
+  // Returns whether the conditions were met; false on timeout or stop.
+  bool run();
+  void report(std::ostream &os) const;
+
+  // The last reading of each condition, in the order given.
+  const std::optional<double> &value(std::size_t i) const {
+    return points_[i].value;
+  }
+  bool holds(std::size_t i) const { return points_[i].holds; }
+  bool stopped() const noexcept { return stopped_; }
+  std::uint64_t polls() const noexcept { return polls_; }
+
+private:
+  struct point {
+    condition cond;
+    channel ch;
+    std::optional<double> value;
+    clock_type::time_point read_at;
+    clock_type::duration interval{};
+    clock_type::time_point due;
+    bool holds = false;
+  };
+
+  void poll(point &p, clock_type::time_point now);
+  bool met() const noexcept {
+    const auto holds = [](const point &p) { return p.holds; };
+    return opts_.mode == wait_options::mode_type::all
+               ? std::all_of(points_.begin(), points_.end(), holds)
+               : std::any_of(points_.begin(), points_.end(), holds);
+  }
+
+  std::vector<point> points_;
+  wait_options opts_;
+  std::uint64_t polls_ = 0;
+  bool met_ = false;
+  bool stopped_ = false;
+  clock_type::duration elapsed_{};
+};
+
+inline void waiter::poll(point &p, clock_type::time_point now) {
+  using std::chrono::duration_cast;
+  const auto fast = duration_cast<clock_type::duration>(opts_.fast);
+  const auto slow = duration_cast<clock_type::duration>(opts_.slow);
+  const auto v = p.ch.read_double();
+  ++polls_;
+  if (!v) {
+    // Unreadable for now, which is no reason to hammer the server.
+    p.holds = false;
+    p.interval = std::clamp(p.interval * 2, fast, slow);
+  } else if (!p.value) {
+    p.interval = fast;
+  } else {
+    const auto before = p.cond.distance(*p.value);
+    const auto after = p.cond.distance(*v);
+    const auto dt = std::chrono::duration<double>(now - p.read_at).count();
+    if (after < before && dt > 0) {
+      // Approaching: look again halfway to the projected arrival.
+      const auto eta = after / ((before - after) / dt);
+      p.interval = std::clamp(duration_cast<clock_type::duration>(
+                                  std::chrono::duration<double>(eta / 2)),
+                              fast, slow);
+    } else {
+      // Still or moving away, either way nothing to see soon.
+      p.interval = std::min(p.interval * 2, slow);
+    }
+  }
+
+  if (v) {
+    p.holds = p.cond.eval(*v);
+    p.value = v;
+    p.read_at = now;
+  }
+  p.due = now + p.interval;
+}
+
+inline bool waiter::run() {
+  const auto start = clock_type::now();
+  const auto deadline = opts_.timeout
+                            ? start + *opts_.timeout
+                            : clock_type::time_point::max();
+  for (auto &p : points_)
+    p.due = start;
+
+  for (;;) {
+    const auto now = clock_type::now();
+    auto changed = false;
+    for (auto &p : points_)
+      if (p.due <= now) {
+        const auto held = p.holds;
+        poll(p, now);
+        changed = changed || p.holds != held;
+      }
+
+    // A condition met on its own reading may no longer hold for the others,
+    // which were read earlier; 'all' is confirmed on one fresh round.
+    if (changed && met() && opts_.mode == wait_options::mode_type::all &&
+        points_.size() > 1) {
+      const auto again = clock_type::now();
+      for (auto &p : points_)
+        poll(p, again);
+    }
+    if ((met_ = met()))
+      break;
+
+    auto next = deadline;
+    for (const auto &p : points_)
+      next = std::min(next, p.due);
+    if (now >= deadline)
+      break;
+    if (!termctl::this_job::sleep_until(next)) {
+      stopped_ = true;
+      break;
+    }
+  }
+  elapsed_ = clock_type::now() - start;
+  return met_;
+}
+
+inline void waiter::report(std::ostream &os) const {
+  const auto flags = os.flags();
+  const auto precision = os.precision();
+  os << "[" << (met_ ? "OK" : stopped_ ? "STOP" : "FAIL") << "][wait]";
+  for (const auto &p : points_) {
+    os << "[" << p.cond << ": ";
+    if (p.value)
+      os << *p.value;
+    else
+      os << "unread";
+    os << "]";
+  }
+  os << std::fixed << std::setprecision(3)
+     << (met_       ? " met after "
+         : stopped_ ? " stopped after "
+                    : " timed out after ")
+     << std::chrono::duration<double>(elapsed_).count() << "s, " << polls_
+     << " reads";
+  os.flags(flags);
+  os.precision(precision);
+}
+} // namespace ctf_io
@@ -0,0 +1,121 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <optional>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "channel.hpp"
+#include "console.hpp"
+#include "jobs.hpp"
+#include "task.hpp"
+#include "variant.hpp"
+
+namespace ctf_io {
+// Samples items on the calling job's thread and prints those that changed
+// since the tick before. All items are read first, then the changes of a
+// tick are formatted into one block and handed to the console at once.
+class watcher final {
+public:
+  using clock_type = std::chrono::steady_clock;
+
+  watcher(std::vector<channel> &&chs, std::chrono::nanoseconds interval)
+      : interval_(interval) {
+    for (auto &ch : chs)
+      points_.push_back({std::move(ch), std::nullopt});
+  }
+
+  void run();
+  void report(std::ostream &os) const;
+
+private:
+  struct point {
+    channel ch;
+    std::optional<variant::raw_type> last;
+  };
+
+  static std::string timestamp();
+
+  std::vector<point> points_;
+  std::chrono::nanoseconds interval_;
+  runtime::deadline_stats stats_;
+  std::uint64_t changes_ = 0;
+  clock_type::duration elapsed_{};
+};
+
+// Wall clock time of day with milliseconds, e.g. "14:03:07.215".
+inline std::string watcher::timestamp() {
+  const auto now = std::chrono::system_clock::now();
+  const auto t = std::chrono::system_clock::to_time_t(now);
+  const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                      now.time_since_epoch())
+                      .count() %
+                  1000;
+  char buf[16];
+  const auto n =
+      std::strftime(buf, sizeof(buf), "%H:%M:%S", std::localtime(&t));
+  auto s = std::string(buf, n);
+  s += '.';
+  s += char('0' + ms / 100);
+  s += char('0' + ms / 10 % 10);
+  s += char('0' + ms % 10);
+  return s;
+}
+
+inline void watcher::run() {
+  const auto period =
+      std::chrono::duration_cast<clock_type::duration>(interval_);
+  const auto start = clock_type::now();
+  auto values = std::vector<const variant *>(points_.size());
+  auto block = std::ostringstream();
+
+  for (std::int64_t k = 0;; ++k) {
+    const auto deadline = start + period * k;
+    if (!termctl::this_job::sleep_until(deadline))
+      break;
+    auto lateness = clock_type::now() - deadline;
+    if (lateness >= period) {
+      const auto skipped = lateness / period;
+      stats_.miss(std::uint64_t(skipped));
+      k += skipped;
+      lateness -= period * skipped;
+    }
+
+    auto ok = true;
+    for (std::size_t i = 0; i < points_.size(); ++i)
+      ok = (values[i] = points_[i].ch.read()) != nullptr && ok;
+    stats_.record(lateness, ok);
+
+    block.str({});
+    auto stamp = std::optional<std::string>();
+    for (std::size_t i = 0; i < points_.size(); ++i) {
+      auto &p = points_[i];
+      if (values[i] == nullptr || p.last == values[i]->get())
+        continue;
+      p.last = values[i]->get();
+      if (!stamp)
+        stamp = timestamp();
+      block << "[" << *stamp << "][" << p.ch.name() << "] " << *values[i]
+            << "\n";
+      ++changes_;
+    }
+    if (stamp) {
+      termctl::out() << block.str();
+      termctl::out().flush();
+    }
+  }
+  elapsed_ = clock_type::now() - start;
+}
+
+inline void watcher::report(std::ostream &os) const {
+  os << "[STOP][watch] " << points_.size() << " items, " << changes_
+     << " changes";
+  stats_.print(os, std::chrono::duration<double>(elapsed_).count());
+}
+} // namespace ctf_io
@@ -0,0 +1,224 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "channel.hpp"
+#include "task.hpp"
+
+namespace ctf_io {
+struct waveform_params {
+  enum class shape_type { sine, ramp, square, triangle, noise };
+
+  shape_type shape = shape_type::sine;
+  double amp = 1.0;
+  double offset = 0.0;
+  double freq = 1.0;
+  double rate = 10.0;
+  double phase = 0.0;
+
+  static shape_type parse_shape(const std::string &name) {
+    if (name == "sine")
+      return shape_type::sine;
+    else if (name == "ramp")
+      return shape_type::ramp;
+    else if (name == "square")
+      return shape_type::square;
+    else if (name == "triangle")
+      return shape_type::triangle;
+    else if (name == "noise")
+      return shape_type::noise;
+    throw std::invalid_argument("invalid waveform \"" + name + "\"");
+  }
+
+  static const char *shape_to_str(shape_type shape) noexcept {
+    switch (shape) {
+    case shape_type::sine:
+      return "sine";
+    case shape_type::ramp:
+      return "ramp";
+    case shape_type::square:
+      return "square";
+    case shape_type::triangle:
+      return "triangle";
+    default:
+      return "noise";
+    }
+  }
+};
+
+class waveform final : public std::enable_shared_from_this<waveform> {
+public:
+  using ptr = std::shared_ptr<waveform>;
+  using id_type = std::uint32_t;
+  using shape_type = waveform_params::shape_type;
+
+  waveform(id_type id, channel &&ch, const waveform_params &params)
+      : id_(id), ch_(std::move(ch)), params_(params),
+        period_(runtime::rate_period(params.rate)),
+        rng_(std::random_device{}()) {}
+
+  id_type id() const noexcept { return id_; }
+  const channel &get_channel() const noexcept { return ch_; }
+  const waveform_params &params() const noexcept { return params_; }
+  const runtime::deadline_stats &stats() const noexcept { return stats_; }
+
+  double elapsed() const noexcept {
+    return std::chrono::duration<double>(runtime::clock_type::now() - start_)
+        .count();
+  }
+
+  double sample(double t) {
+    constexpr auto two_pi = 6.283185307179586;
+    const auto cycles = params_.freq * t + params_.phase;
+    const auto frac = cycles - std::floor(cycles);
+    auto unit = 0.0;
+    switch (params_.shape) {
+    case shape_type::sine:
+      unit = std::sin(two_pi * cycles);
+      break;
+    case shape_type::ramp:
+      unit = 2.0 * frac - 1.0;
+      break;
+    case shape_type::square:
+      unit = frac < 0.5 ? 1.0 : -1.0;
+      break;
+    case shape_type::triangle:
+      unit = frac < 0.5 ? 4.0 * frac - 1.0 : 3.0 - 4.0 * frac;
+      break;
+    case shape_type::noise:
+      unit = noise_(rng_);
+      break;
+    }
+    return params_.offset + params_.amp * unit;
+  }
+
+  void print(std::ostream &os) const {
+    os << "[" << id_ << "][" << ch_.name() << "]["
+       << waveform_params::shape_to_str(params_.shape)
+       << " amp=" << params_.amp << " offset=" << params_.offset
+       << " freq=" << params_.freq << " rate=" << params_.rate << "Hz]";
+    stats_.print(os, elapsed());
+  }
+
+  void start() { handle_ = runtime::spawn(run(shared_from_this())); }
+  void stop() const {
+    handle_.cancel();
+    handle_.wait_for(std::chrono::seconds(1));
+  }
+
+private:
+  // Ticks fall on start + k * period, so a late tick never shifts the ones
+  // after it; ticks that are already a full period late are skipped.
+  static runtime::task<void> run(ptr self) {
+    const auto period = self->period_;
+    for (std::int64_t k = 0;; ++k) {
+      auto deadline = self->start_ + period * k;
+      co_await runtime::sleep_until(deadline);
+
+      auto lateness = runtime::clock_type::now() - deadline;
+      if (lateness >= period) {
+        const auto skipped = lateness / period;
+        self->stats_.miss(std::uint64_t(skipped));
+        k += skipped;
+        deadline += period * skipped;
+        lateness -= period * skipped;
+      }
+
+      const auto t =
+          std::chrono::duration<double>(deadline - self->start_).count();
+      const auto val = self->sample(t);
+      const auto ok = co_await runtime::offload(
+          [wf = self.get(), val] { return wf->ch_.write(val); });
+      self->stats_.record(lateness, ok);
+    }
+  }
+
+  id_type id_;
+  channel ch_;
+  waveform_params params_;
+  runtime::clock_type::duration period_;
+  std::mt19937 rng_;
+  std::uniform_real_distribution<double> noise_{-1.0, 1.0};
+  runtime::deadline_stats stats_;
+  runtime::time_point start_ = runtime::clock_type::now();
+  runtime::task_handle handle_;
+};
+
+// Every generator is a task on the shared scheduler, so thousands of them
+// share one timer and one thread.
+class waveform_engine final {
+public:
+  using generators_type = std::map<waveform::id_type, waveform::ptr>;
+
+  waveform_engine(const waveform_engine &) = delete;
+  waveform_engine &operator=(const waveform_engine &) = delete;
+
+  static waveform_engine &shared() {
+    static waveform_engine engine_;
+    return engine_;
+  }
+
+  waveform::ptr start(channel &&ch, const waveform_params &params) {
+    if (!ch.writable())
+      throw std::invalid_argument("the item \"" + ch.name() +
+                                  "\" has neither 'pw' nor 'pr'");
+    if (!ch.numeric())
+      throw std::invalid_argument("the item \"" + ch.name() +
+                                  "\" is not numeric");
+
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto wf = std::make_shared<waveform>(next_id_++, std::move(ch), params);
+    generators_.emplace(wf->id(), wf);
+    wf->start();
+    return wf;
+  }
+
+  // Stops generators by id, by item name or "all".
+  std::vector<waveform::ptr> stop(const std::string &which) {
+    auto stopped = std::vector<waveform::ptr>();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (auto it = generators_.begin(); it != generators_.end();)
+        if (which == "all" || which == std::to_string(it->first) ||
+            which == it->second->get_channel().name()) {
+          stopped.push_back(std::move(it->second));
+          it = generators_.erase(it);
+        } else {
+          ++it;
+        }
+    }
+
+    for (const auto &wf : stopped)
+      wf->stop();
+    return stopped;
+  }
+
+  std::vector<waveform::ptr> list() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto vec = std::vector<waveform::ptr>();
+    for (const auto &[id, wf] : generators_)
+      vec.push_back(wf);
+    return vec;
+  }
+
+private:
+  waveform_engine() = default;
+
+  mutable std::mutex mutex_;
+  generators_type generators_;
+  waveform::id_type next_id_ = 1;
+};
+} // namespace ctf_io
@@ -0,0 +1,389 @@
+#include "iotest.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <ctf_io.h>
+
+#include "channel.hpp"
+#include "conf_parser.hpp"
+#include "variant.hpp"
+
+namespace {
+thread_local std::string last_error;
+
+int fail(int status, std::string &&what) {
+  last_error = std::move(what);
+  return status;
+}
+
+// Exceptions must not cross into C.
+template <typename F> int guarded(F &&f) noexcept {
+  try {
+    return f();
+  } catch (const std::exception &e) {
+    return fail(IOTEST_ERROR, e.what());
+  } catch (...) {
+    return fail(IOTEST_ERROR, "unexpected error");
+  }
+}
+
+std::string to_text(const ctf_io::variant &v) {
+  auto os = std::ostringstream();
+  os << v;
+  return os.str();
+}
+
+// Polls its own copies of the channels, so it never races the session. The
+// polling thread shares the state, so a callback may end its own
+// subscription: the thread is then detached and ends once the callback
+// returns.
+class subscription final {
+public:
+  subscription(std::vector<std::pair<iotest_item, ctf_io::channel>> &&chs,
+               std::chrono::microseconds interval, iotest_callback callback,
+               void *user)
+      : state_(std::make_shared<state>(interval, callback, user)) {
+    for (auto &[item, ch] : chs)
+      state_->points.push_back({item, std::move(ch), std::nullopt});
+    thread_ = std::thread([s = state_] { s->run(); });
+  }
+
+  ~subscription() {
+    {
+      std::lock_guard<std::mutex> lock(state_->mutex);
+      state_->stop = true;
+    }
+    state_->cv.notify_all();
+    if (thread_.get_id() == std::this_thread::get_id())
+      thread_.detach();
+    else
+      thread_.join();
+  }
+
+  subscription(const subscription &) = delete;
+  subscription &operator=(const subscription &) = delete;
+
+private:
+  struct point {
+    iotest_item item;
+    ctf_io::channel ch;
+    std::optional<ctf_io::variant::raw_type> last;
+  };
+
+  struct state {
+    state(std::chrono::microseconds interval, iotest_callback callback,
+          void *user)
+        : interval(interval), callback(callback), user(user) {}
+
+    bool stopped() {
+      std::lock_guard<std::mutex> lock(mutex);
+      return stop;
+    }
+
+    void run() {
+      const auto start = std::chrono::steady_clock::now();
+      for (std::int64_t k = 0;; ++k) {
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          if (cv.wait_until(lock, start + interval * k,
+                            [this] { return stop; }))
+            return;
+        }
+        for (auto &p : points) {
+          const auto *v = p.ch.read();
+          if (v == nullptr || p.last == v->get())
+            continue;
+          p.last = v->get();
+          const auto d = ctf_io::channel::to_double(*v);
+          callback(user, p.item,
+                   d ? *d : std::numeric_limits<double>::quiet_NaN(),
+                   to_text(*v).c_str());
+          // The callback may have ended the subscription.
+          if (stopped())
+            return;
+        }
+        // Late ticks are skipped rather than run back to back.
+        const auto behind =
+            (std::chrono::steady_clock::now() - start) / interval;
+        k = std::max<std::int64_t>(k, behind);
+      }
+    }
+
+    std::vector<point> points;
+    std::chrono::microseconds interval;
+    iotest_callback callback;
+    void *user;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stop = false;
+  };
+
+  std::shared_ptr<state> state_;
+  std::thread thread_;
+};
+} // namespace
+
+struct iotest_session {
+  conf::io_parser::shared_ptr parser;
+  std::vector<ctf_io::channel> channels;
+  std::map<std::string, iotest_item> handles;
+  std::map<iotest_subscription, std::unique_ptr<subscription>> subscriptions;
+  iotest_subscription next_subscription = 1;
+
+  ctf_io::channel *find(iotest_item item) {
+    if (item < 0 || std::size_t(item) >= channels.size())
+      return nullptr;
+    return &channels[std::size_t(item)];
+  }
+};
+
+namespace {
+int read_one(ctf_io::channel &ch, double *value) {
+  if (!ch.readable())
+    return fail(IOTEST_IO_FAILED, ch.name() + " has no readback");
+  const auto *v = ch.read();
+  if (v == nullptr)
+    return fail(IOTEST_IO_FAILED, ch.name() + " could not be read");
+  const auto d = ctf_io::channel::to_double(*v);
+  if (!d)
+    return fail(IOTEST_NOT_NUMERIC, ch.name() + " is not numeric");
+  *value = *d;
+  return IOTEST_OK;
+}
+
+int write_one(ctf_io::channel &ch, double value) {
+  if (!ch.writable())
+    return fail(IOTEST_IO_FAILED, ch.name() + " is not writable");
+  if (!ch.numeric())
+    return fail(IOTEST_NOT_NUMERIC, ch.name() + " is not numeric");
+  if (!ch.write(value))
+    return fail(IOTEST_IO_FAILED, ch.name() + " could not be written");
+  return IOTEST_OK;
+}
+} // namespace
+
+extern "C" {
+int iotest_init(void) {
+  if (const auto ret = io_init_client(); ret != IO_SUCCESS)
+    return fail(IOTEST_ERROR, "failed to init the client of IO layer, code: " +
+                                  std::to_string(ret));
+  return IOTEST_OK;
+}
+
+void iotest_uninit(void) { io_uninit_client(); }
+
+const char *iotest_last_error(void) { return last_error.c_str(); }
+
+int iotest_open(const char *conf_path, iotest_session **session) {
+  return guarded([&] {
+    if (session == nullptr)
+      return fail(IOTEST_ERROR, "no session to return");
+    auto s = std::make_unique<iotest_session>();
+    s->parser = conf_path ? conf::io_parser::make_shared(conf_path)
+                          : conf::io_parser::make_shared();
+
+    // Handles follow the names in order, the same on every open. Items the
+    // IO layer cannot hold a value of get none.
+    for (const auto &[name, item] : s->parser->items())
+      if (item.dt != conf::io_parser::item::data_type::unknown)
+        s->handles.emplace(name, 0);
+    for (auto &[name, handle] : s->handles) {
+      handle = iotest_item(s->channels.size());
+      s->channels.emplace_back(*s->parser->find_item(name));
+    }
+    *session = s.release();
+    return int(IOTEST_OK);
+  });
+}
+
+void iotest_close(iotest_session *session) {
+  guarded([&] {
+    delete session;
+    return int(IOTEST_OK);
+  });
+}
+
+size_t iotest_item_count(const iotest_session *session) {
+  return session ? session->channels.size() : 0;
+}
+
+const char *iotest_item_name(const iotest_session *session,
+                             iotest_item item) {
+  if (session == nullptr || item < 0 ||
+      std::size_t(item) >= session->channels.size())
+    return nullptr;
+  return session->channels[std::size_t(item)].name().c_str();
+}
+
+int iotest_resolve(iotest_session *session, const char *name,
+                   iotest_item *item) {
+  return guarded([&] {
+    if (session == nullptr || name == nullptr || item == nullptr)
+      return fail(IOTEST_ERROR, "bad argument");
+    auto it = session->handles.find(name);
+    if (it == session->handles.end())
+      return fail(IOTEST_NOT_FOUND,
+                  std::string("no such item \"") + name + "\"");
+    *item = it->second;
+    return int(IOTEST_OK);
+  });
+}
+
+int iotest_get(iotest_session *session, iotest_item item, double *value) {
+  return guarded([&] {
+    auto *ch = session ? session->find(item) : nullptr;
+    if (ch == nullptr || value == nullptr)
+      return fail(IOTEST_BAD_HANDLE, "bad item handle");
+    return read_one(*ch, value);
+  });
+}
+
+int iotest_get_text(iotest_session *session, iotest_item item, char *buf,
+                    size_t size) {
+  return guarded([&] {
+    auto *ch = session ? session->find(item) : nullptr;
+    if (ch == nullptr || buf == nullptr)
+      return fail(IOTEST_BAD_HANDLE, "bad item handle");
+    const auto *v = ch->readable() ? ch->read() : nullptr;
+    if (v == nullptr)
+      return fail(IOTEST_IO_FAILED, ch->name() + " could not be read");
+    const auto text = to_text(*v);
+    if (text.size() >= size)
+      return fail(IOTEST_TOO_SMALL, "buffer too small for " + ch->name());
+    text.copy(buf, text.size());
+    buf[text.size()] = '\0';
+    return int(IOTEST_OK);
+  });
+}
+
+int iotest_set(iotest_session *session, iotest_item item, double value) {
+  return guarded([&] {
+    auto *ch = session ? session->find(item) : nullptr;
+    if (ch == nullptr)
+      return fail(IOTEST_BAD_HANDLE, "bad item handle");
+    return write_one(*ch, value);
+  });
+}
+
+int iotest_set_text(iotest_session *session, iotest_item item,
+                    const char *value) {
+  return guarded([&] {
+    auto *ch = session ? session->find(item) : nullptr;
+    if (ch == nullptr || value == nullptr)
+      return fail(IOTEST_BAD_HANDLE, "bad item handle");
+    if (!ch->writable())
+      return fail(IOTEST_IO_FAILED, ch->name() + " is not writable");
+    if (!ch->write(std::string(value)))
+      return fail(IOTEST_IO_FAILED, ch->name() + " could not be written");
+    return int(IOTEST_OK);
+  });
+}
+
+int iotest_get_batch(iotest_session *session, const iotest_item *items,
+                     size_t count, double *values, int *status) {
+  return guarded([&] {
+    if (session == nullptr || (count && (items == nullptr || !values)))
+      return fail(IOTEST_ERROR, "bad argument");
+    auto first = int(IOTEST_OK);
+    for (std::size_t i = 0; i < count; ++i) {
+      auto *ch = session->find(items[i]);
+      auto ret = ch ? read_one(*ch, &values[i])
+                    : fail(IOTEST_BAD_HANDLE, "bad item handle");
+      if (ret != IOTEST_OK)
+        values[i] = std::numeric_limits<double>::quiet_NaN();
+      if (status)
+        status[i] = ret;
+      if (first == IOTEST_OK)
+        first = ret;
+    }
+    return first;
+  });
+}
+
+int iotest_set_batch(iotest_session *session, const iotest_item *items,
+                     const double *values, size_t count, int *status) {
+  return guarded([&] {
+    if (session == nullptr || (count && (items == nullptr || !values)))
+      return fail(IOTEST_ERROR, "bad argument");
+    auto first = int(IOTEST_OK);
+    for (std::size_t i = 0; i < count; ++i) {
+      auto *ch = session->find(items[i]);
+      auto ret = ch ? write_one(*ch, values[i])
+                    : fail(IOTEST_BAD_HANDLE, "bad item handle");
+      if (status)
+        status[i] = ret;
+      if (first == IOTEST_OK)
+        first = ret;
+    }
+    return first;
+  });
+}
+
+int iotest_snapshot(iotest_session *session, double *values, size_t count) {
+  return guarded([&] {
+    if (session == nullptr || values == nullptr)
+      return fail(IOTEST_ERROR, "bad argument");
+    if (count < session->channels.size())
+      return fail(IOTEST_TOO_SMALL,
+                  "snapshot needs " +
+                      std::to_string(session->channels.size()) + " values");
+    for (std::size_t i = 0; i < session->channels.size(); ++i) {
+      auto &ch = session->channels[i];
+      const auto d =
+          ch.readable() ? ch.read_double() : std::optional<double>();
+      values[i] = d ? *d : std::numeric_limits<double>::quiet_NaN();
+    }
+    return int(IOTEST_OK);
+  });
+}
+
+int iotest_subscribe(iotest_session *session, const iotest_item *items,
+                     size_t count, uint32_t interval_us,
+                     iotest_callback callback, void *user,
+                     iotest_subscription *sub) {
+  return guarded([&] {
+    if (session == nullptr || items == nullptr || count == 0 ||
+        callback == nullptr || sub == nullptr || interval_us == 0)
+      return fail(IOTEST_ERROR, "bad argument");
+    auto chs = std::vector<std::pair<iotest_item, ctf_io::channel>>();
+    for (std::size_t i = 0; i < count; ++i) {
+      auto *ch = session->find(items[i]);
+      if (ch == nullptr)
+        return fail(IOTEST_BAD_HANDLE, "bad item handle");
+      chs.emplace_back(items[i], ctf_io::channel(ch->get_item()));
+    }
+
+    const auto id = session->next_subscription++;
+    session->subscriptions.emplace(
+        id, std::make_unique<subscription>(
+                std::move(chs), std::chrono::microseconds(interval_us),
+                callback, user));
+    *sub = id;
+    return int(IOTEST_OK);
+  });
+}
+
+int iotest_unsubscribe(iotest_session *session, iotest_subscription sub) {
+  return guarded([&] {
+    if (session == nullptr || session->subscriptions.erase(sub) == 0)
+      return fail(IOTEST_BAD_HANDLE, "no such subscription");
+    return int(IOTEST_OK);
+  });
+}
+}
@@ -1,21 +1,39 @@
+#include <cstdlib>
 #include <iostream>
+#include <memory>
+#include <stdexcept>
 #include <string>
 
 #ifdef CTF_CLI
 #include <map>
+#include <thread>
 
-#include <ctf_io.h>
 #include <ctf_log.h>
 #include <ctf_util.h>
 #endif
 
 #include "conf_parser.hpp"
+#include "iotest.h"
+#include "server.hpp"
+#include "shard.hpp"
 #include "terminal.hpp"
 
 #include "commands_impl.hpp"
 
 constexpr auto term_name = "iotest";
 
+static std::string env_or_empty(const char *name) {
+  const auto *value = std::getenv(name);
+  return value ? value : "";
+}
+
+// IOTEST_HEADLESS=1 runs without the interactive terminal, e.g. when started
+// by ctf_service_manager.
+static bool headless() {
+  const auto value = env_or_empty("IOTEST_HEADLESS");
+  return !value.empty() && value != "0";
+}
+
 int main(int argc, char *argv[]) {
   try {
     auto term_prompt = std::string(term_name);
@@ -46,31 +64,106 @@ int main(int argc, char *argv[]) {
       ctf::CTFTask::exit_task_exp(module_name);
       return EXIT_FAILURE;
     }
-
-    if (auto io_ret = io_init_client(); io_ret != IO_SUCCESS) {
-      CTF_LOG(ctf::CL_ERROR,
-              "[%s] failed to init the client of IO layer, code: %d",
-              module_name, io_ret);
-      ctf::ctf_release_proj_cfg();
-      ctf::CTFTask::exit_task_exp(module_name);
-      return EXIT_FAILURE;
-    }
 #endif
 
     auto &term = termctl::terminal::shared();
     auto ioparser = conf::io_parser::make_shared();
     auto cmds = termctl::commands::make_vec(
         termctl::make_help_command(), termctl::make_exit_command(),
+        termctl::make_jobs_command(), termctl::make_fg_command(),
+        termctl::make_kill_command(), termctl::make_sleep_command(),
         termctl::make_info_command(ioparser),
         termctl::make_get_command(ioparser),
-        termctl::make_set_command(ioparser));
+        termctl::make_set_command(ioparser),
+        termctl::make_wave_command(ioparser),
+        termctl::make_plant_command(ioparser),
+        termctl::make_derive_command(ioparser),
+        termctl::make_echo_command(ioparser),
+        termctl::make_fault_command(ioparser),
+        termctl::make_run_command(ioparser),
+        termctl::make_record_command(ioparser),
+        termctl::make_replay_command(ioparser),
+        termctl::make_capture_command(ioparser),
+        termctl::make_wait_command(ioparser),
+        termctl::make_expect_command(ioparser),
+        termctl::make_expect_file_command(ioparser),
+        termctl::make_watch_command(ioparser),
+        termctl::make_dash_command(ioparser),
+        termctl::make_history_command(ioparser),
+        termctl::make_shard_command(ioparser));
 
     term.register_commands(std::move(cmds));
 
+#ifndef _WIN32
+    // IOTEST_WORKERS=N forks N workers for 'shard' before anything connects
+    // to the IO layer, each worker connects on its own.
+    if (const auto n = env_or_empty("IOTEST_WORKERS"); !n.empty()) {
+      auto init = termctl::shard_pool::hook_type();
+      auto uninit = termctl::shard_pool::hook_type();
+#ifdef CTF_CLI
+      init = [] {
+        if (iotest_init() != IOTEST_OK)
+          throw std::runtime_error(iotest_last_error());
+      };
+      uninit = [] { iotest_uninit(); };
+#endif
+      termctl::shard_pool::shared().start(
+          term, ioparser, termctl::shard_pool::parse_workers(n),
+          termctl::shard_pool::parse_policy(env_or_empty("IOTEST_SHARD_BY")),
+          std::move(init), std::move(uninit));
+    }
+#endif
+
+#ifdef CTF_CLI
+    if (iotest_init() != IOTEST_OK) {
+      CTF_LOG(ctf::CL_ERROR, "[%s] %s", module_name, iotest_last_error());
+#ifndef _WIN32
+      termctl::shard_pool::shared().stop();
+#endif
+      ctf::ctf_release_proj_cfg();
+      ctf::CTFTask::exit_task_exp(module_name);
+      return EXIT_FAILURE;
+    }
+#endif
+
+#ifndef _WIN32
+    // IOTEST_SOCKET serves the same commands to automation clients.
+    auto srv = std::unique_ptr<termctl::server>();
+    if (const auto path = env_or_empty("IOTEST_SOCKET"); !path.empty())
+      srv = std::make_unique<termctl::server>(term, path);
+#endif
+
+    if (headless()) {
+#ifdef CTF_CLI
+      // Up and running as far as the service manager is concerned, its exit
+      // signal stops the daemon like 'exit' on the control channel does.
+      ctf::CTFTask::set_running_flag(module_name);
+      std::thread([&term, module_name] {
+        ctf::CTFTask::wait_exit_signal(module_name);
+        term.stop();
+      }).detach();
+#endif
+      term.run_headless(env_or_empty("IOTEST_STARTUP"),
+                        env_or_empty("IOTEST_CONTROL"));
+#ifndef _WIN32
+      srv.reset();
+      termctl::shard_pool::shared().stop();
+#endif
+#ifdef CTF_CLI
+      iotest_uninit();
+      ctf::CTFTask::exit_task_exp(module_name);
+#endif
+      return EXIT_SUCCESS;
+    }
+
     term.run(term_prompt);
+#ifndef _WIN32
+    srv.reset();
+    termctl::shard_pool::shared().stop();
+#endif
 
 #ifdef CTF_CLI
-    io_uninit_client();
+    iotest_uninit();
     ctf::CTFTask::set_running_flag(module_name);
     ctf::CTFTask::wait_exit_signal(module_name);
     ctf::CTFTask::exit_task_exp(module_name);